@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Per virtual device arena of driver-owned buffers shared with user-space.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#include <linux/genalloc.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+
+#include "gxp-arena.h"
+#include "gxp-dma.h"
+#include "gxp-vd.h"
+
+/*
+ * Maximum size, in bytes, of the memory each virtual device's arena may grow
+ * to. Memory stays allocated and mapped until the virtual device is released.
+ */
+static ulong gxp_arena_max_size = SZ_256M;
+module_param_named(arena_max_size, gxp_arena_max_size, ulong, 0660);
+
+/* Minimum size, in bytes, the arena grows by */
+#define GXP_ARENA_CHUNK_SIZE SZ_2M
+
+struct gxp_arena_chunk {
+	void *vaddr;
+	dma_addr_t daddr;
+	size_t size;
+	struct list_head list;
+};
+
+struct gxp_arena_buffer {
+	dma_addr_t device_address;
+	size_t size;
+	/* The address space the buffer is mmapped through, if any */
+	struct address_space *mapping;
+	struct list_head list;
+};
+
+/* Bitfield of all virtual cores of @vd */
+static uint gxp_arena_core_list(struct gxp_virtual_device *vd)
+{
+	return BIT(vd->num_cores) - 1;
+}
+
+/* Caller must hold arena->lock. */
+static struct gxp_arena_buffer *
+gxp_arena_find_buffer_locked(struct gxp_arena *arena, dma_addr_t device_address)
+{
+	struct gxp_arena_buffer *buffer;
+
+	lockdep_assert_held(&arena->lock);
+
+	list_for_each_entry(buffer, &arena->buffers, list) {
+		if (buffer->device_address == device_address)
+			return buffer;
+	}
+
+	return NULL;
+}
+
+/*
+ * Allocates a chunk of at least @size bytes, mapped to all cores of the arena's
+ * virtual device, and adds it to the arena's pool.
+ *
+ * Caller must hold arena->lock.
+ */
+static int gxp_arena_grow_locked(struct gxp_arena *arena, size_t size)
+{
+	struct gxp_virtual_device *vd = arena->vd;
+	struct gxp_arena_chunk *chunk;
+	int ret;
+
+	lockdep_assert_held(&arena->lock);
+
+	size = max_t(size_t, size, GXP_ARENA_CHUNK_SIZE);
+	if (arena->size + size > gxp_arena_max_size)
+		return -ENOMEM;
+
+	chunk = kzalloc(sizeof(*chunk), GFP_KERNEL);
+	if (!chunk)
+		return -ENOMEM;
+
+	chunk->size = size;
+	chunk->vaddr = gxp_dma_alloc_coherent(vd->gxp, vd,
+					      gxp_arena_core_list(vd), size,
+					      &chunk->daddr, GFP_KERNEL, 0);
+	if (!chunk->vaddr) {
+		ret = -ENOMEM;
+		goto error_free_chunk;
+	}
+
+	ret = gen_pool_add(arena->pool, chunk->daddr, size, -1);
+	if (ret)
+		goto error_free_coherent;
+
+	list_add_tail(&chunk->list, &arena->chunks);
+	arena->size += size;
+
+	return 0;
+
+error_free_coherent:
+	gxp_dma_free_coherent(vd->gxp, vd, gxp_arena_core_list(vd), size,
+			      chunk->vaddr, chunk->daddr);
+error_free_chunk:
+	kfree(chunk);
+	return ret;
+}
+
+int gxp_arena_init(struct gxp_arena *arena, struct gxp_virtual_device *vd)
+{
+	arena->pool = gen_pool_create(PAGE_SHIFT, -1);
+	if (!arena->pool)
+		return -ENOMEM;
+
+	arena->vd = vd;
+	INIT_LIST_HEAD(&arena->chunks);
+	INIT_LIST_HEAD(&arena->buffers);
+	arena->size = 0;
+	mutex_init(&arena->lock);
+
+	return 0;
+}
+
+void gxp_arena_destroy(struct gxp_arena *arena)
+{
+	struct gxp_virtual_device *vd = arena->vd;
+	struct gxp_arena_buffer *buffer, *tmp_buffer;
+	struct gxp_arena_chunk *chunk, *tmp_chunk;
+
+	list_for_each_entry_safe(buffer, tmp_buffer, &arena->buffers, list) {
+		gen_pool_free(arena->pool, buffer->device_address,
+			      buffer->size);
+		list_del(&buffer->list);
+		kfree(buffer);
+	}
+
+	/* The pool must be empty of allocations before it can be destroyed */
+	gen_pool_destroy(arena->pool);
+
+	list_for_each_entry_safe(chunk, tmp_chunk, &arena->chunks, list) {
+		gxp_dma_free_coherent(vd->gxp, vd, gxp_arena_core_list(vd),
+				      chunk->size, chunk->vaddr, chunk->daddr);
+		list_del(&chunk->list);
+		kfree(chunk);
+	}
+	arena->size = 0;
+}
+
+int gxp_arena_alloc(struct gxp_arena *arena, size_t size,
+		    dma_addr_t *device_address)
+{
+	struct gxp_arena_buffer *buffer;
+	unsigned long daddr;
+	int ret;
+
+	if (!size)
+		return -EINVAL;
+	/* Also keeps PAGE_ALIGN() from wrapping a size taken from user-space */
+	if (size > READ_ONCE(gxp_arena_max_size))
+		return -ENOMEM;
+	size = PAGE_ALIGN(size);
+
+	buffer = kzalloc(sizeof(*buffer), GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	mutex_lock(&arena->lock);
+
+	daddr = gen_pool_alloc(arena->pool, size);
+	if (!daddr) {
+		ret = gxp_arena_grow_locked(arena, size);
+		if (ret)
+			goto error_unlock;
+		daddr = gen_pool_alloc(arena->pool, size);
+		if (!daddr) {
+			ret = -ENOMEM;
+			goto error_unlock;
+		}
+	}
+
+	buffer->device_address = daddr;
+	buffer->size = size;
+	list_add(&buffer->list, &arena->buffers);
+
+	mutex_unlock(&arena->lock);
+
+	*device_address = daddr;
+
+	return 0;
+
+error_unlock:
+	mutex_unlock(&arena->lock);
+	kfree(buffer);
+	return ret;
+}
+
+int gxp_arena_free(struct gxp_arena *arena, dma_addr_t device_address)
+{
+	struct gxp_arena_buffer *buffer;
+
+	mutex_lock(&arena->lock);
+
+	buffer = gxp_arena_find_buffer_locked(arena, device_address);
+	if (!buffer) {
+		mutex_unlock(&arena->lock);
+		return -EINVAL;
+	}
+
+	list_del(&buffer->list);
+
+	/*
+	 * Zap any user-space mappings before the buffer's pages can be handed
+	 * out again. Holding `arena->lock` keeps gxp_arena_mmap() from mapping
+	 * the buffer again in the meantime.
+	 */
+	if (buffer->mapping)
+		unmap_mapping_range(buffer->mapping,
+				    GXP_ARENA_MMAP_OFFSET_BASE + device_address,
+				    buffer->size, 1);
+	gen_pool_free(arena->pool, buffer->device_address, buffer->size);
+
+	mutex_unlock(&arena->lock);
+
+	kfree(buffer);
+
+	return 0;
+}
+
+int gxp_arena_mmap(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
+		   struct vm_area_struct *vma)
+{
+	struct gxp_arena *arena;
+	struct gxp_arena_buffer *buffer;
+	u64 offset = (u64)vma->vm_pgoff << PAGE_SHIFT;
+	size_t size = vma->vm_end - vma->vm_start;
+	phys_addr_t phys;
+	size_t i;
+	int ret = 0;
+
+	if (!vd || offset < GXP_ARENA_MMAP_OFFSET_BASE)
+		return -EINVAL;
+	/* Mappings must be shared, or user-space writes would not reach them */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	arena = &vd->arena;
+	mutex_lock(&arena->lock);
+
+	buffer = gxp_arena_find_buffer_locked(
+		arena, offset - GXP_ARENA_MMAP_OFFSET_BASE);
+	if (!buffer || size > buffer->size) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP;
+
+	for (i = 0; i < size; i += PAGE_SIZE) {
+		/*
+		 * As with telemetry buffers, `iommu_iova_to_phys()` on the
+		 * default domain is the only way to find the physical address
+		 * of memory from `dma_alloc_coherent()`.
+		 */
+		phys = iommu_iova_to_phys(iommu_get_domain_for_dev(gxp->dev),
+					  buffer->device_address + i);
+		ret = remap_pfn_range(vma, vma->vm_start + i,
+				      phys >> PAGE_SHIFT, PAGE_SIZE,
+				      vma->vm_page_prot);
+		if (ret)
+			goto out;
+	}
+
+	buffer->mapping = vma->vm_file->f_mapping;
+
+out:
+	mutex_unlock(&arena->lock);
+	return ret;
+}
@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Per virtual device arena of driver-owned buffers shared with user-space.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+#ifndef __GXP_ARENA_H__
+#define __GXP_ARENA_H__
+
+#include <linux/list.h>
+#include <linux/mm_types.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+
+#include "gxp-internal.h"
+
+/*
+ * A buffer's mmap offset is this plus its device address, which is unique
+ * across all virtual devices since every buffer's device address is also
+ * reserved in the default domain.
+ */
+#define GXP_ARENA_MMAP_OFFSET_BASE (1ULL << 40)
+
+struct gen_pool;
+struct gxp_virtual_device;
+
+/*
+ * Buffers allocated from memory which stays mapped in all of a virtual
+ * device's core domains until the virtual device is released, so allocating
+ * a buffer needs neither pinning nor IOMMU work once the arena has grown
+ * large enough.
+ */
+struct gxp_arena {
+	struct gxp_virtual_device *vd;
+	/* Allocates buffers from the device addresses of `chunks` */
+	struct gen_pool *pool;
+	/* `struct gxp_arena_chunk`s the arena has grown by */
+	struct list_head chunks;
+	/* Total size of `chunks` */
+	size_t size;
+	/* `struct gxp_arena_buffer`s currently allocated */
+	struct list_head buffers;
+	/* Protects all of the above */
+	struct mutex lock;
+};
+
+/**
+ * gxp_arena_init() - Initialize an empty arena for a virtual device
+ * @arena: The arena to initialize
+ * @vd: The virtual device whose core domains buffers will be mapped to
+ *
+ * Return:
+ * * 0       - Success
+ * * -ENOMEM - Insufficient memory to create the arena's allocator
+ */
+int gxp_arena_init(struct gxp_arena *arena, struct gxp_virtual_device *vd);
+
+/**
+ * gxp_arena_destroy() - Free an arena and all buffers allocated from it
+ * @arena: The arena to destroy
+ *
+ * Must be called while the virtual device still holds its core domains. User
+ * mappings of the arena's buffers hold a reference to the file owning the
+ * virtual device, so none can remain by the time the virtual device is
+ * released.
+ */
+void gxp_arena_destroy(struct gxp_arena *arena);
+
+/**
+ * gxp_arena_alloc() - Allocate a buffer from an arena
+ * @arena: The arena to allocate from
+ * @size: The size of the buffer; rounded up to a multiple of PAGE_SIZE
+ * @device_address: Set to the buffer's device address on success
+ *
+ * The arena grows if none of its memory is free for @size bytes.
+ *
+ * Return:
+ * * 0       - Success
+ * * -EINVAL - @size is 0
+ * * -ENOMEM - @size exceeds the arena's maximum size, or the arena could not
+ *             grow enough to fit the buffer
+ */
+int gxp_arena_alloc(struct gxp_arena *arena, size_t size,
+		    dma_addr_t *device_address);
+
+/**
+ * gxp_arena_free() - Return a buffer to its arena
+ * @arena: The arena the buffer was allocated from
+ * @device_address: The device address returned by gxp_arena_alloc()
+ *
+ * Any user-space mappings of the buffer are torn down. The buffer's memory
+ * stays mapped for the device, ready to be allocated again.
+ *
+ * Return:
+ * * 0       - Success
+ * * -EINVAL - No buffer of @arena starts at @device_address
+ */
+int gxp_arena_free(struct gxp_arena *arena, dma_addr_t device_address);
+
+/**
+ * gxp_arena_mmap() - Map an arena buffer into user-space
+ * @gxp: The GXP device the buffer was allocated for
+ * @vd: The virtual device of the client mapping the buffer
+ * @vma: A shared vm area whose offset is the buffer's mmap offset
+ *
+ * Buffers are mapped write-combined, so neither the CPU nor the device needs
+ * to sync them.
+ *
+ * Return:
+ * * 0       - Success
+ * * -EINVAL - @vma does not describe a buffer belonging to @vd
+ * * Otherwise - Error returned by `remap_pfn_range()`
+ */
+int gxp_arena_mmap(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
+		   struct vm_area_struct *vma);
+
+#endif /* __GXP_ARENA_H__ */
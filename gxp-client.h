@@ -7,6 +7,7 @@
 #ifndef __GXP_CLIENT_H__
 #define __GXP_CLIENT_H__
 
+#include <linux/atomic.h>
 #include <linux/file.h>
 #include <linux/rwsem.h>
 #include <linux/sched.h>
@@ -16,6 +17,17 @@
 #include "gxp-eventfd.h"
 #include "gxp-vd.h"
 
+/* Counters for the mailbox commands a client submitted with a deadline */
+struct gxp_client_deadline_stats {
+	/* Number of commands submitted with a deadline */
+	atomic64_t commands;
+	/*
+	 * Number of those commands which completed after their deadline, or
+	 * did not complete successfully at all.
+	 */
+	atomic64_t misses;
+};
+
 /* Holds state belonging to a client */
 struct gxp_client {
 	struct list_head list_entry;
@@ -53,6 +65,8 @@ struct gxp_client {
 	 */
 	bool enabled_telemetry_logging;
 	bool enabled_telemetry_tracing;
+
+	struct gxp_client_deadline_stats deadline_stats;
 };
 
 /*
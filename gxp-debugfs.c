@@ -6,10 +6,13 @@
  */
 
 #include <linux/acpm_dvfs.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
 
 #include "gxp-client.h"
 #include "gxp-debug-dump.h"
 #include "gxp-debugfs.h"
+#include "gxp-domain-pool.h"
 #include "gxp-firmware-data.h"
 #include "gxp-firmware.h"
 #include "gxp-internal.h"
@@ -473,6 +476,118 @@ static int gxp_cmu_mux2_get(void *data, u64 *val)
 DEFINE_DEBUGFS_ATTRIBUTE(gxp_cmu_mux2_fops, gxp_cmu_mux2_get, gxp_cmu_mux2_set,
 			 "%llu\n");
 
+static void gxp_create_mailbox_stats_debugfs(struct gxp_dev *gxp)
+{
+	struct dentry *stats_dir, *core_dir;
+	struct gxp_mailbox_stats *stats;
+	char name[16];
+	uint core;
+
+	if (!gxp->mailbox_mgr)
+		return;
+
+	stats_dir = debugfs_create_dir("mailbox_stats", gxp->d_entry);
+	for (core = 0; core < GXP_NUM_CORES; core++) {
+		stats = &gxp->mailbox_mgr->stats[core];
+		snprintf(name, sizeof(name), "core%u", core);
+		core_dir = debugfs_create_dir(name, stats_dir);
+		debugfs_create_u64("resp_queue_full_stalls", 0400, core_dir,
+				   &stats->resp_queue_full_stalls);
+		debugfs_create_u64("resp_queue_space_notifications", 0400,
+				   core_dir, &stats->resp_queue_space_notifications);
+	}
+}
+
+static int gxp_deadline_stats_show(struct seq_file *s, void *unused)
+{
+	struct gxp_dev *gxp = s->private;
+	struct gxp_client *client;
+
+	seq_puts(s, "tgid\tpid\tcommands\tmisses\n");
+
+	mutex_lock(&gxp->client_list_lock);
+	list_for_each_entry(client, &gxp->client_list, list_entry) {
+		seq_printf(s, "%d\t%d\t%lld\t%lld\n", client->tgid,
+			   client->pid,
+			   atomic64_read(&client->deadline_stats.commands),
+			   atomic64_read(&client->deadline_stats.misses));
+	}
+	mutex_unlock(&gxp->client_list_lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(gxp_deadline_stats);
+
+struct gxp_mapping_page_sizes_ctx {
+	struct seq_file *s;
+	struct gxp_client *client;
+};
+
+static void gxp_mapping_page_sizes_show_one(struct gxp_mapping *mapping,
+					    void *data)
+{
+	struct gxp_mapping_page_sizes_ctx *ctx = data;
+	struct seq_file *s = ctx->s;
+	uint order;
+
+	seq_printf(s, "%d\t%pad\t%#zx", ctx->client->tgid,
+		   &mapping->device_address, mapping->size);
+	for (order = 0; order < GXP_MAPPING_NUM_PGSIZE_ORDERS; order++) {
+		if (mapping->pgsize_counts[order])
+			seq_printf(s, "\t%luK:%u", (PAGE_SIZE << order) / SZ_1K,
+				   mapping->pgsize_counts[order]);
+	}
+	seq_putc(s, '\n');
+}
+
+static void gxp_mapping_page_sizes_show_vd(struct seq_file *s,
+					   struct gxp_client *client)
+{
+	struct gxp_mapping_page_sizes_ctx ctx = {
+		.s = s,
+		.client = client,
+	};
+
+	gxp_vd_mapping_for_each(client->vd, gxp_mapping_page_sizes_show_one,
+				&ctx);
+}
+
+static int gxp_mapping_page_sizes_show(struct seq_file *s, void *unused)
+{
+	struct gxp_dev *gxp = s->private;
+	struct gxp_client *client;
+
+	seq_puts(s, "tgid\tdevice_address\tsize\tpage_sizes\n");
+
+	mutex_lock(&gxp->client_list_lock);
+	list_for_each_entry(client, &gxp->client_list, list_entry) {
+		down_read(&client->semaphore);
+		if (client->vd)
+			gxp_mapping_page_sizes_show_vd(s, client);
+		up_read(&client->semaphore);
+	}
+	mutex_unlock(&gxp->client_list_lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(gxp_mapping_page_sizes);
+
+static int gxp_domain_pool_stats_show(struct seq_file *s, void *unused)
+{
+	struct gxp_dev *gxp = s->private;
+	struct gxp_domain_pool_stats stats;
+
+	gxp_domain_pool_get_stats(gxp->domain_pool, &stats);
+	seq_printf(s, "hits: %llu\nmisses: %llu\ntotal: %u\nidle: %u\n",
+		   stats.hits, stats.misses, stats.total, stats.idle);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(gxp_domain_pool_stats);
+
 void gxp_create_debugfs(struct gxp_dev *gxp)
 {
 	gxp->d_entry = debugfs_create_dir("gxp", NULL);
@@ -501,6 +616,13 @@ void gxp_create_debugfs(struct gxp_dev *gxp)
 			    &gxp_cmu_mux1_fops);
 	debugfs_create_file("cmumux2", 0600, gxp->d_entry, gxp,
 			    &gxp_cmu_mux2_fops);
+	gxp_create_mailbox_stats_debugfs(gxp);
+	debugfs_create_file("deadline_stats", 0400, gxp->d_entry, gxp,
+			    &gxp_deadline_stats_fops);
+	debugfs_create_file("mapping_page_sizes", 0400, gxp->d_entry, gxp,
+			    &gxp_mapping_page_sizes_fops);
+	debugfs_create_file("domain_pool_stats", 0400, gxp->d_entry, gxp,
+			    &gxp_domain_pool_stats_fops);
 }
 
 void gxp_remove_debugfs(struct gxp_dev *gxp)
@@ -7,6 +7,7 @@
 
 #include <linux/dma-iommu.h>
 #include <linux/dma-mapping.h>
+#include <linux/genalloc.h>
 #include <linux/iommu.h>
 #include <linux/platform_device.h>
 #include <linux/scatterlist.h>
@@ -14,6 +15,7 @@
 
 #include "gxp-config.h"
 #include "gxp-dma.h"
+#include "gxp-domain-pool.h"
 #include "gxp-iova.h"
 #include "gxp-mapping.h"
 #include "gxp-pm.h"
@@ -134,6 +136,31 @@ static inline int ssmt_init(struct gxp_dev *gxp,
 	return 0;
 }
 
+/*
+ * Returns the virtual cores of @vd whose domains must be updated to map or
+ * unmap a buffer for @virt_core_list. When all cores of @vd share one domain,
+ * updating it once covers every core.
+ */
+static uint gxp_dma_domain_core_list(struct gxp_virtual_device *vd,
+				     uint virt_core_list)
+{
+	if (vd->shared_domain && virt_core_list)
+		return BIT(0);
+	return virt_core_list;
+}
+
+/*
+ * Returns the gather collecting @batch's pending invalidations for the domain
+ * of @virt_core, and marks that domain to be synced with the batch.
+ */
+static struct iommu_iotlb_gather *
+gxp_dma_batch_gather(struct gxp_dma_unmap_batch *batch, uint virt_core)
+{
+	virt_core = ffs(gxp_dma_domain_core_list(batch->vd, BIT(virt_core))) - 1;
+	batch->virt_core_list |= BIT(virt_core);
+	return &batch->gathers[virt_core];
+}
+
 /* Fault handler */
 
 static int sysmmu_fault_handler(struct iommu_fault *fault, void *token)
@@ -177,8 +204,12 @@ int gxp_dma_init(struct gxp_dev *gxp)
 	struct gxp_dma_iommu_manager *mgr;
 	int ret;
 
-	/* GXP can only address 32-bit IOVAs */
-	ret = dma_set_mask_and_coherent(gxp->dev, DMA_BIT_MASK(32));
+	/*
+	 * GXP can only address 32-bit IOVAs. Keep the default domain's IOVAs
+	 * below the range each virtual device allocates its own from.
+	 */
+	BUILD_BUG_ON(GXP_IOVA_VD_PRIVATE_START != BIT_ULL(31));
+	ret = dma_set_mask_and_coherent(gxp->dev, DMA_BIT_MASK(31));
 	if (ret) {
 		dev_err(gxp->dev, "Failed to set DMA mask\n");
 		return ret;
@@ -263,10 +294,18 @@ int gxp_dma_domain_attach_device(struct gxp_dev *gxp,
 {
 	int ret;
 
-	ret = iommu_aux_attach_device(vd->core_domains[virt_core], gxp->dev);
-	if (ret)
-		goto out;
-	gxp_dma_ssmt_program(gxp, vd, virt_core, core);
+	/*
+	 * A shared domain is attached once, for the first of its cores; the
+	 * rest only need their stream IDs routed to it.
+	 */
+	if (!vd->shared_domain || !vd->attached_core_list) {
+		ret = iommu_aux_attach_device(vd->core_domains[virt_core],
+					      gxp->dev);
+		if (ret)
+			goto out;
+	}
+	vd->attached_core_list |= BIT(virt_core);
+	ret = gxp_dma_ssmt_program(gxp, vd, virt_core, core);
 out:
 	return ret;
 }
@@ -274,49 +313,136 @@ out:
 void gxp_dma_domain_detach_device(struct gxp_dev *gxp,
 				  struct gxp_virtual_device *vd, uint virt_core)
 {
+	if (vd->shared_domain) {
+		if (!(vd->attached_core_list & BIT(virt_core)))
+			return;
+		vd->attached_core_list &= ~BIT(virt_core);
+		/* Keep the domain attached for the cores still using it */
+		if (vd->attached_core_list)
+			return;
+	}
+	vd->attached_core_list &= ~BIT(virt_core);
 	iommu_aux_detach_device(vd->core_domains[virt_core], gxp->dev);
 }
 
-int gxp_dma_map_core_resources(struct gxp_dev *gxp,
-			       struct gxp_virtual_device *vd, uint virt_core,
-			       uint core)
+/*
+ * Unmaps the resources every core sees at the same IOVAs from the domain of
+ * @virt_core, deferring the IOTLB invalidation to @batch.
+ */
+static void gxp_dma_unmap_common_resources(struct gxp_dev *gxp,
+					   struct gxp_dma_unmap_batch *batch,
+					   uint virt_core)
+{
+	struct iommu_domain *domain = batch->vd->core_domains[virt_core];
+	struct iommu_iotlb_gather *gather =
+		gxp_dma_batch_gather(batch, virt_core);
+
+	iommu_unmap_fast(domain, gxp->fwdatabuf.daddr, gxp->fwdatabuf.size,
+			 gather);
+	/*
+	 * TODO(b/202213606): A core should only have access to the FW
+	 * of other cores if they're in the same VD, and have the FW
+	 * region unmapped on VD destruction.
+	 */
+	iommu_unmap_fast(domain, gxp->fwbufs[0].daddr,
+			 gxp->fwbufs[0].size * GXP_NUM_CORES, gather);
+	iommu_unmap_fast(domain, GXP_IOVA_SYNC_BARRIERS, SYNC_BARRIERS_SIZE,
+			 gather);
+	iommu_unmap_fast(domain, gxp->regs.daddr, gxp->regs.size, gather);
+}
+
+/*
+ * Maps the resources every core sees at the same IOVAs into the domain of
+ * @virt_core.
+ *
+ * On failure, anything mapped is unmapped again.
+ */
+static int gxp_dma_map_common_resources(struct gxp_dev *gxp,
+					struct gxp_virtual_device *vd,
+					uint virt_core)
 {
+	struct iommu_domain *domain = vd->core_domains[virt_core];
+	struct gxp_dma_unmap_batch batch;
 	int ret;
 
-	ret = iommu_map(vd->core_domains[virt_core], gxp->regs.daddr,
-			gxp->regs.paddr, gxp->regs.size,
-			IOMMU_READ | IOMMU_WRITE);
+	ret = iommu_map(domain, gxp->regs.daddr, gxp->regs.paddr,
+			gxp->regs.size, IOMMU_READ | IOMMU_WRITE);
 	if (ret)
 		goto err;
 	/*
 	 * Firmware expects to access the sync barriers at a separate
 	 * address, lower than the rest of the AURORA_TOP registers.
 	 */
-	ret = iommu_map(vd->core_domains[virt_core], GXP_IOVA_SYNC_BARRIERS,
+	ret = iommu_map(domain, GXP_IOVA_SYNC_BARRIERS,
 			gxp->regs.paddr + SYNC_BARRIERS_TOP_OFFSET,
 			SYNC_BARRIERS_SIZE, IOMMU_READ | IOMMU_WRITE);
 	if (ret)
 		goto err;
-	ret = iommu_map(vd->core_domains[virt_core], gxp->mbx[core].daddr,
-			gxp->mbx[core].paddr + MAILBOX_DEVICE_INTERFACE_OFFSET,
-			gxp->mbx[core].size, IOMMU_READ | IOMMU_WRITE);
-	if (ret)
-		goto err;
 	/*
 	 * TODO(b/202213606): Map FW regions of all cores in a VD for
 	 * each other at VD creation.
 	 */
-	ret = iommu_map(vd->core_domains[virt_core], gxp->fwbufs[0].daddr,
-			gxp->fwbufs[0].paddr,
+	ret = iommu_map(domain, gxp->fwbufs[0].daddr, gxp->fwbufs[0].paddr,
 			gxp->fwbufs[0].size * GXP_NUM_CORES,
 			IOMMU_READ | IOMMU_WRITE);
 	if (ret)
 		goto err;
-	ret = iommu_map(vd->core_domains[virt_core], gxp->fwdatabuf.daddr,
-			gxp->fwdatabuf.paddr, gxp->fwdatabuf.size,
-			IOMMU_READ | IOMMU_WRITE);
+	ret = iommu_map(domain, gxp->fwdatabuf.daddr, gxp->fwdatabuf.paddr,
+			gxp->fwdatabuf.size, IOMMU_READ | IOMMU_WRITE);
 	if (ret)
 		goto err;
+	return 0;
+
+err:
+	/*
+	 * Any resource that hadn't been mapped yet will cause `iommu_unmap()`
+	 * to return immediately, so its safe to try to unmap everything.
+	 */
+	gxp_dma_unmap_batch_init(&batch, vd);
+	gxp_dma_unmap_common_resources(gxp, &batch, virt_core);
+	gxp_dma_unmap_batch_sync(gxp, &batch);
+	return ret;
+}
+
+/*
+ * Unmaps the resources only @core sees from the domain of @virt_core,
+ * deferring the IOTLB invalidation to @batch.
+ */
+static void gxp_dma_unmap_per_core_resources(struct gxp_dev *gxp,
+					     struct gxp_dma_unmap_batch *batch,
+					     uint virt_core, uint core)
+{
+	struct iommu_domain *domain = batch->vd->core_domains[virt_core];
+	struct iommu_iotlb_gather *gather =
+		gxp_dma_batch_gather(batch, virt_core);
+
+	/* Only unmap the TPU mailboxes if they were found on probe */
+	if (gxp->tpu_dev.mbx_paddr) {
+		iommu_unmap_fast(domain,
+				 GXP_IOVA_EXT_TPU_MBX + core * EXT_TPU_MBX_SIZE,
+				 EXT_TPU_MBX_SIZE, gather);
+	}
+	iommu_unmap_fast(domain, gxp->mbx[core].daddr, gxp->mbx[core].size,
+			 gather);
+}
+
+/*
+ * Maps the resources only @core sees into the domain of @virt_core.
+ *
+ * On failure, anything mapped is unmapped again.
+ */
+static int gxp_dma_map_per_core_resources(struct gxp_dev *gxp,
+					  struct gxp_virtual_device *vd,
+					  uint virt_core, uint core)
+{
+	struct gxp_dma_unmap_batch batch;
+	int ret;
+
+	ret = iommu_map(vd->core_domains[virt_core], gxp->mbx[core].daddr,
+			gxp->mbx[core].paddr + MAILBOX_DEVICE_INTERFACE_OFFSET,
+			gxp->mbx[core].size, IOMMU_READ | IOMMU_WRITE);
+	if (ret)
+		return ret;
 	/* Only map the TPU mailboxes if they were found on probe */
 	if (gxp->tpu_dev.mbx_paddr) {
 		ret = iommu_map(
@@ -325,47 +451,152 @@ int gxp_dma_map_core_resources(struct gxp_dev *gxp,
 			gxp->tpu_dev.mbx_paddr +
 				core * EXT_TPU_MBX_SIZE,
 			EXT_TPU_MBX_SIZE, IOMMU_READ | IOMMU_WRITE);
+		if (ret) {
+			gxp_dma_unmap_batch_init(&batch, vd);
+			gxp_dma_unmap_per_core_resources(gxp, &batch,
+							 virt_core, core);
+			gxp_dma_unmap_batch_sync(gxp, &batch);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Unmaps the mailbox windows of physical cores other than @core_list, left in
+ * a pooled domain of @virt_core by its previous user.
+ */
+static void gxp_dma_trim_core_resources(struct gxp_dev *gxp,
+					struct gxp_virtual_device *vd,
+					uint virt_core, uint core_list,
+					struct gxp_domain_resources *res)
+{
+	struct gxp_dma_unmap_batch batch;
+	uint stale = res->core_list & ~core_list;
+	uint core;
+
+	if (!stale)
+		return;
+
+	gxp_dma_unmap_batch_init(&batch, vd);
+	for (core = 0; core < GXP_NUM_CORES; core++) {
+		if (stale & BIT(core))
+			gxp_dma_unmap_per_core_resources(gxp, &batch,
+							 virt_core, core);
+	}
+	gxp_dma_unmap_batch_sync(gxp, &batch);
+	res->core_list &= ~stale;
+}
+
+/*
+ * Maps the fixed resources @core needs into a domain from the domain pool,
+ * skipping any left installed by the domain's previous user.
+ */
+static int gxp_dma_map_pooled_core_resources(struct gxp_dev *gxp,
+					     struct gxp_virtual_device *vd,
+					     uint virt_core, uint core,
+					     struct gxp_domain_resources *res)
+{
+	uint core_list = 0;
+	uint phys_core;
+	int ret;
+
+	if (!res->common_mapped) {
+		ret = gxp_dma_map_common_resources(gxp, vd, virt_core);
 		if (ret)
-			goto err;
+			return ret;
+		res->common_mapped = true;
 	}
-	return ret;
+	if (!(res->core_list & BIT(core))) {
+		ret = gxp_dma_map_per_core_resources(gxp, vd, virt_core, core);
+		if (ret)
+			return ret;
+		res->core_list |= BIT(core);
+	}
+	vd->resource_core_list |= BIT(virt_core);
 
-err:
 	/*
-	 * Attempt to unmap all resources.
-	 * Any resource that hadn't been mapped yet will cause `iommu_unmap()`
-	 * to return immediately, so its safe to try to unmap everything.
+	 * No window of a physical core outside @vd may remain visible to it.
+	 * A shared domain serves all of @vd's cores, so it is only trimmed
+	 * once every one of them has been placed.
 	 */
-	gxp_dma_unmap_core_resources(gxp, vd, virt_core, core);
-	return ret;
+	if (!vd->shared_domain) {
+		gxp_dma_trim_core_resources(gxp, vd, virt_core, BIT(core), res);
+	} else if (vd->resource_core_list == BIT(vd->num_cores) - 1) {
+		for (phys_core = 0; phys_core < GXP_NUM_CORES; phys_core++) {
+			if (gxp->core_to_vd[phys_core] == vd)
+				core_list |= BIT(phys_core);
+		}
+		gxp_dma_trim_core_resources(gxp, vd, virt_core, core_list,
+					    res);
+	}
+
+	return 0;
+}
+
+int gxp_dma_map_core_resources(struct gxp_dev *gxp,
+			       struct gxp_virtual_device *vd, uint virt_core,
+			       uint core)
+{
+	struct gxp_domain_resources *res = gxp_domain_pool_resources(
+		gxp->domain_pool, vd->pooled_domains[virt_core]);
+	/*
+	 * A shared domain only needs the common resources mapped once, for
+	 * the first of its cores.
+	 */
+	bool map_common = !vd->shared_domain || !vd->resource_core_list;
+	struct gxp_dma_unmap_batch batch;
+	int ret;
+
+	if (res)
+		return gxp_dma_map_pooled_core_resources(gxp, vd, virt_core,
+							 core, res);
+
+	if (map_common) {
+		ret = gxp_dma_map_common_resources(gxp, vd, virt_core);
+		if (ret)
+			return ret;
+	}
+	ret = gxp_dma_map_per_core_resources(gxp, vd, virt_core, core);
+	if (ret) {
+		if (map_common) {
+			gxp_dma_unmap_batch_init(&batch, vd);
+			gxp_dma_unmap_common_resources(gxp, &batch, virt_core);
+			gxp_dma_unmap_batch_sync(gxp, &batch);
+		}
+		return ret;
+	}
+	vd->resource_core_list |= BIT(virt_core);
+	return 0;
 }
 
 void gxp_dma_unmap_core_resources(struct gxp_dev *gxp,
 				  struct gxp_virtual_device *vd, uint virt_core,
 				  uint core)
 {
-	/* Only unmap the TPU mailboxes if they were found on probe */
-	if (gxp->tpu_dev.mbx_paddr) {
-		iommu_unmap(vd->core_domains[virt_core],
-			    GXP_IOVA_EXT_TPU_MBX +
-				    core * EXT_TPU_MBX_SIZE,
-			    EXT_TPU_MBX_SIZE);
-	}
-	iommu_unmap(vd->core_domains[virt_core], gxp->fwdatabuf.daddr,
-		    gxp->fwdatabuf.size);
+	struct gxp_dma_unmap_batch batch;
+
+	if (vd->shared_domain && !(vd->resource_core_list & BIT(virt_core)))
+		return;
+
 	/*
-	 * TODO(b/202213606): A core should only have access to the FW
-	 * of other cores if they're in the same VD, and have the FW
-	 * region unmapped on VD destruction.
+	 * Pooled domains keep their resources installed for their next user,
+	 * which unmaps any it should not see.
 	 */
-	iommu_unmap(vd->core_domains[virt_core], gxp->fwbufs[0].daddr,
-		    gxp->fwbufs[0].size * GXP_NUM_CORES);
-	iommu_unmap(vd->core_domains[virt_core], gxp->mbx[core].daddr,
-		    gxp->mbx[core].size);
-	iommu_unmap(vd->core_domains[virt_core], GXP_IOVA_SYNC_BARRIERS,
-		    SYNC_BARRIERS_SIZE);
-	iommu_unmap(vd->core_domains[virt_core], gxp->regs.daddr,
-		    gxp->regs.size);
+	if (gxp_domain_pool_resources(gxp->domain_pool,
+				      vd->pooled_domains[virt_core])) {
+		vd->resource_core_list &= ~BIT(virt_core);
+		return;
+	}
+
+	/* Invalidate the domain's IOTLB once for all the resources */
+	gxp_dma_unmap_batch_init(&batch, vd);
+	gxp_dma_unmap_per_core_resources(gxp, &batch, virt_core, core);
+	vd->resource_core_list &= ~BIT(virt_core);
+	/* Keep the common resources mapped for the cores still using them */
+	if (!vd->shared_domain || !vd->resource_core_list)
+		gxp_dma_unmap_common_resources(gxp, &batch, virt_core);
+	gxp_dma_unmap_batch_sync(gxp, &batch);
 }
 
 static inline struct sg_table *
@@ -495,21 +726,27 @@ void gxp_dma_unmap_tpu_buffer(struct gxp_dev *gxp,
 {
 	uint virt_core_list = mbx_desc.virt_core_list;
 	uint core_list = mbx_desc.phys_core_list;
+	struct gxp_dma_unmap_batch batch;
+	struct iommu_iotlb_gather *gather;
 	u64 queue_iova;
 	int core;
 	uint virt_core;
 
+	gxp_dma_unmap_batch_init(&batch, vd);
 	while (virt_core_list) {
 		virt_core = ffs(virt_core_list) - 1;
 		virt_core_list &= ~BIT(virt_core);
 		core = ffs(core_list) - 1;
 		core_list &= ~BIT(core);
 		queue_iova = GXP_IOVA_TPU_MBX_BUFFER(core);
-		iommu_unmap(vd->core_domains[virt_core], queue_iova,
-			    mbx_desc.cmdq_size);
-		iommu_unmap(vd->core_domains[virt_core], queue_iova +
-			    mbx_desc.cmdq_size, mbx_desc.respq_size);
+		gather = gxp_dma_batch_gather(&batch, virt_core);
+		iommu_unmap_fast(vd->core_domains[virt_core], queue_iova,
+				 mbx_desc.cmdq_size, gather);
+		iommu_unmap_fast(vd->core_domains[virt_core],
+				 queue_iova + mbx_desc.cmdq_size,
+				 mbx_desc.respq_size, gather);
 	}
+	gxp_dma_unmap_batch_sync(gxp, &batch);
 }
 #endif  // (CONFIG_GXP_TEST || CONFIG_ANDROID) && !CONFIG_GXP_GEM5
 
@@ -525,6 +762,8 @@ int gxp_dma_map_allocated_coherent_buffer(struct gxp_dev *gxp, void *buf,
 	int virt_core;
 	ssize_t size_mapped;
 
+	virt_core_list = gxp_dma_domain_core_list(vd, virt_core_list);
+
 	size = size < PAGE_SIZE ? PAGE_SIZE : size;
 	sgt = alloc_sgt_for_buffer(buf, size, mgr->default_domain, dma_handle);
 	if (IS_ERR(sgt)) {
@@ -604,6 +843,7 @@ void gxp_dma_unmap_allocated_coherent_buffer(struct gxp_dev *gxp,
 {
 	int virt_core;
 
+	virt_core_list = gxp_dma_domain_core_list(vd, virt_core_list);
 	size = size < PAGE_SIZE ? PAGE_SIZE : size;
 
 	for (virt_core = 0; virt_core < vd->num_cores; virt_core++) {
@@ -643,6 +883,8 @@ dma_addr_t gxp_dma_map_single(struct gxp_dev *gxp,
 	if (dma_mapping_error(gxp->dev, daddr))
 		return DMA_MAPPING_ERROR;
 
+	virt_core_list = gxp_dma_domain_core_list(vd, virt_core_list);
+
 	paddr = iommu_iova_to_phys(mgr->default_domain, daddr);
 	for (virt_core = 0; virt_core < vd->num_cores; virt_core++) {
 		if (!(virt_core_list & BIT(virt_core)))
@@ -669,6 +911,8 @@ void gxp_dma_unmap_single(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 {
 	int virt_core;
 
+	virt_core_list = gxp_dma_domain_core_list(vd, virt_core_list);
+
 	for (virt_core = 0; virt_core < vd->num_cores; virt_core++) {
 		if (!(virt_core_list & BIT(virt_core)))
 			continue;
@@ -698,6 +942,8 @@ dma_addr_t gxp_dma_map_page(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 	if (dma_mapping_error(gxp->dev, daddr))
 		return DMA_MAPPING_ERROR;
 
+	virt_core_list = gxp_dma_domain_core_list(vd, virt_core_list);
+
 	paddr = iommu_iova_to_phys(mgr->default_domain, daddr);
 	for (virt_core = 0; virt_core < vd->num_cores; virt_core++) {
 		if (!(virt_core_list & BIT(virt_core)))
@@ -723,6 +969,8 @@ void gxp_dma_unmap_page(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 {
 	int virt_core;
 
+	virt_core_list = gxp_dma_domain_core_list(vd, virt_core_list);
+
 	for (virt_core = 0; virt_core < vd->num_cores; virt_core++) {
 		if (!(virt_core_list & BIT(virt_core)))
 			continue;
@@ -748,6 +996,8 @@ dma_addr_t gxp_dma_map_resource(struct gxp_dev *gxp,
 	if (dma_mapping_error(gxp->dev, daddr))
 		return DMA_MAPPING_ERROR;
 
+	virt_core_list = gxp_dma_domain_core_list(vd, virt_core_list);
+
 	for (virt_core = 0; virt_core < vd->num_cores; virt_core++) {
 		if (!(virt_core_list & BIT(virt_core)))
 			continue;
@@ -773,6 +1023,8 @@ void gxp_dma_unmap_resource(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 {
 	int virt_core;
 
+	virt_core_list = gxp_dma_domain_core_list(vd, virt_core_list);
+
 	for (virt_core = 0; virt_core < vd->num_cores; virt_core++) {
 		if (!(virt_core_list & BIT(virt_core)))
 			continue;
@@ -784,26 +1036,79 @@ void gxp_dma_unmap_resource(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 	dma_unmap_resource(gxp->dev, dma_addr, size, direction, attrs);
 }
 
+/* Data for gxp_dma_iova_fit_phase() */
+struct gxp_dma_iova_phase {
+	/* Power of two the IOVA is aligned to, offset by `phase` */
+	unsigned long align;
+	/* Required value of the IOVA modulo `align` */
+	unsigned long phase;
+};
+
+/*
+ * Like gen_pool_first_fit_align(), but returns the first free area whose
+ * address, modulo the alignment, equals the requested phase rather than 0.
+ */
+static unsigned long gxp_dma_iova_fit_phase(unsigned long *map,
+					    unsigned long size,
+					    unsigned long start,
+					    unsigned int nr, void *data,
+					    struct gen_pool *pool,
+					    unsigned long start_addr)
+{
+	struct gxp_dma_iova_phase *iova_phase = data;
+	int order = pool->min_alloc_order;
+	unsigned long align_mask, align_off;
+
+	align_mask = ((iova_phase->align + (1UL << order) - 1) >> order) - 1;
+	align_off = ((start_addr - iova_phase->phase) &
+		     (iova_phase->align - 1)) >> order;
+
+	return bitmap_find_next_zero_area_off(map, size, start, nr, align_mask,
+					      align_off);
+}
+
 int gxp_dma_map_sg(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 		   int virt_core_list, struct scatterlist *sg, int nents,
 		   enum dma_data_direction direction, unsigned long attrs,
 		   uint gxp_dma_flags)
 {
-	int nents_mapped;
+	struct gxp_dma_iova_phase iova_phase;
+	unsigned long pgsize_bitmap;
 	dma_addr_t daddr;
 	int prot = dma_info_to_prot(direction, 0, attrs);
 	int virt_core;
 	ssize_t size_mapped;
-	/* Variables needed to cleanup if an error occurs */
 	struct scatterlist *s;
 	int i;
 	size_t size = 0;
 
-	nents_mapped = dma_map_sg_attrs(gxp->dev, sg, nents, direction, attrs);
-	if (!nents_mapped)
+	for_each_sg(sg, s, nents, i)
+		size += s->length;
+	if (!size)
 		return 0;
 
-	daddr = sg_dma_address(sg);
+	virt_core_list = gxp_dma_domain_core_list(vd, virt_core_list);
+
+	/*
+	 * Offset the IOVA from the largest page size the buffer can use by as
+	 * much as the list's first page is offset from it physically. If the
+	 * buffer starts part-way into a huge page, the huge page boundaries
+	 * which follow then fall on equally aligned IOVAs, and the IOMMU can
+	 * map each of them with a single entry.
+	 */
+	pgsize_bitmap =
+		vd->core_domains[ffs(virt_core_list) - 1]->pgsize_bitmap &
+		GENMASK(__fls(size), 0);
+	iova_phase.align = pgsize_bitmap ? BIT(__fls(pgsize_bitmap)) :
+					   PAGE_SIZE;
+	iova_phase.phase = sg_phys(sg) & (iova_phase.align - 1) & PAGE_MASK;
+	daddr = gen_pool_alloc_algo(vd->iova_pool, size,
+				    gxp_dma_iova_fit_phase, &iova_phase);
+	if (!daddr) {
+		dev_err(gxp->dev, "No IOVA space left to map %zu bytes\n",
+			size);
+		return 0;
+	}
 
 	for (virt_core = 0; virt_core < vd->num_cores; virt_core++) {
 		if (!(virt_core_list & BIT(virt_core)))
@@ -815,20 +1120,29 @@ int gxp_dma_map_sg(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 		 */
 		size_mapped = (ssize_t)iommu_map_sg(vd->core_domains[virt_core],
 						    daddr, sg, nents, prot);
-		if (size_mapped <= 0)
+		if (size_mapped != size)
 			goto err;
 	}
 
-	return nents_mapped;
-
-err:
+	/*
+	 * The list is mapped to contiguous device addresses; record each
+	 * entry's as the DMA API would have.
+	 */
 	for_each_sg(sg, s, nents, i) {
-		size += sg_dma_len(s);
+		sg_dma_address(s) = daddr;
+		sg_dma_len(s) = s->length;
+		daddr += s->length;
 	}
 
+	if (!(attrs & DMA_ATTR_SKIP_CPU_SYNC))
+		gxp_dma_sync_sg_for_device(gxp, sg, nents, direction);
+
+	return nents;
+
+err:
 	for (virt_core -= 1; virt_core >= 0; virt_core--)
 		iommu_unmap(vd->core_domains[virt_core], daddr, size);
-	dma_unmap_sg_attrs(gxp->dev, sg, nents, direction, attrs);
+	gen_pool_free(vd->iova_pool, daddr, size);
 	return 0;
 }
 
@@ -836,6 +1150,31 @@ void gxp_dma_unmap_sg(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 		      uint virt_core_list, struct scatterlist *sg, int nents,
 		      enum dma_data_direction direction, unsigned long attrs)
 {
+	struct gxp_dma_unmap_batch batch;
+
+	gxp_dma_unmap_batch_init(&batch, vd);
+	gxp_dma_unmap_sg_cores(gxp, &batch, virt_core_list, sg, nents);
+	gxp_dma_unmap_batch_sync(gxp, &batch);
+	gxp_dma_unmap_sg_finish(gxp, vd, sg, nents, direction, attrs);
+}
+
+void gxp_dma_unmap_batch_init(struct gxp_dma_unmap_batch *batch,
+			      struct gxp_virtual_device *vd)
+{
+	int virt_core;
+
+	batch->vd = vd;
+	batch->virt_core_list = 0;
+	for (virt_core = 0; virt_core < GXP_NUM_CORES; virt_core++)
+		iommu_iotlb_gather_init(&batch->gathers[virt_core]);
+}
+
+void gxp_dma_unmap_sg_cores(struct gxp_dev *gxp,
+			    struct gxp_dma_unmap_batch *batch,
+			    uint virt_core_list, struct scatterlist *sg,
+			    int nents)
+{
+	struct gxp_virtual_device *vd = batch->vd;
 	struct scatterlist *s;
 	int i;
 	size_t size = 0;
@@ -845,15 +1184,75 @@ void gxp_dma_unmap_sg(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 		size += sg_dma_len(s);
 	}
 
+	virt_core_list = gxp_dma_domain_core_list(vd, virt_core_list);
+
 	for (virt_core = 0; virt_core < vd->num_cores; virt_core++) {
 		if (!(virt_core_list & BIT(virt_core)))
 			continue;
-		if (!iommu_unmap(vd->core_domains[virt_core], sg_dma_address(sg),
-				 size))
+		if (!iommu_unmap_fast(vd->core_domains[virt_core],
+				      sg_dma_address(sg), size,
+				      gxp_dma_batch_gather(batch, virt_core)))
 			dev_warn(gxp->dev, "Failed to unmap sg\n");
 	}
+}
+
+void gxp_dma_unmap_batch_sync(struct gxp_dev *gxp,
+			      struct gxp_dma_unmap_batch *batch)
+{
+	struct gxp_virtual_device *vd = batch->vd;
+	int virt_core;
 
-	dma_unmap_sg_attrs(gxp->dev, sg, nents, direction, attrs);
+	for (virt_core = 0; virt_core < vd->num_cores; virt_core++) {
+		if (!(batch->virt_core_list & BIT(virt_core)))
+			continue;
+		iommu_iotlb_sync(vd->core_domains[virt_core],
+				 &batch->gathers[virt_core]);
+		iommu_iotlb_gather_init(&batch->gathers[virt_core]);
+	}
+	batch->virt_core_list = 0;
+}
+
+void gxp_dma_unmap_sg_finish(struct gxp_dev *gxp,
+			     struct gxp_virtual_device *vd,
+			     struct scatterlist *sg, int nents,
+			     enum dma_data_direction direction,
+			     unsigned long attrs)
+{
+	struct scatterlist *s;
+	int i;
+	size_t size = 0;
+
+	for_each_sg(sg, s, nents, i)
+		size += sg_dma_len(s);
+
+	if (!(attrs & DMA_ATTR_SKIP_CPU_SYNC))
+		gxp_dma_sync_sg_for_cpu(gxp, sg, nents, direction);
+	gen_pool_free(vd->iova_pool, sg_dma_address(sg), size);
+}
+
+void gxp_dma_sync_vd_range(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
+			   uint virt_core_list, dma_addr_t dma_handle,
+			   size_t size, enum dma_data_direction direction,
+			   bool for_cpu)
+{
+	struct iommu_domain *domain =
+		vd->core_domains[ffs(virt_core_list) - 1];
+	struct scatterlist sg;
+	phys_addr_t phys;
+
+	/*
+	 * The range is not mapped in the default domain, so it cannot be
+	 * synced by device address. Sync its pages through a scatterlist,
+	 * which the DMA API maintains by physical address.
+	 */
+	phys = iommu_iova_to_phys(domain, dma_handle);
+	sg_init_table(&sg, 1);
+	sg_set_page(&sg, pfn_to_page(PHYS_PFN(phys)), size,
+		    offset_in_page(phys));
+	if (for_cpu)
+		gxp_dma_sync_sg_for_cpu(gxp, &sg, 1, direction);
+	else
+		gxp_dma_sync_sg_for_device(gxp, &sg, 1, direction);
 }
 
 void gxp_dma_sync_single_for_cpu(struct gxp_dev *gxp, dma_addr_t dma_handle,
@@ -910,6 +1309,8 @@ struct sg_table *gxp_dma_map_dmabuf_attachment(
 		return sgt;
 	}
 
+	virt_core_list = gxp_dma_domain_core_list(vd, virt_core_list);
+
 	/* Map the sgt into the aux domain of all specified cores */
 	for (virt_core = 0; virt_core < vd->num_cores; virt_core++) {
 		if (!(virt_core_list & BIT(virt_core)))
@@ -957,26 +1358,16 @@ void gxp_dma_unmap_dmabuf_attachment(struct gxp_dev *gxp,
 				     struct sg_table *sgt,
 				     enum dma_data_direction direction)
 {
-	struct scatterlist *s;
-	int i;
-	size_t size = 0;
-	int virt_core;
-
-	/* Find the size of the mapping in IOVA-space */
-	for_each_sg(sgt->sgl, s, sgt->nents, i)
-		size += sg_dma_len(s);
+	struct gxp_dma_unmap_batch batch;
 
-	/* Unmap the dma-buf from the aux domain of all specified cores */
-	for (virt_core = 0; virt_core < vd->num_cores; virt_core++) {
-		if (!(virt_core_list & BIT(virt_core)))
-			continue;
-		if (!iommu_unmap(vd->core_domains[virt_core],
-				 sg_dma_address(sgt->sgl), size))
-			dev_warn(
-				gxp->dev,
-				"Failed to unmap dma-buf from virtual core %d\n",
-				virt_core);
-	}
+	/*
+	 * Unmap the dma-buf from the aux domain of all specified cores,
+	 * invalidating each domain's IOTLB once.
+	 */
+	gxp_dma_unmap_batch_init(&batch, vd);
+	gxp_dma_unmap_sg_cores(gxp, &batch, virt_core_list, sgt->sgl,
+			       sgt->nents);
+	gxp_dma_unmap_batch_sync(gxp, &batch);
 
 	/* Unmap the attachment from the default domain */
 	dma_buf_unmap_attachment(attachment, sgt, direction);
@@ -21,6 +21,18 @@ struct gxp_dma_manager {
 	struct rb_root mapping_tree;
 };
 
+/*
+ * IOTLB invalidations pending for the core domains of a virtual device, so a
+ * group of scatter-gather lists can be unmapped with one invalidation per
+ * domain.
+ */
+struct gxp_dma_unmap_batch {
+	struct gxp_virtual_device *vd;
+	/* Bitfield of the virtual cores whose domains have pending unmaps */
+	uint virt_core_list;
+	struct iommu_iotlb_gather gathers[GXP_NUM_CORES];
+};
+
 /*
  * Error value to be returned in place of a dma_addr_t when a mapping fails.
  *
@@ -372,13 +384,18 @@ void gxp_dma_unmap_resource(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
  * @gxp: The GXP device to map the scatter-gather list for
  * @vd: The virtual device including the virtual cores the mapping is for
  * @virt_core_list: A bitfield enumerating the virtual cores the mapping is for
- * @sg: The scatter-gather list of the buffer to be mapped
+ * @sg: The scatter-gather list of the buffer to be mapped; every entry but the
+ *      first must start on a page boundary, and every entry but the last must
+ *      end on one
  * @nents: The number of entries in @sg
  * @direction: DMA direction
  * @attrs: The same set of flags used by the base DMA API
  * @gxp_dma_flags: The type of mapping to create; Currently unused
  *
- * Return: The number of scatter-gather entries mapped to
+ * The list is mapped to contiguous IOVAs allocated from @vd's own IOVA space,
+ * and only into @vd's domains; it is not mapped in the default domain.
+ *
+ * Return: The number of scatter-gather entries mapped to, or 0 on failure
  *
  * The caller must make sure @vd will not be released for the duration of the
  * call.
@@ -405,6 +422,76 @@ void gxp_dma_unmap_sg(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 		      uint virt_core_list, struct scatterlist *sg, int nents,
 		      enum dma_data_direction direction, unsigned long attrs);
 
+/**
+ * gxp_dma_unmap_batch_init() - Start a batch of scatter-gather list unmaps
+ * @batch: The batch to initialize
+ * @vd: The virtual device all lists unmapped in @batch were mapped for
+ */
+void gxp_dma_unmap_batch_init(struct gxp_dma_unmap_batch *batch,
+			      struct gxp_virtual_device *vd);
+
+/**
+ * gxp_dma_unmap_sg_cores() - Unmap a scatter-gather list from the core domains
+ *                            without invalidating their IOTLBs
+ * @gxp: The GXP device the scatter-gather list was mapped for
+ * @batch: The batch collecting the IOTLB invalidations to perform
+ * @virt_core_list: A bitfield enumerating the virtual cores the mapping was for
+ * @sg: The scatter-gather list to unmap; The same one passed to
+ *      `gxp_dma_map_sg()`
+ * @nents: The number of entries in @sg; Same value passed to `gxp_dma_map_sg()`
+ *
+ * The cores may keep accessing the buffer until gxp_dma_unmap_batch_sync() is
+ * called for @batch, after which gxp_dma_unmap_sg_finish() must be called.
+ */
+void gxp_dma_unmap_sg_cores(struct gxp_dev *gxp,
+			    struct gxp_dma_unmap_batch *batch,
+			    uint virt_core_list, struct scatterlist *sg,
+			    int nents);
+
+/**
+ * gxp_dma_unmap_batch_sync() - Invalidate the IOTLBs for a batch of unmaps
+ * @gxp: The GXP device the batch's virtual device belongs to
+ * @batch: The batch to complete
+ *
+ * Each core domain with pending unmaps in @batch is invalidated once.
+ */
+void gxp_dma_unmap_batch_sync(struct gxp_dev *gxp,
+			      struct gxp_dma_unmap_batch *batch);
+
+/**
+ * gxp_dma_unmap_sg_finish() - Release a scatter-gather list's device addresses
+ * @gxp: The GXP device the scatter-gather list was mapped for
+ * @vd: The virtual device the scatter-gather list was mapped for
+ * @sg: The scatter-gather list to unmap; The same one passed to
+ *      `gxp_dma_map_sg()`
+ * @nents: The number of entries in @sg; Same value passed to `gxp_dma_map_sg()`
+ * @direction: DMA direction; Same as passed to `gxp_dma_map_sg()`
+ * @attrs: The same set of flags used by the base DMA API
+ *
+ * Must only be called once @sg has been unmapped with gxp_dma_unmap_sg_cores()
+ * and the batch it was unmapped in has been synced.
+ */
+void gxp_dma_unmap_sg_finish(struct gxp_dev *gxp,
+			     struct gxp_virtual_device *vd,
+			     struct scatterlist *sg, int nents,
+			     enum dma_data_direction direction,
+			     unsigned long attrs);
+
+/**
+ * gxp_dma_sync_vd_range() - Sync part of a scatter-gather list mapping
+ * @gxp: The GXP device the mapping was created for
+ * @vd: The virtual device the mapping was created for
+ * @virt_core_list: The bitfield of virtual cores passed to `gxp_dma_map_sg()`
+ * @dma_handle: The device address of the range, mapped by `gxp_dma_map_sg()`
+ * @size: The size of the range, which must be physically contiguous
+ * @direction: DMA direction
+ * @for_cpu: True to sync for CPU access, false to sync for device access
+ */
+void gxp_dma_sync_vd_range(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
+			   uint virt_core_list, dma_addr_t dma_handle,
+			   size_t size, enum dma_data_direction direction,
+			   bool for_cpu);
+
 /**
  * gxp_dma_sync_single_for_cpu() - Sync buffer for reading by the CPU
  * @gxp: The GXP device the mapping was created for
@@ -6,11 +6,31 @@
  */
 
 #include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/dma-resv.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
 #include <linux/scatterlist.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
 
 #include "gxp-dma.h"
 #include "gxp-dmabuf.h"
+#include "gxp-vd.h"
+
+/*
+ * Maximum number of unmapped dma-buf mappings each virtual device keeps for
+ * reuse. Each holds a reference to its dma-buf. 0 disables the cache.
+ */
+static uint gxp_dmabuf_cache_size = 16;
+module_param_named(dmabuf_cache_size, gxp_dmabuf_cache_size, uint, 0660);
+
+/*
+ * Maximum size, in bytes, of each buffer allocated by gxp_dmabuf_export().
+ * The memory is charged to the allocating process's memory cgroup.
+ */
+static ulong gxp_dmabuf_export_max_size = SZ_256M;
+module_param_named(export_max_size, gxp_dmabuf_export_max_size, ulong, 0660);
 
 struct gxp_dmabuf_mapping {
 	struct gxp_mapping mapping;
@@ -27,50 +47,345 @@ struct gxp_dmabuf_mapping {
 	 * `sg_table` pointer here and ignore `mapping->sgt`.
 	 */
 	struct sg_table *sgt;
+	/*
+	 * Whether the attachment is pinned. Mappings are pinned while stored
+	 * in their VD's records, and unpinned while in its dma-buf cache, so
+	 * the exporter remains free to move dma-bufs nobody is using.
+	 *
+	 * `pinned` and `sgt` are protected by the dma-buf's reservation lock.
+	 * `sgt` is cleared once the dma-buf has been unmapped because it moved.
+	 */
+	bool pinned;
+};
+
+/*
+ * Called with the dma-buf's reservation lock held when its exporter moves it.
+ * Only unpinned, and so cached, mappings can be moved; they are unmapped right
+ * away, and released the next time their cache is searched or trimmed.
+ */
+static void gxp_dmabuf_move_notify(struct dma_buf_attachment *attachment)
+{
+	struct gxp_dmabuf_mapping *dmabuf_mapping = attachment->importer_priv;
+	struct gxp_mapping *mapping = &dmabuf_mapping->mapping;
+
+	if (WARN_ON(dmabuf_mapping->pinned) || !dmabuf_mapping->sgt)
+		return;
+
+	gxp_dma_unmap_dmabuf_attachment(mapping->gxp, mapping->vd,
+					mapping->virt_core_list, attachment,
+					dmabuf_mapping->sgt, mapping->dir);
+	WRITE_ONCE(dmabuf_mapping->sgt, NULL);
+}
+
+/* A buffer allocated by the driver and exported by gxp_dmabuf_export() */
+struct gxp_dmabuf_export {
+	struct gxp_dev *gxp;
+	struct page **pages;
+	size_t page_count;
+	/* Attachments to the exported dma-buf */
+	struct list_head attachments;
+	/* Protects `attachments` and their `mapped` state */
+	struct mutex lock;
+};
+
+struct gxp_dmabuf_export_attachment {
+	struct device *dev;
+	/* Each attachment maps its own copy of the buffer's pages */
+	struct sg_table sgt;
+	enum dma_data_direction dir;
+	bool mapped;
+	struct list_head list;
+};
+
+/*
+ * Page orders the buffer is allocated with, largest first. Large pages let the
+ * buffer be mapped with fewer IOMMU entries, by this driver and by importers.
+ */
+static const unsigned int gxp_dmabuf_export_orders[] = { 9, 4, 0 };
+
+static const struct dma_buf_attach_ops gxp_dmabuf_attach_ops = {
+	.move_notify = gxp_dmabuf_move_notify,
 };
 
+static struct gxp_dmabuf_mapping *to_dmabuf_mapping(struct gxp_mapping *mapping)
+{
+	return container_of(mapping, struct gxp_dmabuf_mapping, mapping);
+}
+
 /* Mapping destructor for gxp_mapping_put() to call */
 static void destroy_dmabuf_mapping(struct gxp_mapping *mapping)
 {
-	struct gxp_dmabuf_mapping *dmabuf_mapping;
+	struct gxp_dmabuf_mapping *dmabuf_mapping = to_dmabuf_mapping(mapping);
 	struct gxp_dev *gxp = mapping->gxp;
 	struct gxp_virtual_device *vd = mapping->vd;
 
-	/* Unmap and detach the dma-buf */
-	dmabuf_mapping =
-		container_of(mapping, struct gxp_dmabuf_mapping, mapping);
-
-	gxp_dma_unmap_dmabuf_attachment(gxp, vd, mapping->virt_core_list,
-					dmabuf_mapping->attachment,
-					dmabuf_mapping->sgt, mapping->dir);
+	/* Unmap and detach the dma-buf, unless it was unmapped when moved */
+	dma_resv_lock(dmabuf_mapping->dmabuf->resv, NULL);
+	if (dmabuf_mapping->sgt)
+		gxp_dma_unmap_dmabuf_attachment(gxp, vd,
+						mapping->virt_core_list,
+						dmabuf_mapping->attachment,
+						dmabuf_mapping->sgt,
+						mapping->dir);
+	if (dmabuf_mapping->pinned)
+		dma_buf_unpin(dmabuf_mapping->attachment);
+	dma_resv_unlock(dmabuf_mapping->dmabuf->resv);
 	dma_buf_detach(dmabuf_mapping->dmabuf, dmabuf_mapping->attachment);
 	dma_buf_put(dmabuf_mapping->dmabuf);
 
-	kfree(dmabuf_mapping);
+	kfree_rcu(dmabuf_mapping, mapping.rcu);
 }
 
-struct gxp_mapping *gxp_dmabuf_map(struct gxp_dev *gxp,
-				   struct gxp_virtual_device *vd,
-				   uint virt_core_list, int fd, u32 flags,
-				   enum dma_data_direction dir)
+/* Whether @mapping was unmapped because its dma-buf moved */
+static bool gxp_dmabuf_mapping_is_stale(struct gxp_mapping *mapping)
+{
+	return !READ_ONCE(to_dmabuf_mapping(mapping)->sgt);
+}
+
+/*
+ * Pins a cached mapping so it can be used again. Fails if the mapping was
+ * unmapped because its dma-buf moved.
+ */
+static int gxp_dmabuf_mapping_pin(struct gxp_mapping *mapping)
+{
+	struct gxp_dmabuf_mapping *dmabuf_mapping = to_dmabuf_mapping(mapping);
+	struct dma_buf *dmabuf = dmabuf_mapping->dmabuf;
+	int ret = -ENOENT;
+
+	dma_resv_lock(dmabuf->resv, NULL);
+	if (dmabuf_mapping->sgt) {
+		ret = dma_buf_pin(dmabuf_mapping->attachment);
+		dmabuf_mapping->pinned = !ret;
+	}
+	dma_resv_unlock(dmabuf->resv);
+
+	return ret;
+}
+
+static void gxp_dmabuf_mapping_unpin(struct gxp_mapping *mapping)
+{
+	struct gxp_dmabuf_mapping *dmabuf_mapping = to_dmabuf_mapping(mapping);
+	struct dma_buf *dmabuf = dmabuf_mapping->dmabuf;
+
+	dma_resv_lock(dmabuf->resv, NULL);
+	dma_buf_unpin(dmabuf_mapping->attachment);
+	dmabuf_mapping->pinned = false;
+	dma_resv_unlock(dmabuf->resv);
+}
+
+/*
+ * Moves stale mappings, and then the least recently cached ones, from @cache
+ * to @evicted until at most @target mappings are left in @cache.
+ *
+ * Caller must hold cache->lock.
+ */
+static void gxp_dmabuf_cache_evict_locked(struct gxp_dmabuf_cache *cache,
+					  uint target,
+					  struct list_head *evicted)
+{
+	struct gxp_mapping *mapping, *tmp;
+
+	lockdep_assert_held(&cache->lock);
+
+	list_for_each_entry_safe(mapping, tmp, &cache->lru, cache_entry) {
+		if (gxp_dmabuf_mapping_is_stale(mapping)) {
+			list_move_tail(&mapping->cache_entry, evicted);
+			cache->count--;
+		}
+	}
+
+	while (cache->count > target) {
+		mapping = list_first_entry(&cache->lru, struct gxp_mapping,
+					   cache_entry);
+		list_move_tail(&mapping->cache_entry, evicted);
+		cache->count--;
+	}
+}
+
+/*
+ * Takes the most recently cached mapping of @dmabuf for @virt_core_list and
+ * @dir out of @cache, or returns NULL if there is none.
+ */
+static struct gxp_mapping *
+gxp_dmabuf_cache_lookup(struct gxp_dmabuf_cache *cache, struct dma_buf *dmabuf,
+			uint virt_core_list, enum dma_data_direction dir)
+{
+	struct gxp_mapping *mapping, *tmp, *found = NULL;
+	LIST_HEAD(evicted);
+
+	mutex_lock(&cache->lock);
+
+	list_for_each_entry_safe_reverse(mapping, tmp, &cache->lru,
+					 cache_entry) {
+		if (to_dmabuf_mapping(mapping)->dmabuf != dmabuf ||
+		    mapping->virt_core_list != virt_core_list ||
+		    mapping->dir != dir)
+			continue;
+
+		list_del_init(&mapping->cache_entry);
+		cache->count--;
+		found = mapping;
+		break;
+	}
+
+	mutex_unlock(&cache->lock);
+
+	if (found && gxp_dmabuf_mapping_pin(found)) {
+		list_add_tail(&found->cache_entry, &evicted);
+		found = NULL;
+	}
+
+	/* Released without the lock held, since this unmaps the dma-bufs */
+	gxp_mapping_put_list(&evicted);
+
+	return found;
+}
+
+void gxp_dmabuf_cache_init(struct gxp_dmabuf_cache *cache)
+{
+	INIT_LIST_HEAD(&cache->lru);
+	cache->count = 0;
+	mutex_init(&cache->lock);
+}
+
+void gxp_dmabuf_cache_insert(struct gxp_dmabuf_cache *cache,
+			     struct gxp_mapping *mapping)
+{
+	uint size = READ_ONCE(gxp_dmabuf_cache_size);
+	LIST_HEAD(evicted);
+
+	if (!size || !gxp_mapping_get(mapping))
+		return;
+
+	/* Let the exporter move the dma-buf while it is not in use */
+	gxp_dmabuf_mapping_unpin(mapping);
+
+	mutex_lock(&cache->lock);
+	gxp_dmabuf_cache_evict_locked(cache, size - 1, &evicted);
+	list_add_tail(&mapping->cache_entry, &cache->lru);
+	cache->count++;
+	mutex_unlock(&cache->lock);
+
+	gxp_mapping_put_list(&evicted);
+}
+
+void gxp_dmabuf_cache_flush(struct gxp_dmabuf_cache *cache)
+{
+	LIST_HEAD(evicted);
+
+	mutex_lock(&cache->lock);
+	gxp_dmabuf_cache_evict_locked(cache, 0, &evicted);
+	mutex_unlock(&cache->lock);
+
+	gxp_mapping_put_list(&evicted);
+}
+
+size_t gxp_dmabuf_mapping_size(struct gxp_mapping *mapping)
+{
+	return to_dmabuf_mapping(mapping)->dmabuf->size;
+}
+
+int gxp_dmabuf_sync(struct gxp_mapping *mapping, u32 offset, u32 size,
+		    bool for_cpu)
+{
+	struct gxp_dmabuf_mapping *dmabuf_mapping = to_dmabuf_mapping(mapping);
+	struct dma_buf *dmabuf = dmabuf_mapping->dmabuf;
+	struct gxp_dev *gxp = mapping->gxp;
+	struct scatterlist *s;
+	u64 start = offset, end = (u64)offset + size;
+	u64 seg_base = 0, seg_start, seg_end;
+	dma_addr_t daddr;
+	int i, ret = 0;
+
+	if (!gxp_mapping_get(mapping))
+		return -ENODEV;
+
+	if (size == 0 || end > dmabuf->size) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Keep the exporter from moving the dma-buf during the sync */
+	dma_resv_lock(dmabuf->resv, NULL);
+	if (!dmabuf_mapping->sgt) {
+		ret = -ENODEV;
+		goto out_unlock;
+	}
+
+	/*
+	 * The page side of an importer's sg_table belongs to the exporter, so
+	 * walk the DMA side of the table and sync the part of each DMA segment
+	 * which overlaps the region by device address.
+	 */
+	for_each_sg(dmabuf_mapping->sgt->sgl, s, dmabuf_mapping->sgt->nents, i) {
+		if (seg_base >= end)
+			break;
+		seg_start = max(start, seg_base);
+		seg_end = min_t(u64, end, seg_base + sg_dma_len(s));
+		if (seg_start < seg_end) {
+			daddr = sg_dma_address(s) + (seg_start - seg_base);
+			if (for_cpu)
+				gxp_dma_sync_single_for_cpu(gxp, daddr,
+							    seg_end - seg_start,
+							    mapping->dir);
+			else
+				gxp_dma_sync_single_for_device(
+					gxp, daddr, seg_end - seg_start,
+					mapping->dir);
+		}
+		seg_base += sg_dma_len(s);
+	}
+
+out_unlock:
+	dma_resv_unlock(dmabuf->resv);
+out:
+	gxp_mapping_put(mapping);
+
+	return ret;
+}
+
+/*
+ * Maps @dmabuf for @virt_core_list of @vd, or takes a cached mapping of it.
+ * The mapping holds its own reference to @dmabuf.
+ */
+static struct gxp_mapping *
+gxp_dmabuf_map_dmabuf(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
+		      uint virt_core_list, struct dma_buf *dmabuf,
+		      enum dma_data_direction dir)
 {
-	struct dma_buf *dmabuf;
 	struct dma_buf_attachment *attachment;
 	struct sg_table *sgt;
 	struct gxp_dmabuf_mapping *dmabuf_mapping;
+	struct gxp_mapping *mapping;
 	int ret = 0;
 
-	if (!valid_dma_direction(dir))
-		return ERR_PTR(-EINVAL);
+	mapping = gxp_dmabuf_cache_lookup(&vd->dmabuf_cache, dmabuf,
+					  virt_core_list, dir);
+	if (mapping)
+		return mapping;
 
-	dmabuf = dma_buf_get(fd);
-	if (IS_ERR(dmabuf)) {
-		dev_err(gxp->dev, "Failed to get dma-buf to map (ret=%ld)\n",
-			PTR_ERR(dmabuf));
-		return ERR_CAST(dmabuf);
-	}
+	dmabuf_mapping = kzalloc(sizeof(*dmabuf_mapping), GFP_KERNEL);
+	if (!dmabuf_mapping)
+		return ERR_PTR(-ENOMEM);
 
-	attachment = dma_buf_attach(dmabuf, gxp->dev);
+	/* dma-buf mappings are indicated by a host_address of 0 */
+	refcount_set(&dmabuf_mapping->mapping.refcount, 1);
+	dmabuf_mapping->mapping.destructor = destroy_dmabuf_mapping;
+	dmabuf_mapping->mapping.host_address = 0;
+	dmabuf_mapping->mapping.gxp = gxp;
+	dmabuf_mapping->mapping.virt_core_list = virt_core_list;
+	dmabuf_mapping->mapping.vd = vd;
+	dmabuf_mapping->mapping.dir = dir;
+	INIT_LIST_HEAD(&dmabuf_mapping->mapping.cache_entry);
+	dmabuf_mapping->dmabuf = dmabuf;
+
+	/*
+	 * Attach as a dynamic importer, so cached mappings can be unpinned and
+	 * unmapped if the exporter moves the dma-buf while it is not in use.
+	 */
+	attachment = dma_buf_dynamic_attach(dmabuf, gxp->dev,
+					    &gxp_dmabuf_attach_ops,
+					    dmabuf_mapping);
 	if (IS_ERR(attachment)) {
 		dev_err(gxp->dev, "Failed to attach dma-buf to map (ret=%ld)\n",
 			PTR_ERR(attachment));
@@ -78,41 +393,313 @@ struct gxp_mapping *gxp_dmabuf_map(struct gxp_dev *gxp,
 		goto err_attach;
 	}
 
+	dma_resv_lock(dmabuf->resv, NULL);
+	ret = dma_buf_pin(attachment);
+	if (ret) {
+		dma_resv_unlock(dmabuf->resv);
+		dev_err(gxp->dev, "Failed to pin dma-buf to map (ret=%d)\n",
+			ret);
+		goto err_detach;
+	}
 	sgt = gxp_dma_map_dmabuf_attachment(gxp, vd, virt_core_list, attachment, dir);
 	if (IS_ERR(sgt)) {
+		dma_buf_unpin(attachment);
+		dma_resv_unlock(dmabuf->resv);
 		dev_err(gxp->dev,
 			"Failed to map dma-buf attachment (ret=%ld)\n",
 			PTR_ERR(sgt));
 		ret = PTR_ERR(sgt);
-		goto err_map_attachment;
-	}
-
-	dmabuf_mapping = kzalloc(sizeof(*dmabuf_mapping), GFP_KERNEL);
-	if (!dmabuf_mapping) {
-		ret = -ENOMEM;
-		goto err_alloc_mapping;
+		goto err_detach;
 	}
-
-	/* dma-buf mappings are indicated by a host_address of 0 */
-	refcount_set(&dmabuf_mapping->mapping.refcount, 1);
-	dmabuf_mapping->mapping.destructor = destroy_dmabuf_mapping;
-	dmabuf_mapping->mapping.host_address = 0;
-	dmabuf_mapping->mapping.gxp = gxp;
-	dmabuf_mapping->mapping.virt_core_list = virt_core_list;
-	dmabuf_mapping->mapping.vd = vd;
 	dmabuf_mapping->mapping.device_address = sg_dma_address(sgt->sgl);
-	dmabuf_mapping->mapping.dir = dir;
-	dmabuf_mapping->dmabuf = dmabuf;
 	dmabuf_mapping->attachment = attachment;
 	dmabuf_mapping->sgt = sgt;
+	dmabuf_mapping->pinned = true;
+	dma_resv_unlock(dmabuf->resv);
+
+	get_dma_buf(dmabuf);
 
 	return &dmabuf_mapping->mapping;
 
-err_alloc_mapping:
-	gxp_dma_unmap_dmabuf_attachment(gxp, vd, virt_core_list, attachment, sgt, dir);
-err_map_attachment:
+err_detach:
 	dma_buf_detach(dmabuf, attachment);
 err_attach:
-	dma_buf_put(dmabuf);
+	kfree(dmabuf_mapping);
+	return ERR_PTR(ret);
+}
+
+static int gxp_dmabuf_export_attach(struct dma_buf *dmabuf,
+				    struct dma_buf_attachment *attachment)
+{
+	struct gxp_dmabuf_export *export = dmabuf->priv;
+	struct gxp_dmabuf_export_attachment *a;
+	int ret;
+
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	if (!a)
+		return -ENOMEM;
+
+	ret = sg_alloc_table_from_pages(&a->sgt, export->pages,
+					export->page_count, 0,
+					export->page_count << PAGE_SHIFT,
+					GFP_KERNEL);
+	if (ret) {
+		kfree(a);
+		return ret;
+	}
+	a->dev = attachment->dev;
+	attachment->priv = a;
+
+	mutex_lock(&export->lock);
+	list_add(&a->list, &export->attachments);
+	mutex_unlock(&export->lock);
+
+	return 0;
+}
+
+static void gxp_dmabuf_export_detach(struct dma_buf *dmabuf,
+				     struct dma_buf_attachment *attachment)
+{
+	struct gxp_dmabuf_export *export = dmabuf->priv;
+	struct gxp_dmabuf_export_attachment *a = attachment->priv;
+
+	mutex_lock(&export->lock);
+	list_del(&a->list);
+	mutex_unlock(&export->lock);
+
+	sg_free_table(&a->sgt);
+	kfree(a);
+}
+
+static struct sg_table *
+gxp_dmabuf_export_map(struct dma_buf_attachment *attachment,
+		      enum dma_data_direction dir)
+{
+	struct gxp_dmabuf_export *export = attachment->dmabuf->priv;
+	struct gxp_dmabuf_export_attachment *a = attachment->priv;
+	int ret;
+
+	ret = dma_map_sgtable(a->dev, &a->sgt, dir, 0);
+	if (ret)
+		return ERR_PTR(ret);
+
+	mutex_lock(&export->lock);
+	a->dir = dir;
+	a->mapped = true;
+	mutex_unlock(&export->lock);
+
+	return &a->sgt;
+}
+
+static void gxp_dmabuf_export_unmap(struct dma_buf_attachment *attachment,
+				    struct sg_table *sgt,
+				    enum dma_data_direction dir)
+{
+	struct gxp_dmabuf_export *export = attachment->dmabuf->priv;
+	struct gxp_dmabuf_export_attachment *a = attachment->priv;
+
+	mutex_lock(&export->lock);
+	a->mapped = false;
+	mutex_unlock(&export->lock);
+
+	dma_unmap_sgtable(a->dev, sgt, dir, 0);
+}
+
+static int gxp_dmabuf_export_begin_cpu_access(struct dma_buf *dmabuf,
+					      enum dma_data_direction dir)
+{
+	struct gxp_dmabuf_export *export = dmabuf->priv;
+	struct gxp_dmabuf_export_attachment *a;
+
+	mutex_lock(&export->lock);
+	list_for_each_entry(a, &export->attachments, list) {
+		if (a->mapped)
+			dma_sync_sgtable_for_cpu(a->dev, &a->sgt, dir);
+	}
+	mutex_unlock(&export->lock);
+
+	return 0;
+}
+
+static int gxp_dmabuf_export_end_cpu_access(struct dma_buf *dmabuf,
+					    enum dma_data_direction dir)
+{
+	struct gxp_dmabuf_export *export = dmabuf->priv;
+	struct gxp_dmabuf_export_attachment *a;
+
+	mutex_lock(&export->lock);
+	list_for_each_entry(a, &export->attachments, list) {
+		if (a->mapped)
+			dma_sync_sgtable_for_device(a->dev, &a->sgt, dir);
+	}
+	mutex_unlock(&export->lock);
+
+	return 0;
+}
+
+static int gxp_dmabuf_export_mmap(struct dma_buf *dmabuf,
+				  struct vm_area_struct *vma)
+{
+	struct gxp_dmabuf_export *export = dmabuf->priv;
+
+	/* The pages are cached for the CPU; importers sync around accesses */
+	return vm_map_pages(vma, export->pages, export->page_count);
+}
+
+static void gxp_dmabuf_export_release(struct dma_buf *dmabuf)
+{
+	struct gxp_dmabuf_export *export = dmabuf->priv;
+	size_t i;
+
+	for (i = 0; i < export->page_count; i++)
+		__free_page(export->pages[i]);
+	kvfree(export->pages);
+	mutex_destroy(&export->lock);
+	kfree(export);
+}
+
+static const struct dma_buf_ops gxp_dmabuf_export_ops = {
+	.attach = gxp_dmabuf_export_attach,
+	.detach = gxp_dmabuf_export_detach,
+	.map_dma_buf = gxp_dmabuf_export_map,
+	.unmap_dma_buf = gxp_dmabuf_export_unmap,
+	.begin_cpu_access = gxp_dmabuf_export_begin_cpu_access,
+	.end_cpu_access = gxp_dmabuf_export_end_cpu_access,
+	.mmap = gxp_dmabuf_export_mmap,
+	.release = gxp_dmabuf_export_release,
+};
+
+/*
+ * Allocates @export->page_count zeroed pages into @export->pages, as large as
+ * possible. Higher-order allocations are split so every page can be freed on
+ * its own.
+ */
+static int gxp_dmabuf_export_alloc_pages(struct gxp_dmabuf_export *export)
+{
+	size_t filled = 0, i;
+	unsigned int order;
+	struct page *page;
+	gfp_t gfp;
+	int o;
+
+	while (filled < export->page_count) {
+		page = NULL;
+		for (o = 0; o < ARRAY_SIZE(gxp_dmabuf_export_orders); o++) {
+			order = gxp_dmabuf_export_orders[o];
+			if ((1UL << order) > export->page_count - filled)
+				continue;
+			gfp = GFP_KERNEL_ACCOUNT | __GFP_ZERO;
+			if (order)
+				gfp |= __GFP_NORETRY | __GFP_NOWARN;
+			page = alloc_pages(gfp, order);
+			if (page)
+				break;
+		}
+		if (!page)
+			goto err_free_pages;
+
+		if (order)
+			split_page(page, order);
+		for (i = 0; i < (1UL << order); i++)
+			export->pages[filled++] = page + i;
+	}
+
+	return 0;
+
+err_free_pages:
+	while (filled)
+		__free_page(export->pages[--filled]);
+	return -ENOMEM;
+}
+
+struct gxp_mapping *gxp_dmabuf_export(struct gxp_dev *gxp,
+				      struct gxp_virtual_device *vd,
+				      uint virt_core_list, size_t size,
+				      enum dma_data_direction dir,
+				      struct dma_buf **dmabuf_out)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct gxp_dmabuf_export *export;
+	struct gxp_mapping *mapping;
+	struct dma_buf *dmabuf;
+	int ret;
+
+	if (!size || size > READ_ONCE(gxp_dmabuf_export_max_size) ||
+	    !valid_dma_direction(dir))
+		return ERR_PTR(-EINVAL);
+
+	export = kzalloc(sizeof(*export), GFP_KERNEL);
+	if (!export)
+		return ERR_PTR(-ENOMEM);
+
+	export->gxp = gxp;
+	export->page_count = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	INIT_LIST_HEAD(&export->attachments);
+	mutex_init(&export->lock);
+
+	export->pages = kvcalloc(export->page_count, sizeof(*export->pages),
+				 GFP_KERNEL_ACCOUNT);
+	if (!export->pages) {
+		ret = -ENOMEM;
+		goto err_free_export;
+	}
+	ret = gxp_dmabuf_export_alloc_pages(export);
+	if (ret)
+		goto err_free_page_array;
+
+	exp_info.ops = &gxp_dmabuf_export_ops;
+	exp_info.size = export->page_count << PAGE_SHIFT;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = export;
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		ret = PTR_ERR(dmabuf);
+		dev_err(gxp->dev, "Failed to export buffer (ret=%d)\n", ret);
+		goto err_free_pages;
+	}
+
+	/* From here on, the dma-buf's release frees the buffer */
+	mapping = gxp_dmabuf_map_dmabuf(gxp, vd, virt_core_list, dmabuf, dir);
+	if (IS_ERR(mapping)) {
+		dma_buf_put(dmabuf);
+		return mapping;
+	}
+
+	*dmabuf_out = dmabuf;
+
+	return mapping;
+
+err_free_pages:
+	while (export->page_count)
+		__free_page(export->pages[--export->page_count]);
+err_free_page_array:
+	kvfree(export->pages);
+err_free_export:
+	mutex_destroy(&export->lock);
+	kfree(export);
 	return ERR_PTR(ret);
 }
+
+struct gxp_mapping *gxp_dmabuf_map(struct gxp_dev *gxp,
+				   struct gxp_virtual_device *vd,
+				   uint virt_core_list, int fd, u32 flags,
+				   enum dma_data_direction dir)
+{
+	struct dma_buf *dmabuf;
+	struct gxp_mapping *mapping;
+
+	if (!valid_dma_direction(dir))
+		return ERR_PTR(-EINVAL);
+
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf)) {
+		dev_err(gxp->dev, "Failed to get dma-buf to map (ret=%ld)\n",
+			PTR_ERR(dmabuf));
+		return ERR_CAST(dmabuf);
+	}
+
+	mapping = gxp_dmabuf_map_dmabuf(gxp, vd, virt_core_list, dmabuf, dir);
+	dma_buf_put(dmabuf);
+
+	return mapping;
+}
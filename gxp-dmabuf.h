@@ -8,11 +8,46 @@
 #define __GXP_DMABUF_H__
 
 #include <linux/dma-direction.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/types.h>
 
 #include "gxp-internal.h"
 #include "gxp-mapping.h"
 
+struct dma_buf;
+
+/*
+ * Keeps dma-buf mappings alive after their dma-buf is unmapped, still attached
+ * and mapped for the device, so mapping the same dma-buf again only takes a
+ * reference to the existing mapping.
+ */
+struct gxp_dmabuf_cache {
+	/* Cached mappings, linked through `cache_entry`, least recent first */
+	struct list_head lru;
+	uint count;
+	/* Protects `lru` and `count` */
+	struct mutex lock;
+};
+
+/* Initializes an empty dma-buf mapping cache. */
+void gxp_dmabuf_cache_init(struct gxp_dmabuf_cache *cache);
+
+/**
+ * gxp_dmabuf_cache_insert() - Keep an unmapped dma-buf mapping for reuse
+ * @cache: The cache of the virtual device @mapping was created for
+ * @mapping: A mapping created with gxp_dmabuf_map(), no longer stored in its
+ *           virtual device's records
+ *
+ * Acquires a reference to @mapping if it is cached. The least recently cached
+ * mappings are released to keep @cache within its size limit.
+ */
+void gxp_dmabuf_cache_insert(struct gxp_dmabuf_cache *cache,
+			     struct gxp_mapping *mapping);
+
+/* Releases all mappings held by @cache. */
+void gxp_dmabuf_cache_flush(struct gxp_dmabuf_cache *cache);
+
 /**
  * gxp_dmabuf_map() - Map a dma-buf for access by the specified virtual device
  * @gxp: The GXP device to map the dma-buf for
@@ -22,7 +57,11 @@
  * @flags: The type of mapping to create; Currently unused
  * @direction: DMA direction
  *
- * If successful, the mapping will be initialized with a reference count of 1
+ * If the virtual device's dma-buf cache holds a mapping of the same dma-buf,
+ * for the same cores and direction, that mapping is returned instead, with the
+ * cache's reference handed to the caller.
+ *
+ * If successful, the caller owns one reference to the returned mapping
  *
  * Return: The structure that was created and is being tracked to describe the
  *         mapping of the dma-buf. Returns ERR_PTR on failure.
@@ -32,4 +71,58 @@ struct gxp_mapping *gxp_dmabuf_map(struct gxp_dev *gxp,
 				   uint virt_core_list, int fd, u32 flags,
 				   enum dma_data_direction dir);
 
+/**
+ * gxp_dmabuf_export() - Allocate a buffer, export it as a dma-buf, and map it
+ * @gxp: The GXP device to allocate the buffer for
+ * @vd: The virtual device to map the dma-buf for
+ * @virt_core_list: A bitfield enumerating the virtual cores to map it for
+ * @size: The size, in bytes, of the buffer; rounded up to whole pages. Must
+ *        not exceed the `export_max_size` module parameter.
+ * @dir: DMA direction
+ * @dmabuf: Set to the exported dma-buf on success
+ *
+ * The buffer is made of zeroed pages, charged to the current process's memory
+ * cgroup and freed once the dma-buf is released. The returned mapping is the
+ * same as gxp_dmabuf_map() would create for the dma-buf, and holds its own
+ * reference to it.
+ *
+ * Return: The mapping of the dma-buf, holding one reference the caller owns,
+ *         with @dmabuf holding a reference the caller also owns. Returns
+ *         ERR_PTR on failure.
+ */
+struct gxp_mapping *gxp_dmabuf_export(struct gxp_dev *gxp,
+				      struct gxp_virtual_device *vd,
+				      uint virt_core_list, size_t size,
+				      enum dma_data_direction dir,
+				      struct dma_buf **dmabuf);
+
+/**
+ * gxp_dmabuf_mapping_size() - Get the size of the dma-buf a mapping maps
+ * @mapping: A mapping created with gxp_dmabuf_map()
+ *
+ * Return: The size, in bytes, of the mapped dma-buf
+ */
+size_t gxp_dmabuf_mapping_size(struct gxp_mapping *mapping);
+
+/**
+ * gxp_dmabuf_sync() - Sync part of a mapped dma-buf for either CPU or device
+ * @mapping: A mapping created with gxp_dmabuf_map()
+ * @offset: The offset, in bytes, into the dma-buf where the region to be
+ *          synced begins
+ * @size: The size, in bytes, of the region to be synced
+ * @for_cpu: True to sync for CPU access (cache invalidate), false to sync for
+ *           device access (cache flush)
+ *
+ * Only the parts of the dma-buf's scatter-gather table covering the region are
+ * synced, rather than the whole dma-buf as dma_buf_begin_cpu_access() does.
+ *
+ * Return:
+ * * 0: Success
+ * * -ENODEV: A reference to the mapping could not be obtained, or the dma-buf
+ *            is no longer mapped
+ * * -EINVAL: The specified @offset and @size were not valid
+ */
+int gxp_dmabuf_sync(struct gxp_mapping *mapping, u32 offset, u32 size,
+		    bool for_cpu);
+
 #endif /* __GXP_DMABUF_H__ */
@@ -5,100 +5,188 @@
  * Copyright (C) 2022 Google LLC
  */
 
-#include <linux/idr.h>
 #include <linux/iommu.h>
 #include <linux/slab.h>
 
 #include "gxp-domain-pool.h"
 #include "gxp-internal.h"
 
+static struct gxp_pooled_domain *
+gxp_domain_pool_create_domain(struct gxp_domain_pool *pool)
+{
+	struct gxp_pooled_domain *pdomain;
+
+	pdomain = kzalloc(sizeof(*pdomain), GFP_KERNEL);
+	if (!pdomain)
+		return NULL;
+
+	pdomain->domain = iommu_domain_alloc(pool->gxp->dev->bus);
+	if (!pdomain->domain) {
+		kfree(pdomain);
+		return NULL;
+	}
+	INIT_LIST_HEAD(&pdomain->list);
+
+	return pdomain;
+}
+
+static void gxp_domain_pool_destroy_domain(struct gxp_pooled_domain *pdomain)
+{
+	iommu_domain_free(pdomain->domain);
+	kfree(pdomain);
+}
+
+/*
+ * Creates domains until @pool has `low_watermark` idle ones, and frees idle
+ * domains beyond `high_watermark`. Domains are created and freed without
+ * holding the pool's lock, so allocations are not held up by either.
+ */
+static void gxp_domain_pool_balance(struct gxp_domain_pool *pool)
+{
+	struct gxp_pooled_domain *pdomain;
+
+	for (;;) {
+		mutex_lock(&pool->lock);
+		if (pool->stats.idle < pool->low_watermark) {
+			mutex_unlock(&pool->lock);
+			pdomain = gxp_domain_pool_create_domain(pool);
+			if (!pdomain) {
+				dev_warn(pool->gxp->dev,
+					 "Failed to refill domain pool\n");
+				return;
+			}
+			mutex_lock(&pool->lock);
+			list_add_tail(&pdomain->list, &pool->idle);
+			pool->stats.idle++;
+			pool->stats.total++;
+		} else if (pool->stats.idle > pool->high_watermark) {
+			/* Free the least recently used domain */
+			pdomain = list_first_entry(&pool->idle,
+						   struct gxp_pooled_domain,
+						   list);
+			list_del(&pdomain->list);
+			pool->stats.idle--;
+			pool->stats.total--;
+			mutex_unlock(&pool->lock);
+			gxp_domain_pool_destroy_domain(pdomain);
+			continue;
+		} else {
+			mutex_unlock(&pool->lock);
+			return;
+		}
+		mutex_unlock(&pool->lock);
+	}
+}
+
+static void gxp_domain_pool_balance_work(struct work_struct *work)
+{
+	struct gxp_domain_pool *pool =
+		container_of(work, struct gxp_domain_pool, balance_work);
+
+	gxp_domain_pool_balance(pool);
+}
+
 int gxp_domain_pool_init(struct gxp_dev *gxp, struct gxp_domain_pool *pool,
 			 unsigned int size)
 {
-	unsigned int i;
-	struct iommu_domain *domain;
-
-	pool->size = size;
 	pool->gxp = gxp;
+	pool->low_watermark = size;
+	pool->high_watermark = size * 2;
+	memset(&pool->stats, 0, sizeof(pool->stats));
+	INIT_LIST_HEAD(&pool->idle);
+	mutex_init(&pool->lock);
+	INIT_WORK(&pool->balance_work, gxp_domain_pool_balance_work);
 
 	if (!size)
 		return 0;
 
 	dev_dbg(pool->gxp->dev, "Initializing domain pool with %u domains\n", size);
 
-	ida_init(&pool->idp);
-	pool->array = vzalloc(sizeof(*pool->array) * size);
-	if (!pool->array) {
-		dev_err(gxp->dev, "Failed to allocate memory for domain pool array\n");
+	gxp_domain_pool_balance(pool);
+	if (pool->stats.idle < size) {
+		dev_err(pool->gxp->dev,
+			"Failed to allocate iommu domain %u of %u\n",
+			pool->stats.idle + 1, size);
+		gxp_domain_pool_destroy(pool);
 		return -ENOMEM;
 	}
-	for (i = 0; i < size; i++) {
-		domain = iommu_domain_alloc(pool->gxp->dev->bus);
-		if (!domain) {
-			dev_err(pool->gxp->dev,
-				"Failed to allocate iommu domain %d of %u\n",
-				i + 1, size);
-			gxp_domain_pool_destroy(pool);
-			return -ENOMEM;
-		}
-		pool->array[i] = domain;
-	}
 	return 0;
 }
 
-struct iommu_domain *gxp_domain_pool_alloc(struct gxp_domain_pool *pool)
+struct gxp_pooled_domain *gxp_domain_pool_alloc(struct gxp_domain_pool *pool)
 {
-	int id;
-
-	if (!pool->size)
-		return iommu_domain_alloc(pool->gxp->dev->bus);
-
-	id = ida_alloc_max(&pool->idp, pool->size - 1, GFP_KERNEL);
+	struct gxp_pooled_domain *pdomain;
+
+	mutex_lock(&pool->lock);
+	pdomain = list_first_entry_or_null(&pool->idle,
+					   struct gxp_pooled_domain, list);
+	if (pdomain) {
+		list_del_init(&pdomain->list);
+		pool->stats.idle--;
+		pool->stats.hits++;
+		if (pool->stats.idle < pool->low_watermark)
+			schedule_work(&pool->balance_work);
+		mutex_unlock(&pool->lock);
+		return pdomain;
+	}
+	pool->stats.misses++;
+	mutex_unlock(&pool->lock);
 
-	if (id < 0) {
-		dev_err(pool->gxp->dev,
-			"No more domains available from pool of size %u\n",
-			pool->size);
+	pdomain = gxp_domain_pool_create_domain(pool);
+	if (!pdomain) {
+		dev_err(pool->gxp->dev, "Failed to allocate iommu domain\n");
 		return NULL;
 	}
 
-	dev_dbg(pool->gxp->dev, "Allocated domain from pool with id = %d\n", id);
+	mutex_lock(&pool->lock);
+	pool->stats.total++;
+	if (pool->low_watermark)
+		schedule_work(&pool->balance_work);
+	mutex_unlock(&pool->lock);
 
-	return pool->array[id];
+	return pdomain;
 }
 
-void gxp_domain_pool_free(struct gxp_domain_pool *pool, struct iommu_domain *domain)
+void gxp_domain_pool_free(struct gxp_domain_pool *pool,
+			  struct gxp_pooled_domain *pdomain)
 {
-	int id;
-
-	if (!pool->size) {
-		iommu_domain_free(domain);
+	mutex_lock(&pool->lock);
+	if (!pool->high_watermark) {
+		pool->stats.total--;
+		mutex_unlock(&pool->lock);
+		gxp_domain_pool_destroy_domain(pdomain);
 		return;
 	}
-	for (id = 0; id < pool->size; id++) {
-		if (pool->array[id] == domain) {
-			dev_dbg(pool->gxp->dev, "Released domain from pool with id = %d\n", id);
-			ida_free(&pool->idp, id);
-			return;
-		}
-	}
-	dev_err(pool->gxp->dev, "%s: domain not found in pool", __func__);
+	/* Most recently used domains are handed out first */
+	list_add(&pdomain->list, &pool->idle);
+	pool->stats.idle++;
+	if (pool->stats.idle > pool->high_watermark)
+		schedule_work(&pool->balance_work);
+	mutex_unlock(&pool->lock);
+}
+
+void gxp_domain_pool_get_stats(struct gxp_domain_pool *pool,
+			       struct gxp_domain_pool_stats *stats)
+{
+	mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	mutex_unlock(&pool->lock);
 }
 
 void gxp_domain_pool_destroy(struct gxp_domain_pool *pool)
 {
-	int i;
+	struct gxp_pooled_domain *pdomain, *tmp;
 
-	if (!pool->size)
-		return;
+	cancel_work_sync(&pool->balance_work);
 
-	dev_dbg(pool->gxp->dev, "Destroying domain pool with %u domains\n", pool->size);
+	dev_dbg(pool->gxp->dev, "Destroying domain pool with %u domains\n",
+		pool->stats.idle);
 
-	for (i = 0; i < pool->size; i++) {
-		if (pool->array[i])
-			iommu_domain_free(pool->array[i]);
+	list_for_each_entry_safe(pdomain, tmp, &pool->idle, list) {
+		list_del(&pdomain->list);
+		gxp_domain_pool_destroy_domain(pdomain);
 	}
-
-	ida_destroy(&pool->idp);
-	vfree(pool->array);
+	pool->stats.idle = 0;
+	pool->stats.total = 0;
+	mutex_destroy(&pool->lock);
 }
@@ -8,29 +8,72 @@
 #ifndef __GXP_DOMAIN_POOL_H__
 #define __GXP_DOMAIN_POOL_H__
 
-#include <linux/idr.h>
 #include <linux/iommu.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
 
 #include "gxp-internal.h"
 
+/*
+ * Fixed IOVA resources left installed in a domain between uses, so starting a
+ * virtual device on it does not have to map them again.
+ */
+struct gxp_domain_resources {
+	/* Whether the resources shared by all cores are mapped */
+	bool common_mapped;
+	/* Physical cores whose mailbox and TPU mailbox windows are mapped */
+	uint core_list;
+};
+
+/*
+ * A domain handed out by the pool. Holders keep this alongside the domain, so
+ * returning it to the pool needs no search.
+ */
+struct gxp_pooled_domain {
+	struct iommu_domain *domain;
+	struct gxp_domain_resources resources;
+	/* Entry in the pool's list of idle domains, while idle */
+	struct list_head list;
+};
+
+struct gxp_domain_pool_stats {
+	/* Allocations served by an idle domain */
+	u64 hits;
+	/* Allocations which had to create a domain */
+	u64 misses;
+	/* Domains created and not yet freed, idle or in use */
+	u32 total;
+	/* Idle domains */
+	u32 idle;
+};
+
 struct gxp_domain_pool {
-	struct ida idp;			/* ID allocator to keep track of used domains. */
+	/* Idle domains, ready to be handed out */
+	struct list_head idle;
 	/*
-	 * Size of the pool. Can be set to 0, in which case the implementation will fall back to
-	 * dynamic domain allocation using the IOMMU API directly.
+	 * The pool refills itself in the background up to `low_watermark`
+	 * idle domains, and frees idle domains beyond `high_watermark`. If
+	 * both are 0, domains are created on demand and freed when released.
 	 */
-	unsigned int size;
-	struct iommu_domain **array;	/* Array holding the pointers to pre-allocated domains. */
+	unsigned int low_watermark;
+	unsigned int high_watermark;
+	struct gxp_domain_pool_stats stats;
+	/* Protects `idle` and `stats` */
+	struct mutex lock;
+	/* Refills or trims `idle` to within the watermarks */
+	struct work_struct balance_work;
 	struct gxp_dev *gxp;	/* The gxp device used for logging warnings/errors. */
 };
 
-
 /*
  * Initializes a domain pool.
  *
  * @gxp: pointer to gxp device.
  * @pool: caller-allocated pool structure.
- * @size: size of the pre-allocated domains pool.
+ * @size: number of domains to pre-allocate, and the number of idle domains the
+ * pool keeps ready; up to twice as many are kept once released.
  * Set to zero to fall back to dynamically allocated domains.
  *
  * returns 0 on success or negative error value.
@@ -39,15 +82,34 @@ int gxp_domain_pool_init(struct gxp_dev *gxp, struct gxp_domain_pool *pool,
 			 unsigned int size);
 
 /*
- * Allocates a domain from the pool
+ * Allocates a domain from the pool, creating one if none is idle.
  * returns NULL on error.
  */
-struct iommu_domain *gxp_domain_pool_alloc(struct gxp_domain_pool *pool);
+struct gxp_pooled_domain *gxp_domain_pool_alloc(struct gxp_domain_pool *pool);
+
+/* Releases a domain to the pool. */
+void gxp_domain_pool_free(struct gxp_domain_pool *pool,
+			  struct gxp_pooled_domain *pdomain);
+
+/*
+ * Returns the resources left installed in @pdomain, or NULL if @pool frees
+ * domains once they are released, leaving nothing to keep installed.
+ */
+static inline struct gxp_domain_resources *
+gxp_domain_pool_resources(struct gxp_domain_pool *pool,
+			  struct gxp_pooled_domain *pdomain)
+{
+	return pool->high_watermark ? &pdomain->resources : NULL;
+}
 
-/* Releases a domain from the pool. */
-void gxp_domain_pool_free(struct gxp_domain_pool *pool, struct iommu_domain *domain);
+/* Copies the pool's current statistics to @stats. */
+void gxp_domain_pool_get_stats(struct gxp_domain_pool *pool,
+			       struct gxp_domain_pool_stats *stats);
 
-/* Cleans up all resources used by the domain pool. */
+/*
+ * Cleans up all resources used by the domain pool. All allocated domains must
+ * have been released.
+ */
 void gxp_domain_pool_destroy(struct gxp_domain_pool *pool);
 
 #endif /* __GXP_DOMAIN_POOL_H__ */
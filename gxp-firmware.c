@@ -728,8 +728,7 @@ static int gxp_firmware_finish_startup(struct gxp_dev *gxp,
 	if (ret) {
 		dev_err(gxp->dev, "Firmware handshake failed on core %u\n",
 			core);
-		gxp_pm_core_off(gxp, core);
-		goto out_firmware_unload;
+		goto err_core_off;
 	}
 
 	/* Initialize mailbox */
@@ -741,7 +740,7 @@ static int gxp_firmware_finish_startup(struct gxp_dev *gxp,
 			PTR_ERR(gxp->mailbox_mgr->mailboxes[core]));
 		ret = PTR_ERR(gxp->mailbox_mgr->mailboxes[core]);
 		gxp->mailbox_mgr->mailboxes[core] = NULL;
-		goto out_firmware_unload;
+		goto err_core_off;
 	}
 
 	work = gxp_debug_dump_get_notification_handler(gxp, core);
@@ -758,7 +757,8 @@ static int gxp_firmware_finish_startup(struct gxp_dev *gxp,
 
 	return ret;
 
-out_firmware_unload:
+err_core_off:
+	gxp_pm_core_off(gxp, core);
 	gxp_firmware_unload(gxp, core);
 	return ret;
 }
@@ -890,6 +890,42 @@ void gxp_firmware_stop(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 	}
 }
 
+int gxp_firmware_restart_core(struct gxp_dev *gxp,
+			      struct gxp_virtual_device *vd, uint virt_core,
+			      uint core)
+{
+	struct list_head *dest_queue =
+		&vd->mailbox_resp_queues[virt_core].queue;
+	struct list_head pending;
+	int ret;
+
+	INIT_LIST_HEAD(&pending);
+	gxp_mailbox_detach_pending(gxp->mailbox_mgr->mailboxes[core],
+				   &pending);
+	gxp_firmware_stop_core(gxp, vd, virt_core, core);
+
+	ret = gxp_firmware_setup(gxp, core);
+	if (ret)
+		goto err_abort_pending;
+
+	/* Switch clock mux to the normal state to guarantee LPM works */
+	gxp_pm_force_clkmux_normal(gxp);
+	gxp_firmware_wakeup_cores(gxp, BIT(core));
+	ret = gxp_firmware_finish_startup(gxp, vd, virt_core, core);
+	gxp_pm_resume_clkmux(gxp);
+	if (ret)
+		goto err_abort_pending;
+
+	gxp_mailbox_replay_pending(gxp, gxp->mailbox_mgr->mailboxes[core],
+				   &pending, dest_queue);
+
+	return 0;
+
+err_abort_pending:
+	gxp_mailbox_replay_pending(gxp, NULL, &pending, dest_queue);
+	return ret;
+}
+
 void gxp_firmware_set_boot_mode(struct gxp_dev *gxp, uint core, u32 mode)
 {
 	void __iomem *boot_mode_addr;
@@ -83,6 +83,18 @@ int gxp_firmware_run(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 void gxp_firmware_stop(struct gxp_dev *gxp, struct gxp_virtual_device *vd,
 		       uint core_list);
 
+/*
+ * Reboots the firmware of a single core of @vd, which must currently be
+ * running, and allocates it a new mailbox. Idempotent commands still pending
+ * on the old mailbox are re-sent on the new one, all others are aborted.
+ * If the restart fails, the core is left powered off.
+ *
+ * The caller must have locked gxp->vd_semaphore for writing.
+ */
+int gxp_firmware_restart_core(struct gxp_dev *gxp,
+			      struct gxp_virtual_device *vd, uint virt_core,
+			      uint core);
+
 /*
  * Sets the specified core's boot mode or suspend request value.
  * This function should be called only after the firmware has been run.
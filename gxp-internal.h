@@ -74,11 +74,6 @@ struct gxp_dev {
 	struct mutex dsp_firmware_lock;
 	/* Firmware status bitmap. Accessors must hold `vd_semaphore` */
 	u32 firmware_running;
-	/*
-	 * Lock to ensure only one thread at a time is ever calling
-	 * `pin_user_pages_fast()` during mapping, otherwise it will fail.
-	 */
-	struct mutex pin_user_pages_lock;
 	/*
 	 * Reader/writer lock protecting usage of virtual cores assigned to
 	 * physical cores.
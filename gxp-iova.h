@@ -15,4 +15,11 @@
 #define GXP_IOVA_FW_DATA                (0xFA400000)
 #define GXP_IOVA_TPU_MBX_BUFFER(_x_)    (0xFE100000 + (_x_) * 0x00040000)
 
+/*
+ * Each virtual device maps user buffers at IOVAs it allocates from this range
+ * itself. The default domain never hands out addresses in it.
+ */
+#define GXP_IOVA_VD_PRIVATE_START       (0x80000000)
+#define GXP_IOVA_VD_PRIVATE_END         GXP_IOVA_FIRMWARE(0)
+
 #endif /* __GXP_IOVAS_H__ */
@@ -9,21 +9,50 @@
 #include <linux/dma-mapping.h>
 #include <linux/io.h>
 #include <linux/iommu.h>
+#include <linux/ktime.h>
 #include <linux/kthread.h>
 #include <linux/moduleparam.h>
 #include <linux/slab.h>
 #include <uapi/linux/sched/types.h>
 
 #include "gxp-dma.h"
+#include "gxp-firmware.h"
 #include "gxp-internal.h"
 #include "gxp-mailbox.h"
 #include "gxp-mailbox-driver.h"
 #include "gxp-pm.h"
+#include "gxp-vd.h"
 
 /* Timeout of 1s by default */
 int gxp_mbx_timeout = 1000;
 module_param_named(mbx_timeout, gxp_mbx_timeout, int, 0660);
 
+/*
+ * Response queue occupancy, in entries, above which the host notifies the
+ * firmware as soon as it has made room again. Applied when a mailbox is
+ * allocated. Half of the queue by default.
+ */
+static uint gxp_mbx_resp_watermark = 512;
+module_param_named(mbx_resp_watermark, gxp_mbx_resp_watermark, uint, 0660);
+
+/*
+ * Whether a core is restarted when one of its commands times out. Pending
+ * idempotent commands are re-sent to the restarted core, all others are
+ * aborted instead of each waiting for its own timeout.
+ */
+static bool gxp_mbx_recover_on_timeout;
+module_param_named(mbx_recover_on_timeout, gxp_mbx_recover_on_timeout, bool,
+		   0660);
+
+/*
+ * Maximum number of async commands each mailbox keeps outstanding on its core.
+ * Further commands wait on the host and are sent earliest deadline first as
+ * outstanding ones complete. Applied when a mailbox is allocated. 0 sends every
+ * command straight to the command queue.
+ */
+static uint gxp_mbx_inflight_window;
+module_param_named(mbx_inflight_window, gxp_mbx_inflight_window, uint, 0660);
+
 /* Utilities of circular queue operations */
 
 #define CIRCULAR_QUEUE_WRAP_BIT BIT(15)
@@ -161,10 +190,198 @@ static int gxp_mailbox_inc_resp_queue_head(struct gxp_mailbox *mailbox, u32 inc)
 	return 0;
 }
 
+/*
+ * Returns true if the command queue has no room for another command.
+ *
+ * Caller must hold cmd_queue_lock.
+ */
+static bool gxp_mailbox_cmd_queue_full(struct gxp_mailbox *mailbox)
+{
+	lockdep_assert_held(&mailbox->cmd_queue_lock);
+
+	return gxp_mailbox_read_cmd_queue_head(mailbox) ==
+	       (mailbox->cmd_queue_tail ^ CIRCULAR_QUEUE_WRAP_BIT);
+}
+
+/*
+ * Copies @cmd to the tail of the command queue and rings the doorbell.
+ *
+ * Caller must hold cmd_queue_lock and have checked the queue is not full.
+ */
+static void gxp_mailbox_write_cmd(struct gxp_mailbox *mailbox,
+				  const struct gxp_command *cmd)
+{
+	/*
+	 * The lock ensures mailbox->cmd_queue_tail cannot be changed by
+	 * other processes (this method should be the only one to modify the
+	 * value of tail).
+	 */
+	lockdep_assert_held(&mailbox->cmd_queue_lock);
+
+	/* size of cmd_queue is a multiple of sizeof(*cmd) */
+	memcpy(mailbox->cmd_queue +
+		       CIRCULAR_QUEUE_REAL_INDEX(mailbox->cmd_queue_tail),
+	       cmd, sizeof(*cmd));
+	gxp_mailbox_inc_cmd_queue_tail(mailbox, 1);
+	/* triggers doorbell */
+	/* TODO(b/190868834) define interrupt bits */
+	gxp_mailbox_generate_device_interrupt(mailbox, BIT(0));
+}
+
+/* Commands without a deadline are scheduled after all others */
+static inline u64 gxp_mailbox_edf_key(struct gxp_async_response *async_resp)
+{
+	return async_resp->deadline ? async_resp->deadline : U64_MAX;
+}
+
+/*
+ * Adds @async_resp to the mailbox's `edf_queue`, after any command with an
+ * earlier or equal deadline.
+ *
+ * Caller must hold edf_lock.
+ */
+static void gxp_mailbox_edf_insert(struct gxp_mailbox *mailbox,
+				   struct gxp_async_response *async_resp)
+{
+	struct rb_node **link = &mailbox->edf_queue.rb_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct gxp_async_response *cur;
+	u64 key = gxp_mailbox_edf_key(async_resp);
+	bool leftmost = true;
+
+	lockdep_assert_held(&mailbox->edf_lock);
+
+	while (*link) {
+		parent = *link;
+		cur = rb_entry(parent, struct gxp_async_response, edf_node);
+		if (key < gxp_mailbox_edf_key(cur)) {
+			link = &parent->rb_left;
+		} else {
+			link = &parent->rb_right;
+			leftmost = false;
+		}
+	}
+
+	rb_link_node(&async_resp->edf_node, parent, link);
+	rb_insert_color_cached(&async_resp->edf_node, &mailbox->edf_queue,
+			       leftmost);
+	async_resp->sched_state = GXP_ASYNC_SCHED_QUEUED;
+}
+
+/*
+ * Sends queued commands to the command queue, earliest deadline first, until
+ * either the in-flight window or the command queue is full.
+ *
+ * Caller must hold edf_lock.
+ */
+static void gxp_mailbox_edf_admit(struct gxp_mailbox *mailbox)
+{
+	struct gxp_async_response *async_resp;
+	struct rb_node *node;
+
+	lockdep_assert_held(&mailbox->edf_lock);
+
+	while (mailbox->edf_in_flight < mailbox->edf_window) {
+		node = rb_first_cached(&mailbox->edf_queue);
+		if (!node)
+			break;
+		async_resp = rb_entry(node, struct gxp_async_response,
+				      edf_node);
+
+		mutex_lock(&mailbox->cmd_queue_lock);
+		/*
+		 * If the command queue is full, the command stays queued and
+		 * is retried the next time responses are consumed.
+		 */
+		if (gxp_mailbox_cmd_queue_full(mailbox)) {
+			mutex_unlock(&mailbox->cmd_queue_lock);
+			break;
+		}
+		rb_erase_cached(node, &mailbox->edf_queue);
+		/*
+		 * The response may be handled as soon as the command is in the
+		 * ring, so it must be marked admitted beforehand.
+		 */
+		async_resp->sched_state = GXP_ASYNC_SCHED_ADMITTED;
+		mailbox->edf_in_flight++;
+		gxp_mailbox_write_cmd(mailbox, &async_resp->cmd);
+		mutex_unlock(&mailbox->cmd_queue_lock);
+	}
+}
+
+/*
+ * Frees @count slots of the in-flight window, whose commands' responses have
+ * been handled, and admits queued commands into them.
+ */
+static void gxp_mailbox_edf_release(struct gxp_mailbox *mailbox, u32 count)
+{
+	mutex_lock(&mailbox->edf_lock);
+	mailbox->edf_in_flight -= min(count, mailbox->edf_in_flight);
+	gxp_mailbox_edf_admit(mailbox);
+	mutex_unlock(&mailbox->edf_lock);
+}
+
+/*
+ * Stops tracking @async_resp, which has been removed from its wait_list
+ * without a response, in the mailbox's deadline scheduler.
+ *
+ * Returns the scheduling state @async_resp was in before it was cancelled.
+ */
+static enum gxp_async_response_sched_state
+gxp_mailbox_edf_cancel(struct gxp_mailbox *mailbox,
+		       struct gxp_async_response *async_resp)
+{
+	enum gxp_async_response_sched_state state;
+
+	mutex_lock(&mailbox->edf_lock);
+	state = async_resp->sched_state;
+	if (async_resp->sched_state == GXP_ASYNC_SCHED_QUEUED) {
+		rb_erase_cached(&async_resp->edf_node, &mailbox->edf_queue);
+	} else if (async_resp->sched_state == GXP_ASYNC_SCHED_ADMITTED) {
+		mailbox->edf_in_flight--;
+		gxp_mailbox_edf_admit(mailbox);
+	}
+	async_resp->sched_state = GXP_ASYNC_SCHED_NONE;
+	mutex_unlock(&mailbox->edf_lock);
+
+	return state;
+}
+
+static void gxp_mailbox_recovery_work(struct work_struct *work)
+{
+	struct gxp_mailbox_recovery_work *recovery_work =
+		container_of(work, struct gxp_mailbox_recovery_work, work);
+	struct gxp_dev *gxp = recovery_work->gxp;
+	uint core = recovery_work->core;
+	struct gxp_mailbox *mailbox;
+	struct gxp_virtual_device *vd;
+
+	down_write(&gxp->vd_semaphore);
+
+	/*
+	 * The core may have been stopped, suspended or already restarted since
+	 * the request was made, in which case the current mailbox is not the
+	 * one which requested the recovery.
+	 */
+	mailbox = gxp->mailbox_mgr->mailboxes[core];
+	vd = gxp->core_to_vd[core];
+	if (!mailbox || !READ_ONCE(mailbox->recovery_requested) || !vd ||
+	    vd->state != GXP_VD_RUNNING)
+		goto out;
+
+	dev_warn(gxp->dev, "Restarting core %u after a command timed out\n",
+		 core);
+	gxp_vd_restart_core(vd, core);
+
+out:
+	up_write(&gxp->vd_semaphore);
+}
+
 struct gxp_mailbox_manager *gxp_mailbox_create_manager(struct gxp_dev *gxp,
 						       uint num_cores)
 {
 	struct gxp_mailbox_manager *mgr;
+	uint core;
 
 	mgr = devm_kzalloc(gxp->dev, sizeof(*mgr), GFP_KERNEL);
 	if (!mgr)
@@ -180,9 +397,50 @@ struct gxp_mailbox_manager *gxp_mailbox_create_manager(struct gxp_dev *gxp,
 	if (!mgr->mailboxes)
 		return ERR_PTR(-ENOMEM);
 
+	mgr->stats = devm_kcalloc(gxp->dev, mgr->num_cores,
+				  sizeof(*mgr->stats), GFP_KERNEL);
+	if (!mgr->stats)
+		return ERR_PTR(-ENOMEM);
+
+	mgr->recovery_works = devm_kcalloc(gxp->dev, mgr->num_cores,
+					   sizeof(*mgr->recovery_works),
+					   GFP_KERNEL);
+	if (!mgr->recovery_works)
+		return ERR_PTR(-ENOMEM);
+
+	for (core = 0; core < mgr->num_cores; core++) {
+		mgr->recovery_works[core].gxp = gxp;
+		mgr->recovery_works[core].core = core;
+		INIT_WORK(&mgr->recovery_works[core].work,
+			  gxp_mailbox_recovery_work);
+	}
+
 	return mgr;
 }
 
+void gxp_mailbox_cancel_recovery(struct gxp_mailbox_manager *mgr)
+{
+	uint core;
+
+	for (core = 0; core < mgr->num_cores; core++)
+		cancel_work_sync(&mgr->recovery_works[core].work);
+}
+
+/*
+ * Counts @async_resp against its submitter's deadline statistics. Must be
+ * called once the final status of the response is known, before it is handed
+ * to its destination queue.
+ */
+static void gxp_mailbox_account_deadline(struct gxp_async_response *async_resp)
+{
+	if (!async_resp->deadline || !async_resp->deadline_stats)
+		return;
+
+	if (async_resp->resp.status != GXP_RESP_OK ||
+	    ktime_get_ns() > async_resp->deadline)
+		atomic64_inc(&async_resp->deadline_stats->misses);
+}
+
 /*
  * Pops the wait_list until the sequence number of @resp is found, and copies
  * @resp to the found entry.
@@ -202,13 +460,17 @@ struct gxp_mailbox_manager *gxp_mailbox_create_manager(struct gxp_dev *gxp,
  *   - @resp has arrived out of sequence order.
  *   - Leave #cur->resp in the wait_list.
  *   - Keep iterating unless the list is exhausted.
+ *
+ * Returns true if @resp completed a command holding a slot in the mailbox's
+ * in-flight window.
  */
-static void gxp_mailbox_handle_response(struct gxp_mailbox *mailbox,
+static bool gxp_mailbox_handle_response(struct gxp_mailbox *mailbox,
 					const struct gxp_response *resp)
 {
 	struct gxp_mailbox_wait_list *cur, *nxt;
 	struct gxp_async_response *async_resp;
 	unsigned long flags;
+	bool admitted = false;
 
 	mutex_lock(&mailbox->wait_list_lock);
 
@@ -238,6 +500,13 @@ static void gxp_mailbox_handle_response(struct gxp_mailbox *mailbox,
 					AUR_OFF, false,
 					async_resp->memory_power_state,
 					AUR_MEM_UNDEFINED);
+				/*
+				 * The response may be freed as soon as it is
+				 * delivered, so check its state beforehand.
+				 */
+				admitted = async_resp->sched_state ==
+					   GXP_ASYNC_SCHED_ADMITTED;
+				gxp_mailbox_account_deadline(async_resp);
 
 				spin_lock_irqsave(async_resp->dest_queue_lock,
 						  flags);
@@ -276,11 +545,54 @@ static void gxp_mailbox_handle_response(struct gxp_mailbox *mailbox,
 	}
 
 	mutex_unlock(&mailbox->wait_list_lock);
+
+	return admitted;
+}
+
+/*
+ * Interrupts the device if the @count responses just consumed reached the
+ * watermark, or if the firmware has flagged that it is waiting for space in
+ * the response queue. A @count of 0 only checks the firmware's flags.
+ *
+ * Caller must hold resp_queue_lock.
+ */
+static void gxp_mailbox_notify_resp_space(struct gxp_mailbox *mailbox,
+					  u32 count)
+{
+	struct gxp_mailbox_stats *stats =
+		&mailbox->gxp->mailbox_mgr->stats[mailbox->core_id];
+	u32 fw_flags = READ_ONCE(mailbox->descriptor->resp_queue_flags);
+
+	if (count && (count == mailbox->resp_queue_size ||
+		      (fw_flags & GXP_MAILBOX_RESP_QUEUE_BLOCKED)))
+		stats->resp_queue_full_stalls++;
+	/*
+	 * The queue has been drained below the watermark, send an interrupt
+	 * to the device in case firmware is waiting for us to consume
+	 * responses.
+	 */
+	if ((count && count >= mailbox->resp_queue_watermark) || fw_flags) {
+		/*
+		 * Acknowledge the firmware's flags before notifying it, so
+		 * flags it sets again afterwards are not lost.
+		 */
+		if (fw_flags)
+			WRITE_ONCE(mailbox->descriptor->resp_queue_flags, 0);
+		/* TODO(b/190868834) define interrupt bits */
+		gxp_mailbox_generate_device_interrupt(mailbox, BIT(0));
+		stats->resp_queue_space_notifications++;
+	}
 }
 
 /*
  * Fetches elements in the response queue.
  *
+ * Consumed slots are handed back to the device after each batch, and the
+ * device is notified as soon as a batch frees enough space rather than once
+ * the whole fetch completes. The firmware's flags are checked once more after
+ * the queue is found empty, in case it blocked while the last batch was being
+ * copied.
+ *
  * Returns the pointer of fetched response elements.
  * @total_ptr will be the number of elements fetched.
  *
@@ -334,19 +646,12 @@ gxp_mailbox_fetch_responses(struct gxp_mailbox *mailbox, u32 *total_ptr)
 			total++;
 		}
 		head = circular_queue_inc(head, count, size);
+		gxp_mailbox_inc_resp_queue_head(mailbox, count);
+		gxp_mailbox_notify_resp_space(mailbox, count);
 	}
-	gxp_mailbox_inc_resp_queue_head(mailbox, total);
+	gxp_mailbox_notify_resp_space(mailbox, 0);
 
 	mutex_unlock(&mailbox->resp_queue_lock);
-	/*
-	 * Now that the response queue has been drained, send an interrupt
-	 * to the device in case firmware was waiting for us to consume
-	 * responses.
-	 */
-	if (total == size) {
-		/* TODO(b/190868834) define interrupt bits */
-		gxp_mailbox_generate_device_interrupt(mailbox, BIT(0));
-	}
 
 	*total_ptr = total;
 	return ret;
@@ -367,6 +672,7 @@ static void gxp_mailbox_consume_responses_work(struct kthread_work *work)
 	struct gxp_response *responses;
 	u32 i;
 	u32 count = 0;
+	u32 admitted = 0;
 
 	/* fetch responses and bump RESP_QUEUE_HEAD */
 	responses = gxp_mailbox_fetch_responses(mailbox, &count);
@@ -378,12 +684,20 @@ static void gxp_mailbox_consume_responses_work(struct kthread_work *work)
 	}
 
 	for (i = 0; i < count; i++)
-		gxp_mailbox_handle_response(mailbox, &responses[i]);
+		if (gxp_mailbox_handle_response(mailbox, &responses[i]))
+			admitted++;
 	/*
 	 * Responses handled, wake up threads that are waiting for a response.
 	 */
 	wake_up(&mailbox->wait_list_waitq);
 	kfree(responses);
+
+	/*
+	 * Also retry when no slot was freed, in case queued commands were held
+	 * back by a full command queue.
+	 */
+	if (mailbox->edf_window)
+		gxp_mailbox_edf_release(mailbox, admitted);
 }
 
 /*
@@ -447,6 +761,12 @@ static struct gxp_mailbox *create_mailbox(struct gxp_mailbox_manager *mgr,
 	mailbox->cmd_queue_tail = 0;
 	mutex_init(&mailbox->cmd_queue_lock);
 
+	mailbox->edf_queue = RB_ROOT_CACHED;
+	mailbox->edf_in_flight = 0;
+	mailbox->edf_window =
+		min_t(u32, gxp_mbx_inflight_window, mailbox->cmd_queue_size);
+	mutex_init(&mailbox->edf_lock);
+
 	/* Allocate and initialize the response queue */
 	mailbox->resp_queue = (struct gxp_response *)gxp_dma_alloc_coherent(
 		mailbox->gxp, vd, BIT(virt_core),
@@ -456,6 +776,8 @@ static struct gxp_mailbox *create_mailbox(struct gxp_mailbox_manager *mgr,
 		goto err_resp_queue;
 
 	mailbox->resp_queue_size = MBOX_RESP_QUEUE_NUM_ENTRIES;
+	mailbox->resp_queue_watermark =
+		clamp_val(gxp_mbx_resp_watermark, 1, mailbox->resp_queue_size);
 	mailbox->resp_queue_head = 0;
 	mutex_init(&mailbox->resp_queue_lock);
 
@@ -474,6 +796,9 @@ static struct gxp_mailbox *create_mailbox(struct gxp_mailbox_manager *mgr,
 		mailbox->resp_queue_device_addr;
 	mailbox->descriptor->cmd_queue_size = mailbox->cmd_queue_size;
 	mailbox->descriptor->resp_queue_size = mailbox->resp_queue_size;
+	mailbox->descriptor->resp_queue_watermark =
+		mailbox->resp_queue_watermark;
+	mailbox->descriptor->resp_queue_flags = 0;
 
 	kthread_init_worker(&mailbox->response_worker);
 	mailbox->response_thread = create_response_rt_thread(
@@ -660,38 +985,47 @@ void gxp_mailbox_reset(struct gxp_mailbox *mailbox)
 }
 
 /*
- * Adds @resp to @mailbox->wait_list.
+ * Adds @entry to @mailbox->wait_list, and sets up its response for the
+ * command @cmd. Unless @keep_seq is set, @cmd is assigned the next sequence
+ * number first. If @entry is NULL, only the sequence number is assigned.
  *
  * wait_list is a FIFO queue, with sequence number in increasing order.
+ * Assigning the sequence number under the same lock keeps it that way.
  *
- * Returns 0 on success, or -ENOMEM if failed on allocation.
+ * The entry is allocated by the caller before taking any locks, to keep
+ * allocations out of the command queue's critical section.
  */
-static int gxp_mailbox_push_wait_resp(struct gxp_mailbox *mailbox,
-				      struct gxp_response *resp, bool is_async)
+static void gxp_mailbox_push_wait_resp(struct gxp_mailbox *mailbox,
+				       struct gxp_command *cmd,
+				       struct gxp_mailbox_wait_list *entry,
+				       bool keep_seq)
 {
-	struct gxp_mailbox_wait_list *entry =
-		kzalloc(sizeof(*entry), GFP_KERNEL);
-
-	if (!entry)
-		return -ENOMEM;
-	entry->resp = resp;
-	entry->is_async = is_async;
 	mutex_lock(&mailbox->wait_list_lock);
-	list_add_tail(&entry->list, &mailbox->wait_list);
+	if (keep_seq)
+		mailbox->cur_seq = max(mailbox->cur_seq, cmd->seq + 1);
+	else
+		cmd->seq = mailbox->cur_seq++;
+	if (entry) {
+		entry->resp->seq = cmd->seq;
+		entry->resp->status = GXP_RESP_WAITING;
+		list_add_tail(&entry->list, &mailbox->wait_list);
+	}
 	mutex_unlock(&mailbox->wait_list_lock);
-
-	return 0;
 }
 
 /*
  * Removes the response previously pushed with gxp_mailbox_push_wait_resp().
  *
  * This is used when the kernel gives up waiting for the response.
+ *
+ * Returns false if @resp was not in the wait_list, because it has already been
+ * handled or flushed.
  */
-static void gxp_mailbox_del_wait_resp(struct gxp_mailbox *mailbox,
+static bool gxp_mailbox_del_wait_resp(struct gxp_mailbox *mailbox,
 				      struct gxp_response *resp)
 {
 	struct gxp_mailbox_wait_list *cur;
+	bool found = false;
 
 	mutex_lock(&mailbox->wait_list_lock);
 
@@ -707,70 +1041,131 @@ static void gxp_mailbox_del_wait_resp(struct gxp_mailbox *mailbox,
 		if (cur->resp->seq == resp->seq) {
 			list_del(&cur->list);
 			kfree(cur);
+			found = true;
 			break;
 		}
 	}
 
 	mutex_unlock(&mailbox->wait_list_lock);
+
+	return found;
 }
 
-static int gxp_mailbox_enqueue_cmd(struct gxp_mailbox *mailbox,
-				   struct gxp_command *cmd,
-				   struct gxp_response *resp,
-				   bool resp_is_async)
+/*
+ * Copies @cmd into the command queue and rings the doorbell. If @entry is not
+ * NULL, it is added to the wait_list for the command's response. See
+ * gxp_mailbox_push_wait_resp() for @keep_seq.
+ */
+static int gxp_mailbox_push_cmd(struct gxp_mailbox *mailbox,
+				struct gxp_command *cmd,
+				struct gxp_mailbox_wait_list *entry,
+				bool keep_seq)
 {
 	int ret;
-	u32 tail;
 
 	mutex_lock(&mailbox->cmd_queue_lock);
 
-	cmd->seq = mailbox->cur_seq;
-	/*
-	 * The lock ensures mailbox->cmd_queue_tail cannot be changed by
-	 * other processes (this method should be the only one to modify the
-	 * value of tail), therefore we can remember its value here and use it
-	 * in various places below.
-	 */
-	tail = mailbox->cmd_queue_tail;
-
 	/*
 	 * If the cmd queue is full, it's up to the caller to retry.
 	 */
-	if (gxp_mailbox_read_cmd_queue_head(mailbox) ==
-	    (tail ^ CIRCULAR_QUEUE_WRAP_BIT)) {
+	if (gxp_mailbox_cmd_queue_full(mailbox)) {
 		ret = -EAGAIN;
 		goto out;
 	}
 
-	if (resp) {
-		/*
-		 * Add @resp to the wait_list only if the cmd can be pushed
-		 * successfully.
-		 */
-		resp->seq = cmd->seq;
-		resp->status = GXP_RESP_WAITING;
-		ret = gxp_mailbox_push_wait_resp(mailbox, resp, resp_is_async);
-		if (ret)
-			goto out;
-	}
-	/* size of cmd_queue is a multiple of sizeof(*cmd) */
-	memcpy(mailbox->cmd_queue + CIRCULAR_QUEUE_REAL_INDEX(tail), cmd,
-	       sizeof(*cmd));
-	gxp_mailbox_inc_cmd_queue_tail(mailbox, 1);
-	/* triggers doorbell */
-	/* TODO(b/190868834) define interrupt bits */
-	gxp_mailbox_generate_device_interrupt(mailbox, BIT(0));
-	/* bumps sequence number after the command is sent */
-	mailbox->cur_seq++;
+	/*
+	 * Add the response to the wait_list only if the cmd can be pushed
+	 * successfully. Sequence numbers are assigned while holding the
+	 * cmd_queue_lock, so commands enter the ring in sequence order.
+	 */
+	gxp_mailbox_push_wait_resp(mailbox, cmd, entry, keep_seq);
+	gxp_mailbox_write_cmd(mailbox, cmd);
 	ret = 0;
 out:
 	mutex_unlock(&mailbox->cmd_queue_lock);
-	if (ret)
+
+	return ret;
+}
+
+static int gxp_mailbox_enqueue_cmd(struct gxp_mailbox *mailbox,
+				   struct gxp_command *cmd,
+				   struct gxp_response *resp,
+				   bool resp_is_async)
+{
+	struct gxp_mailbox_wait_list *entry = NULL;
+	int ret;
+
+	if (resp) {
+		entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+		if (!entry)
+			return -ENOMEM;
+		entry->resp = resp;
+		entry->is_async = resp_is_async;
+	}
+
+	ret = gxp_mailbox_push_cmd(mailbox, cmd, entry, /*keep_seq=*/false);
+	if (ret) {
+		kfree(entry);
 		dev_err(mailbox->gxp->dev, "%s: ret=%d", __func__, ret);
+	}
 
 	return ret;
 }
 
+/*
+ * Adds @entry for @async_resp to the wait_list and queues its command to be
+ * admitted into the command queue in deadline order. See
+ * gxp_mailbox_push_wait_resp() for @keep_seq.
+ *
+ * Returns the sequence number of the command. Once the edf_lock is released,
+ * @async_resp may already have been completed and freed, so callers must not
+ * read it back from @async_resp.
+ */
+static u64 gxp_mailbox_edf_submit(struct gxp_mailbox *mailbox,
+				  struct gxp_async_response *async_resp,
+				  struct gxp_mailbox_wait_list *entry,
+				  bool keep_seq)
+{
+	u64 seq;
+
+	/*
+	 * Hold the edf_lock from the moment the response can be found in the
+	 * wait_list, so a timeout worker which removes it cannot miss it in
+	 * `edf_queue`.
+	 */
+	mutex_lock(&mailbox->edf_lock);
+	gxp_mailbox_push_wait_resp(mailbox, &async_resp->cmd, entry, keep_seq);
+	seq = async_resp->cmd.seq;
+	gxp_mailbox_edf_insert(mailbox, async_resp);
+	gxp_mailbox_edf_admit(mailbox);
+	mutex_unlock(&mailbox->edf_lock);
+
+	return seq;
+}
+
+/*
+ * Like gxp_mailbox_enqueue_cmd(), but for async commands on a mailbox with an
+ * in-flight window. The command is only copied into the command queue once it
+ * is admitted by gxp_mailbox_edf_admit().
+ */
+static int gxp_mailbox_enqueue_cmd_edf(struct gxp_mailbox *mailbox,
+				       struct gxp_command *cmd,
+				       struct gxp_async_response *async_resp)
+{
+	struct gxp_mailbox_wait_list *entry;
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+	entry->resp = &async_resp->resp;
+	entry->is_async = true;
+
+	cmd->seq = gxp_mailbox_edf_submit(mailbox, async_resp, entry,
+					  /*keep_seq=*/false);
+
+	return 0;
+}
+
 int gxp_mailbox_execute_cmd(struct gxp_mailbox *mailbox,
 			    struct gxp_command *cmd, struct gxp_response *resp)
 {
@@ -798,10 +1193,24 @@ int gxp_mailbox_execute_cmd(struct gxp_mailbox *mailbox,
 	return resp->retval;
 }
 
+/* Asks for the core behind @mailbox to be restarted. */
+static void gxp_mailbox_request_recovery(struct gxp_mailbox *mailbox)
+{
+	struct gxp_mailbox_manager *mgr = mailbox->gxp->mailbox_mgr;
+
+	WRITE_ONCE(mailbox->recovery_requested, true);
+	schedule_work(&mgr->recovery_works[mailbox->core_id].work);
+}
+
 static void async_cmd_timeout_work(struct work_struct *work)
 {
 	struct gxp_async_response *async_resp = container_of(
 		work, struct gxp_async_response, timeout_work.work);
+	/*
+	 * Whether the command was sent to the firmware. Without an in-flight
+	 * window every command is sent as soon as it is enqueued.
+	 */
+	bool sent = true;
 	unsigned long flags;
 
 	/*
@@ -812,7 +1221,10 @@ static void async_cmd_timeout_work(struct work_struct *work)
 	 * Once this function has the wait_list_lock, no future response
 	 * processing will begin until this response has been removed.
 	 */
-	gxp_mailbox_del_wait_resp(async_resp->mailbox, &async_resp->resp);
+	if (gxp_mailbox_del_wait_resp(async_resp->mailbox, &async_resp->resp) &&
+	    gxp_mailbox_edf_cancel(async_resp->mailbox, async_resp) ==
+		    GXP_ASYNC_SCHED_QUEUED)
+		sent = false;
 
 	/*
 	 * Check if this response still has a valid destination queue, in case
@@ -822,7 +1234,18 @@ static void async_cmd_timeout_work(struct work_struct *work)
 	 */
 	spin_lock_irqsave(async_resp->dest_queue_lock, flags);
 	if (async_resp->dest_queue) {
+		/*
+		 * Request recovery before delivering the response, since the
+		 * mailbox may be released once the waiter has consumed it. A
+		 * command still waiting for a slot in the in-flight window
+		 * never reached the firmware, so its timeout does not show the
+		 * core has stopped responding.
+		 */
+		if (gxp_mbx_recover_on_timeout && sent)
+			gxp_mailbox_request_recovery(async_resp->mailbox);
+
 		async_resp->resp.status = GXP_RESP_CANCELLED;
+		gxp_mailbox_account_deadline(async_resp);
 		list_add_tail(&async_resp->list_entry, async_resp->dest_queue);
 		spin_unlock_irqrestore(async_resp->dest_queue_lock, flags);
 
@@ -849,7 +1272,9 @@ int gxp_mailbox_execute_cmd_async(struct gxp_mailbox *mailbox,
 				  wait_queue_head_t *queue_waitq,
 				  uint gxp_power_state, uint memory_power_state,
 				  bool requested_low_clkmux,
-				  struct gxp_eventfd *eventfd)
+				  struct gxp_eventfd *eventfd, u64 user_cookie,
+				  bool idempotent, u64 deadline,
+				  struct gxp_client_deadline_stats *deadline_stats)
 {
 	struct gxp_async_response *async_resp;
 	int ret;
@@ -865,6 +1290,11 @@ int gxp_mailbox_execute_cmd_async(struct gxp_mailbox *mailbox,
 	async_resp->gxp_power_state = gxp_power_state;
 	async_resp->memory_power_state = memory_power_state;
 	async_resp->requested_low_clkmux = requested_low_clkmux;
+	async_resp->user_cookie = user_cookie;
+	async_resp->cmd = *cmd;
+	async_resp->idempotent = idempotent;
+	async_resp->deadline = deadline;
+	async_resp->deadline_stats = deadline_stats;
 	if (eventfd && gxp_eventfd_get(eventfd))
 		async_resp->eventfd = eventfd;
 	else
@@ -877,14 +1307,21 @@ int gxp_mailbox_execute_cmd_async(struct gxp_mailbox *mailbox,
 	gxp_pm_update_requested_power_states(
 		mailbox->gxp, AUR_OFF, false, gxp_power_state,
 		requested_low_clkmux, AUR_MEM_UNDEFINED, memory_power_state);
-	ret = gxp_mailbox_enqueue_cmd(mailbox, cmd, &async_resp->resp,
-				      /* resp_is_async = */ true);
+	if (deadline && deadline_stats)
+		atomic64_inc(&deadline_stats->commands);
+	if (mailbox->edf_window)
+		ret = gxp_mailbox_enqueue_cmd_edf(mailbox, cmd, async_resp);
+	else
+		ret = gxp_mailbox_enqueue_cmd(mailbox, cmd, &async_resp->resp,
+					      /* resp_is_async = */ true);
 	if (ret)
 		goto err_free_resp;
 
 	return 0;
 
 err_free_resp:
+	if (deadline && deadline_stats)
+		atomic64_dec(&deadline_stats->commands);
 	gxp_pm_update_requested_power_states(mailbox->gxp, gxp_power_state,
 					     requested_low_clkmux, AUR_OFF, false,
 					     memory_power_state,
@@ -894,6 +1331,150 @@ err_free_resp:
 	return ret;
 }
 
+void gxp_mailbox_detach_pending(struct gxp_mailbox *mailbox,
+				struct list_head *pending)
+{
+	struct gxp_mailbox_wait_list *cur, *nxt;
+	struct gxp_async_response *async_resp;
+	unsigned long flags;
+
+	mutex_lock(&mailbox->wait_list_lock);
+	list_for_each_entry_safe(cur, nxt, &mailbox->wait_list, list) {
+		if (!cur->is_async)
+			continue;
+		list_del(&cur->list);
+		async_resp = container_of(cur->resp, struct gxp_async_response,
+					  resp);
+		/*
+		 * As in gxp_mailbox_release(), clearing the response's
+		 * destination queue stops a running timeout worker from
+		 * completing it.
+		 */
+		spin_lock_irqsave(async_resp->dest_queue_lock, flags);
+		async_resp->dest_queue = NULL;
+		spin_unlock_irqrestore(async_resp->dest_queue_lock, flags);
+		list_add_tail(&async_resp->list_entry, pending);
+		kfree(cur);
+	}
+	mutex_unlock(&mailbox->wait_list_lock);
+
+	list_for_each_entry(async_resp, pending, list_entry)
+		cancel_delayed_work_sync(&async_resp->timeout_work);
+
+	/* None of the detached commands is tracked by @mailbox any more */
+	mutex_lock(&mailbox->edf_lock);
+	list_for_each_entry(async_resp, pending, list_entry) {
+		if (async_resp->sched_state == GXP_ASYNC_SCHED_QUEUED)
+			rb_erase_cached(&async_resp->edf_node,
+					&mailbox->edf_queue);
+		async_resp->sched_state = GXP_ASYNC_SCHED_NONE;
+	}
+	mailbox->edf_in_flight = 0;
+	mutex_unlock(&mailbox->edf_lock);
+}
+
+/*
+ * Completes @async_resp, which is in no wait_list and has no pending timeout,
+ * with @status and delivers it to its destination queue.
+ */
+static void gxp_mailbox_complete_detached(struct gxp_dev *gxp,
+					  struct gxp_async_response *async_resp,
+					  u16 status)
+{
+	unsigned long flags;
+
+	gxp_pm_update_requested_power_states(
+		gxp, async_resp->gxp_power_state,
+		async_resp->requested_low_clkmux, AUR_OFF, false,
+		async_resp->memory_power_state, AUR_MEM_UNDEFINED);
+
+	spin_lock_irqsave(async_resp->dest_queue_lock, flags);
+	async_resp->resp.status = status;
+	gxp_mailbox_account_deadline(async_resp);
+	list_add_tail(&async_resp->list_entry, async_resp->dest_queue);
+	async_resp->dest_queue = NULL;
+	/*
+	 * As in gxp_mailbox_handle_response(), hold the dest_queue_lock until
+	 * the waiters have been notified, since they may free the response as
+	 * soon as it is released.
+	 */
+	if (async_resp->eventfd) {
+		gxp_eventfd_signal(async_resp->eventfd);
+		gxp_eventfd_put(async_resp->eventfd);
+	}
+	wake_up(async_resp->dest_queue_waitq);
+	spin_unlock_irqrestore(async_resp->dest_queue_lock, flags);
+}
+
+/*
+ * Re-sends the command of @async_resp on @mailbox with the sequence number it
+ * was originally assigned, so the client can still match its response.
+ */
+static int gxp_mailbox_replay_cmd(struct gxp_mailbox *mailbox,
+				  struct gxp_async_response *async_resp)
+{
+	struct gxp_mailbox_wait_list *entry;
+	int ret = 0;
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+	entry->resp = &async_resp->resp;
+	entry->is_async = true;
+
+	async_resp->mailbox = mailbox;
+	schedule_delayed_work(&async_resp->timeout_work,
+			      msecs_to_jiffies(MAILBOX_TIMEOUT));
+
+	/*
+	 * Replayed commands are sent in increasing sequence order, before any
+	 * new command, so the mailbox's sequence continues after them.
+	 */
+	async_resp->cmd.seq = async_resp->resp.seq;
+	if (mailbox->edf_window)
+		gxp_mailbox_edf_submit(mailbox, async_resp, entry,
+				       /*keep_seq=*/true);
+	else
+		ret = gxp_mailbox_push_cmd(mailbox, &async_resp->cmd, entry,
+					   /*keep_seq=*/true);
+
+	if (ret) {
+		cancel_delayed_work_sync(&async_resp->timeout_work);
+		kfree(entry);
+	}
+
+	return ret;
+}
+
+void gxp_mailbox_replay_pending(struct gxp_dev *gxp,
+				struct gxp_mailbox *mailbox,
+				struct list_head *pending,
+				struct list_head *dest_queue)
+{
+	struct gxp_async_response *async_resp, *nxt;
+	uint replayed = 0, aborted = 0;
+
+	list_for_each_entry_safe(async_resp, nxt, pending, list_entry) {
+		list_del(&async_resp->list_entry);
+		async_resp->dest_queue = dest_queue;
+
+		if (mailbox && async_resp->idempotent &&
+		    !gxp_mailbox_replay_cmd(mailbox, async_resp)) {
+			replayed++;
+			continue;
+		}
+
+		gxp_mailbox_complete_detached(gxp, async_resp,
+					      GXP_RESP_ABORTED);
+		aborted++;
+	}
+
+	if (replayed || aborted)
+		dev_notice(gxp->dev,
+			   "Pending mailbox commands: %u re-sent, %u aborted\n",
+			   replayed, aborted);
+}
+
 int gxp_mailbox_register_interrupt_handler(struct gxp_mailbox *mailbox,
 					   u32 int_bit,
 					   struct work_struct *handler)
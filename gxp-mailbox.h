@@ -8,6 +8,7 @@
 #define __GXP_MAILBOX_H__
 
 #include <linux/kthread.h>
+#include <linux/rbtree.h>
 
 #include "gxp-client.h"
 #include "gxp-internal.h"
@@ -67,6 +68,16 @@ struct gxp_response {
 	u32 retval;
 };
 
+/* How an async command is tracked by its mailbox's deadline scheduler */
+enum gxp_async_response_sched_state {
+	/* Not tracked, the command was sent straight to the command queue */
+	GXP_ASYNC_SCHED_NONE = 0,
+	/* Waiting on the host for a slot in the in-flight window */
+	GXP_ASYNC_SCHED_QUEUED = 1,
+	/* Sent to the command queue, holding a slot in the in-flight window */
+	GXP_ASYNC_SCHED_ADMITTED = 2,
+};
+
 /*
  * Wrapper struct for responses consumed by a thread other than the one which
  * sent the command.
@@ -101,12 +112,33 @@ struct gxp_async_response {
 	bool requested_low_clkmux;
 	/* gxp_eventfd to signal when the response completes. May be NULL */
 	struct gxp_eventfd *eventfd;
+	/* Opaque value supplied by the client, returned with the response */
+	u64 user_cookie;
+	/*
+	 * Copy of the command as submitted, so it can be re-sent if the core
+	 * is restarted before responding. `cmd.seq` is only kept up to date
+	 * for commands tracked by the deadline scheduler; `resp.seq` holds the
+	 * sequence number assigned to the command.
+	 */
+	struct gxp_command cmd;
+	/* Whether the command may be re-sent after the core is restarted */
+	bool idempotent;
+	/* Absolute CLOCK_MONOTONIC deadline in nanoseconds, or 0 if none */
+	u64 deadline;
+	/* Counters to update when the command completes. May be NULL */
+	struct gxp_client_deadline_stats *deadline_stats;
+	/* Protected by the owning mailbox's `edf_lock` */
+	enum gxp_async_response_sched_state sched_state;
+	/* Node in the owning mailbox's `edf_queue` while GXP_ASYNC_SCHED_QUEUED */
+	struct rb_node edf_node;
 };
 
 enum gxp_response_status {
 	GXP_RESP_OK = 0,
 	GXP_RESP_WAITING = 1,
 	GXP_RESP_CANCELLED = 2,
+	/* The core was restarted and the command could not be re-sent */
+	GXP_RESP_ABORTED = 3,
 };
 
 struct gxp_mailbox_wait_list {
@@ -121,8 +153,26 @@ struct gxp_mailbox_descriptor {
 	u64 resp_queue_device_addr;
 	u32 cmd_queue_size;
 	u32 resp_queue_size;
+	/*
+	 * Written by the host. Once the response queue has held at least this
+	 * many entries, the host sends a "space available" interrupt as soon
+	 * as it has drained the queue below this level.
+	 */
+	u32 resp_queue_watermark;
+	/*
+	 * Set by the firmware. A combination of the GXP_MAILBOX_RESP_QUEUE_*
+	 * flags below, describing why the firmware is waiting on the host to
+	 * consume responses. The host clears it before sending the "space
+	 * available" interrupt the flags asked for.
+	 */
+	u32 resp_queue_flags;
 };
 
+/* The firmware is close to filling the response queue */
+#define GXP_MAILBOX_RESP_QUEUE_NEAR_FULL BIT(0)
+/* The firmware is blocked on a full response queue */
+#define GXP_MAILBOX_RESP_QUEUE_BLOCKED BIT(1)
+
 #define GXP_MAILBOX_INT_BIT_COUNT 16
 
 struct gxp_mailbox {
@@ -153,13 +203,33 @@ struct gxp_mailbox {
 
 	struct gxp_response *resp_queue;
 	u32 resp_queue_size; /* size of resp queue */
+	u32 resp_queue_watermark; /* see `gxp_mailbox_descriptor` */
 	u32 resp_queue_head; /* offset within the resp queue */
 	dma_addr_t resp_queue_device_addr; /* device address for resp queue */
 	struct mutex resp_queue_lock; /* protects resp_queue */
 
+	/*
+	 * Async commands waiting for a slot in the in-flight window, ordered
+	 * by deadline. Commands without a deadline sort last, and commands
+	 * with equal deadlines keep their submission order.
+	 */
+	struct rb_root_cached edf_queue;
+	/* Number of async commands admitted and awaiting their response */
+	u32 edf_in_flight;
+	/*
+	 * Maximum value of `edf_in_flight`. If 0, async commands bypass
+	 * `edf_queue` and are sent straight to the command queue.
+	 */
+	u32 edf_window;
+	/* Protects `edf_queue`, `edf_in_flight` and commands' `sched_state` */
+	struct mutex edf_lock;
+
+	/* Set once a command timed out and the core should be restarted */
+	bool recovery_requested;
 	/* add to this list if a command needs to wait for a response */
 	struct list_head wait_list;
-	struct mutex wait_list_lock; /* protects wait_list */
+	/* protects wait_list, and `cur_seq` so both stay in sequence order */
+	struct mutex wait_list_lock;
 	/* queue for waiting for the wait_list to be consumed */
 	wait_queue_head_t wait_list_waitq;
 	/* to create our own realtime worker for handling responses */
@@ -170,10 +240,34 @@ struct gxp_mailbox {
 
 typedef void __iomem *(*get_mailbox_base_t)(struct gxp_dev *gxp, uint index);
 
+/*
+ * Per-core mailbox counters. These are kept by the manager so they survive
+ * the mailbox being released and re-allocated.
+ */
+struct gxp_mailbox_stats {
+	/*
+	 * Number of times the firmware may have stalled on the response
+	 * queue, either because the host found it full or because the
+	 * firmware flagged it was blocked.
+	 */
+	u64 resp_queue_full_stalls;
+	/* Number of "space available" interrupts sent to the firmware */
+	u64 resp_queue_space_notifications;
+};
+
+/* Restarts a core whose firmware stopped responding to commands */
+struct gxp_mailbox_recovery_work {
+	struct work_struct work;
+	struct gxp_dev *gxp;
+	uint core;
+};
+
 struct gxp_mailbox_manager {
 	struct gxp_dev *gxp;
 	u8 num_cores;
 	struct gxp_mailbox **mailboxes;
+	struct gxp_mailbox_stats *stats;
+	struct gxp_mailbox_recovery_work *recovery_works;
 	get_mailbox_base_t get_mailbox_csr_base;
 	get_mailbox_base_t get_mailbox_data_base;
 };
@@ -186,6 +280,13 @@ extern int gxp_mbx_timeout;
 struct gxp_mailbox_manager *gxp_mailbox_create_manager(struct gxp_dev *gxp,
 						       uint num_cores);
 
+/*
+ * Waits for any core restart requested by a timed out command to finish.
+ *
+ * The caller must not hold gxp->vd_semaphore.
+ */
+void gxp_mailbox_cancel_recovery(struct gxp_mailbox_manager *mgr);
+
 /*
  * The following functions all require their caller have locked
  * gxp->vd_semaphore for reading.
@@ -210,7 +311,35 @@ int gxp_mailbox_execute_cmd_async(struct gxp_mailbox *mailbox,
 				  wait_queue_head_t *queue_waitq,
 				  uint gxp_power_state, uint memory_power_state,
 				  bool requested_low_clkmux,
-				  struct gxp_eventfd *eventfd);
+				  struct gxp_eventfd *eventfd, u64 user_cookie,
+				  bool idempotent, u64 deadline,
+				  struct gxp_client_deadline_stats *deadline_stats);
+
+/*
+ * Moves every async command still waiting for a response on @mailbox to
+ * @pending, ordered by sequence number, and cancels their timeouts. The power
+ * votes and eventfd references held by the commands are kept. Must be called
+ * before @mailbox is released.
+ *
+ * The caller must have locked gxp->vd_semaphore for writing.
+ */
+void gxp_mailbox_detach_pending(struct gxp_mailbox *mailbox,
+				struct list_head *pending);
+
+/*
+ * Re-sends the idempotent commands in @pending, previously detached with
+ * gxp_mailbox_detach_pending(), on @mailbox with their original sequence
+ * numbers. All other commands, or every command if @mailbox is NULL, are
+ * completed with GXP_RESP_ABORTED and delivered to @dest_queue.
+ *
+ * @mailbox must not have had any command enqueued on it yet.
+ *
+ * The caller must have locked gxp->vd_semaphore for writing.
+ */
+void gxp_mailbox_replay_pending(struct gxp_dev *gxp,
+				struct gxp_mailbox *mailbox,
+				struct list_head *pending,
+				struct list_head *dest_queue);
 
 int gxp_mailbox_register_interrupt_handler(struct gxp_mailbox *mailbox,
 					   u32 int_bit,
@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Cache of recently unmapped user buffer mappings.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/sched.h>
+#include <linux/sizes.h>
+
+#include "gxp-mapping-cache.h"
+
+/*
+ * Maximum size, in bytes, of the user pages each virtual device keeps pinned
+ * for mappings which have been unmapped. 0 disables the cache.
+ */
+static ulong gxp_mapping_cache_budget = SZ_64M;
+module_param_named(mapping_cache_budget, gxp_mapping_cache_budget, ulong,
+		   0660);
+
+/* Size of the pages pinned by @mapping */
+static size_t gxp_mapping_pinned_bytes(struct gxp_mapping *mapping)
+{
+	return PAGE_ALIGN((mapping->host_address & ~PAGE_MASK) + mapping->size);
+}
+
+static void gxp_mapping_cache_remove_locked(struct gxp_mapping_cache *cache,
+					    struct gxp_mapping *mapping)
+{
+	list_del_init(&mapping->cache_entry);
+	cache->pinned_bytes -= gxp_mapping_pinned_bytes(mapping);
+}
+
+/*
+ * Moves stale mappings, and then the least recently cached ones, from @cache
+ * to @evicted until at most @target bytes are pinned by @cache.
+ *
+ * Caller must hold cache->lock.
+ */
+static void gxp_mapping_cache_evict_locked(struct gxp_mapping_cache *cache,
+					   size_t target,
+					   struct list_head *evicted)
+{
+	struct gxp_mapping *mapping, *tmp;
+
+	lockdep_assert_held(&cache->lock);
+
+	list_for_each_entry_safe(mapping, tmp, &cache->lru, cache_entry) {
+		if (gxp_mapping_is_stale(mapping)) {
+			gxp_mapping_cache_remove_locked(cache, mapping);
+			list_add_tail(&mapping->cache_entry, evicted);
+		}
+	}
+
+	while (cache->pinned_bytes > target) {
+		mapping = list_first_entry(&cache->lru, struct gxp_mapping,
+					   cache_entry);
+		gxp_mapping_cache_remove_locked(cache, mapping);
+		list_add_tail(&mapping->cache_entry, evicted);
+	}
+}
+
+bool gxp_mapping_cache_enabled(void)
+{
+	return READ_ONCE(gxp_mapping_cache_budget) != 0;
+}
+
+void gxp_mapping_cache_init(struct gxp_mapping_cache *cache)
+{
+	INIT_LIST_HEAD(&cache->lru);
+	cache->pinned_bytes = 0;
+	mutex_init(&cache->lock);
+}
+
+struct gxp_mapping *gxp_mapping_cache_lookup(struct gxp_mapping_cache *cache,
+					     u64 host_address, size_t size,
+					     uint virt_core_list,
+					     enum dma_data_direction dir)
+{
+	struct gxp_mapping *mapping, *tmp, *found = NULL;
+	LIST_HEAD(evicted);
+
+	mutex_lock(&cache->lock);
+
+	/* Prefer the most recently unmapped mapping */
+	list_for_each_entry_safe_reverse(mapping, tmp, &cache->lru,
+					 cache_entry) {
+		/* Only the process which mapped a buffer may reuse it */
+		if (mapping->notifier.mm != current->mm ||
+		    mapping->host_address != host_address ||
+		    mapping->size != size ||
+		    mapping->virt_core_list != virt_core_list ||
+		    mapping->dir != dir)
+			continue;
+
+		gxp_mapping_cache_remove_locked(cache, mapping);
+		if (gxp_mapping_is_stale(mapping)) {
+			list_add_tail(&mapping->cache_entry, &evicted);
+			continue;
+		}
+		found = mapping;
+		break;
+	}
+
+	mutex_unlock(&cache->lock);
+
+	gxp_mapping_put_list(&evicted);
+
+	return found;
+}
+
+void gxp_mapping_cache_insert(struct gxp_mapping_cache *cache,
+			      struct gxp_mapping *mapping)
+{
+	if (!gxp_mapping_get(mapping))
+		return;
+
+	gxp_mapping_cache_insert_batch(cache, &mapping, 1);
+}
+
+void gxp_mapping_cache_insert_batch(struct gxp_mapping_cache *cache,
+				    struct gxp_mapping **mappings, uint count)
+{
+	size_t budget = READ_ONCE(gxp_mapping_cache_budget);
+	struct gxp_mapping *mapping;
+	size_t bytes;
+	LIST_HEAD(evicted);
+	uint i;
+
+	mutex_lock(&cache->lock);
+
+	for (i = 0; i < count; i++) {
+		mapping = mappings[i];
+		if (!mapping)
+			continue;
+
+		bytes = gxp_mapping_pinned_bytes(mapping);
+		if (bytes > budget || gxp_mapping_is_stale(mapping)) {
+			list_add_tail(&mapping->cache_entry, &evicted);
+			continue;
+		}
+
+		gxp_mapping_cache_evict_locked(cache, budget - bytes, &evicted);
+		list_add_tail(&mapping->cache_entry, &cache->lru);
+		cache->pinned_bytes += bytes;
+	}
+
+	mutex_unlock(&cache->lock);
+
+	gxp_mapping_put_list(&evicted);
+}
+
+void gxp_mapping_cache_flush(struct gxp_mapping_cache *cache)
+{
+	LIST_HEAD(evicted);
+
+	mutex_lock(&cache->lock);
+	gxp_mapping_cache_evict_locked(cache, 0, &evicted);
+	mutex_unlock(&cache->lock);
+
+	gxp_mapping_put_list(&evicted);
+}
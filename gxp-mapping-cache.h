@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Cache of recently unmapped user buffer mappings.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+#ifndef __GXP_MAPPING_CACHE_H__
+#define __GXP_MAPPING_CACHE_H__
+
+#include <linux/dma-direction.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+
+#include "gxp-mapping.h"
+
+/*
+ * Keeps mappings alive after their buffer is unmapped, with their pages still
+ * pinned and mapped for the device, so mapping the same buffer again does not
+ * have to repeat that work.
+ */
+struct gxp_mapping_cache {
+	/* Cached mappings, least recently unmapped first */
+	struct list_head lru;
+	/* Size, in bytes, of the pages pinned by the cached mappings */
+	size_t pinned_bytes;
+	/* Protects `lru` and `pinned_bytes` */
+	struct mutex lock;
+};
+
+/*
+ * Returns whether unmapped mappings may be cached at all. Mappings created
+ * while the cache is disabled do not track their user range, and are never
+ * cached.
+ */
+bool gxp_mapping_cache_enabled(void);
+
+/* Initializes an empty mapping cache. */
+void gxp_mapping_cache_init(struct gxp_mapping_cache *cache);
+
+/**
+ * gxp_mapping_cache_lookup() - Take a cached mapping of a user buffer
+ * @cache: The cache to search
+ * @host_address: The user-space address of the buffer
+ * @size: The size of the buffer
+ * @virt_core_list: The cores the buffer must be mapped to
+ * @dir: The DMA direction the buffer must be mapped with
+ *
+ * Only a mapping created by the current process with exactly the same
+ * parameters is returned, and only if its user range has not changed since.
+ *
+ * Return: The mapping, removed from @cache, with a reference the caller owns,
+ *         or NULL if there is no such mapping.
+ */
+struct gxp_mapping *gxp_mapping_cache_lookup(struct gxp_mapping_cache *cache,
+					     u64 host_address, size_t size,
+					     uint virt_core_list,
+					     enum dma_data_direction dir);
+
+/**
+ * gxp_mapping_cache_insert() - Keep an unmapped mapping for later reuse
+ * @cache: The cache of the virtual device @mapping was created for
+ * @mapping: A mapping created with gxp_mapping_create(), no longer stored in
+ *           its virtual device's records
+ *
+ * Acquires a reference to @mapping if it is cached. The least recently cached
+ * mappings are released to keep @cache within its pinned memory budget.
+ */
+void gxp_mapping_cache_insert(struct gxp_mapping_cache *cache,
+			      struct gxp_mapping *mapping);
+
+/**
+ * gxp_mapping_cache_insert_batch() - Keep several unmapped mappings for reuse
+ * @cache: The cache of the virtual device the mappings were created for
+ * @mappings: Array of @count mappings created with gxp_mapping_create(), no
+ *            longer stored in their virtual device's records; NULL entries
+ *            are skipped
+ * @count: The number of entries in @mappings
+ *
+ * Takes over the caller's reference to each of @mappings. Mappings which
+ * cannot be cached are released together with the ones evicted to make room.
+ */
+void gxp_mapping_cache_insert_batch(struct gxp_mapping_cache *cache,
+				    struct gxp_mapping **mappings, uint count);
+
+/* Releases all mappings held by @cache. */
+void gxp_mapping_cache_flush(struct gxp_mapping_cache *cache);
+
+#endif /* __GXP_MAPPING_CACHE_H__ */
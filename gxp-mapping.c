@@ -8,36 +8,154 @@
 #include <linux/dma-mapping.h>
 #include <linux/mm.h>
 #include <linux/mmap_lock.h>
+#include <linux/moduleparam.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/workqueue.h>
 
 #include "gxp-debug-dump.h"
 #include "gxp-dma.h"
 #include "gxp-internal.h"
 #include "gxp-mapping.h"
+#include "gxp-mapping-cache.h"
+#include "gxp-vd.h"
 #include "mm-backport.h"
 
-/* Destructor for a mapping created with `gxp_mapping_create()` */
-static void destroy_mapping(struct gxp_mapping *mapping)
+/*
+ * Maximum number of pages pinned by a single call to `pin_user_pages_fast`.
+ * 512 pages covers 2MB with 4KB pages.
+ */
+#define GXP_PIN_CHUNK_PAGES 512
+
+/*
+ * If set, mappings whose last reference is released are unpinned and freed by
+ * a background worker, instead of by the thread releasing them. They are always
+ * unmapped by the releasing thread.
+ */
+static bool gxp_mapping_async_release = true;
+module_param_named(mapping_async_release, gxp_mapping_async_release, bool,
+		   0660);
+
+static bool gxp_mapping_invalidate(struct mmu_interval_notifier *mni,
+				   const struct mmu_notifier_range *range,
+				   unsigned long cur_seq)
 {
-	struct sg_page_iter sg_iter;
-	struct page *page;
+	/*
+	 * The pinned pages remain valid for the device to access, so there is
+	 * nothing to tear down. Only record that the user range changed, so the
+	 * mapping is not handed out again by the mapping cache.
+	 */
+	mmu_interval_set_seq(mni, cur_seq);
 
-	mutex_destroy(&mapping->vlock);
-	mutex_destroy(&mapping->sync_lock);
+	return true;
+}
+
+static const struct mmu_interval_notifier_ops gxp_mapping_notifier_ops = {
+	.invalidate = gxp_mapping_invalidate,
+};
+
+/*
+ * Returns the largest page size in @pgsize_bitmap which is no larger than
+ * @size and to which @addr_merge is aligned, mirroring how the IOMMU core
+ * picks page sizes when mapping.
+ */
+static size_t gxp_mapping_pgsize(unsigned long pgsize_bitmap,
+				 unsigned long addr_merge, size_t size)
+{
+	unsigned long pgsizes = pgsize_bitmap & GENMASK(__fls(size), 0);
+
+	if (addr_merge)
+		pgsizes &= GENMASK(__ffs(addr_merge), 0);
+	if (!pgsizes)
+		return PAGE_SIZE;
+
+	return BIT(__fls(pgsizes));
+}
+
+/* Fills in `pgsize_counts` once @mapping has been mapped. */
+static void gxp_mapping_count_pgsizes(struct gxp_mapping *mapping,
+				      unsigned long pgsize_bitmap)
+{
+	struct scatterlist *sg;
+	dma_addr_t iova = sg_dma_address(mapping->sgt.sgl);
+	phys_addr_t paddr;
+	size_t len, pgsize;
+	uint order;
+	int i;
 
 	/*
-	 * Unmap the user pages
-	 *
-	 * Normally on unmap, the entire mapping is synced back to the CPU.
-	 * Since mappings are made at a page granularity regardless of the
-	 * underlying buffer's size, they can cover other data as well. If a
-	 * user requires a mapping be synced before unmapping, they are
-	 * responsible for calling `gxp_mapping_sync()` before hand.
+	 * User pages are mapped without any padding between scatterlist
+	 * entries, since they all start and end on page boundaries.
 	 */
-	gxp_dma_unmap_sg(mapping->gxp, mapping->vd, mapping->virt_core_list,
-			 mapping->sgt.sgl, mapping->sgt.orig_nents,
-			 mapping->dir, DMA_ATTR_SKIP_CPU_SYNC);
+	for_each_sg(mapping->sgt.sgl, sg, mapping->sgt.orig_nents, i) {
+		paddr = sg_phys(sg);
+		len = sg->length;
+		while (len) {
+			pgsize = gxp_mapping_pgsize(pgsize_bitmap,
+						    iova | paddr, len);
+			order = min_t(uint, ilog2(pgsize) - PAGE_SHIFT,
+				      GXP_MAPPING_NUM_PGSIZE_ORDERS - 1);
+			mapping->pgsize_counts[order]++;
+			iova += pgsize;
+			paddr += pgsize;
+			len -= pgsize;
+		}
+	}
+}
+
+/*
+ * Records the offset of each of @mapping's scatterlist entries, so
+ * gxp_mapping_sync() can find the entries covering a range without walking
+ * the whole list.
+ */
+static int gxp_mapping_index_sg(struct gxp_mapping *mapping)
+{
+	struct scatterlist *sg;
+	size_t cur_offset = 0;
+	int i;
+
+	mapping->sg_offsets = kvmalloc_array(mapping->sgt.orig_nents + 1,
+					     sizeof(*mapping->sg_offsets),
+					     GFP_KERNEL);
+	if (!mapping->sg_offsets)
+		return -ENOMEM;
+
+	for_each_sg(mapping->sgt.sgl, sg, mapping->sgt.orig_nents, i) {
+		mapping->sg_offsets[i] = cur_offset;
+		cur_offset += sg->length;
+	}
+	mapping->sg_offsets[i] = cur_offset;
+
+	return 0;
+}
+
+/*
+ * Returns the index of the scatterlist entry of @mapping containing @offset,
+ * which must be less than the total length of the entries.
+ */
+static uint gxp_mapping_find_sg(struct gxp_mapping *mapping, size_t offset)
+{
+	uint lo = 0, hi = mapping->sgt.orig_nents - 1, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (mapping->sg_offsets[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+/*
+ * Releases the user pages and book-keeping of a mapping created with
+ * `gxp_mapping_create()`, once it has been unmapped by `unmap_mapping_list()`.
+ */
+static void release_mapping(struct gxp_mapping *mapping)
+{
+	struct sg_page_iter sg_iter;
+	struct page *page;
 
 	/* Unpin the user pages */
 	for_each_sg_page(mapping->sgt.sgl, &sg_iter, mapping->sgt.orig_nents,
@@ -52,8 +170,130 @@ static void destroy_mapping(struct gxp_mapping *mapping)
 	}
 
 	/* Free the mapping book-keeping */
+	kvfree(mapping->sg_offsets);
 	sg_free_table(&mapping->sgt);
-	kfree(mapping);
+	kfree_rcu(mapping, rcu);
+}
+
+/*
+ * Removes a mapping created with `gxp_mapping_create()` from its core domains,
+ * with the IOTLB invalidation deferred to @batch.
+ */
+static void unmap_mapping(struct gxp_mapping *mapping,
+			  struct gxp_dma_unmap_batch *batch)
+{
+	if (mapping->notifier.mm)
+		mmu_interval_notifier_remove(&mapping->notifier);
+	mutex_destroy(&mapping->vlock);
+
+	/*
+	 * Unmap the user pages
+	 *
+	 * Normally on unmap, the entire mapping is synced back to the CPU.
+	 * Since mappings are made at a page granularity regardless of the
+	 * underlying buffer's size, they can cover other data as well. If a
+	 * user requires a mapping be synced before unmapping, they are
+	 * responsible for calling `gxp_mapping_sync()` before hand.
+	 */
+	gxp_dma_unmap_sg_cores(mapping->gxp, batch, mapping->virt_core_list,
+			       mapping->sgt.sgl, mapping->sgt.orig_nents);
+}
+
+/*
+ * Unmaps the mappings created with `gxp_mapping_create()` on @list, all
+ * belonging to the same virtual device, invalidating each core domain's IOTLB
+ * only once for the whole list and returning their IOVAs to the allocator.
+ */
+static void unmap_mapping_list(struct list_head *list)
+{
+	struct gxp_mapping *mapping;
+	struct gxp_dma_unmap_batch batch;
+	struct gxp_dev *gxp;
+
+	mapping = list_first_entry(list, struct gxp_mapping, cache_entry);
+	gxp = mapping->gxp;
+	gxp_dma_unmap_batch_init(&batch, mapping->vd);
+	list_for_each_entry(mapping, list, cache_entry)
+		unmap_mapping(mapping, &batch);
+	gxp_dma_unmap_batch_sync(gxp, &batch);
+
+	list_for_each_entry(mapping, list, cache_entry)
+		gxp_dma_unmap_sg_finish(gxp, mapping->vd, mapping->sgt.sgl,
+					mapping->sgt.orig_nents, mapping->dir,
+					DMA_ATTR_SKIP_CPU_SYNC);
+}
+
+static void release_mapping_list(struct list_head *list)
+{
+	struct gxp_mapping *mapping, *tmp;
+
+	list_for_each_entry_safe(mapping, tmp, list, cache_entry)
+		release_mapping(mapping);
+}
+
+static void gxp_mapping_release_work(struct work_struct *work)
+{
+	struct gxp_mapping_release_queue *queue =
+		container_of(work, struct gxp_mapping_release_queue, work);
+	LIST_HEAD(list);
+
+	spin_lock(&queue->lock);
+	list_splice_init(&queue->list, &list);
+	spin_unlock(&queue->lock);
+
+	release_mapping_list(&list);
+}
+
+/*
+ * Destroys the mappings on @list, which belong to the same virtual device.
+ *
+ * The mappings are unmapped right away, so the device can no longer reach
+ * their pages once this returns. Unpinning the pages and freeing the mappings
+ * is done either right away too, or in the background depending on
+ * `gxp_mapping_async_release`.
+ */
+static void destroy_or_queue_mapping_list(struct list_head *list)
+{
+	struct gxp_mapping_release_queue *queue;
+
+	if (list_empty(list))
+		return;
+
+	unmap_mapping_list(list);
+
+	if (!READ_ONCE(gxp_mapping_async_release)) {
+		release_mapping_list(list);
+		return;
+	}
+
+	queue = &list_first_entry(list, struct gxp_mapping, cache_entry)
+			 ->vd->release_queue;
+	spin_lock(&queue->lock);
+	list_splice_tail_init(list, &queue->list);
+	spin_unlock(&queue->lock);
+
+	queue_work(system_unbound_wq, &queue->work);
+}
+
+/* Destructor for a mapping created with `gxp_mapping_create()` */
+static void destroy_mapping(struct gxp_mapping *mapping)
+{
+	LIST_HEAD(list);
+
+	list_add(&mapping->cache_entry, &list);
+	destroy_or_queue_mapping_list(&list);
+}
+
+void gxp_mapping_release_queue_init(struct gxp_mapping_release_queue *queue)
+{
+	INIT_LIST_HEAD(&queue->list);
+	spin_lock_init(&queue->lock);
+	INIT_WORK(&queue->work, gxp_mapping_release_work);
+}
+
+void gxp_mapping_release_queue_flush(struct gxp_mapping_release_queue *queue)
+{
+	flush_work(&queue->work);
 }
 
 struct gxp_mapping *gxp_mapping_create(struct gxp_dev *gxp,
@@ -64,6 +304,8 @@ struct gxp_mapping *gxp_mapping_create(struct gxp_dev *gxp,
 {
 	struct gxp_mapping *mapping = NULL;
 	uint num_pages = 0;
+	uint pinned, chunk;
+	unsigned long pgsize_bitmap;
 	struct page **pages;
 	ulong offset;
 	int ret, i;
@@ -104,6 +346,32 @@ struct gxp_mapping *gxp_mapping_create(struct gxp_dev *gxp,
 	if ((size + offset) % PAGE_SIZE)
 		num_pages++;
 
+	/* Initialize mapping book-keeping */
+	mapping = kzalloc(sizeof(*mapping), GFP_KERNEL);
+	if (!mapping)
+		return ERR_PTR(-ENOMEM);
+
+	/*
+	 * Start tracking the user range before the pages are pinned, so any
+	 * change to the range after they are looked up is noticed. The range
+	 * only needs tracking if the mapping may be reused from the cache.
+	 */
+	if (gxp_mapping_cache_enabled()) {
+		ret = mmu_interval_notifier_insert(&mapping->notifier,
+						   current->mm,
+						   user_address & PAGE_MASK,
+						   (ulong)num_pages * PAGE_SIZE,
+						   &gxp_mapping_notifier_ops);
+		if (ret) {
+			dev_err(gxp->dev,
+				"Failed to track user range (ret=%d)\n", ret);
+			kfree(mapping);
+			return ERR_PTR(ret);
+		}
+		mapping->notifier_seq =
+			mmu_interval_read_begin(&mapping->notifier);
+	}
+
 	/*
 	 * "num_pages" is decided from user-space arguments, don't show warnings
 	 * when facing malicious input.
@@ -112,44 +380,51 @@ struct gxp_mapping *gxp_mapping_create(struct gxp_dev *gxp,
 	if (!pages) {
 		dev_err(gxp->dev, "Failed to alloc pages for mapping: num_pages=%u",
 			num_pages);
-		return ERR_PTR(-ENOMEM);
+		ret = -ENOMEM;
+		goto error_remove_notifier;
 	}
 
 	/*
-	 * Provide protection around `pin_user_pages_fast` since it fails if
-	 * called by more than one thread simultaneously.
+	 * `pin_user_pages_fast` may pin fewer pages than requested, e.g. when
+	 * it falls back to the slow path part-way through a range another
+	 * thread is faulting in at the same time. Rather than treating that as
+	 * a failure, continue from the first page which was not pinned.
+	 *
+	 * Pages are pinned a chunk at a time, yielding in between, so large
+	 * buffers do not hold up other threads mapping their own buffers.
 	 */
-	mutex_lock(&gxp->pin_user_pages_lock);
-	ret = pin_user_pages_fast(user_address & PAGE_MASK, num_pages,
-				  foll_flags, pages);
-	if (ret == -EFAULT && !vma) {
-		dev_warn(gxp->dev,
-			 "pin failed with fault, assuming buffer is read-only");
-		ret = pin_user_pages_fast(user_address & PAGE_MASK, num_pages,
-					  foll_flags & ~FOLL_WRITE, pages);
+	pinned = 0;
+	while (pinned < num_pages) {
+		chunk = min_t(uint, num_pages - pinned, GXP_PIN_CHUNK_PAGES);
+		ret = pin_user_pages_fast((user_address & PAGE_MASK) +
+						  (ulong)pinned * PAGE_SIZE,
+					  chunk, foll_flags, pages + pinned);
+		if (ret == -EFAULT && !vma && (foll_flags & FOLL_WRITE)) {
+			dev_warn(gxp->dev,
+				 "pin failed with fault, assuming buffer is read-only");
+			foll_flags &= ~FOLL_WRITE;
+			continue;
+		}
+		if (ret <= 0)
+			break;
+		pinned += ret;
+		cond_resched();
 	}
-	mutex_unlock(&gxp->pin_user_pages_lock);
 	if (ret == -ENOMEM)
 		dev_err(gxp->dev, "system out of memory locking %u pages",
 			num_pages);
 	if (ret == -EFAULT)
 		dev_err(gxp->dev, "address fault mapping %s buffer",
 			dir == DMA_TO_DEVICE ? "read-only" : "writeable");
-	if (ret < 0 || ret < num_pages) {
+	if (pinned < num_pages) {
 		dev_dbg(gxp->dev,
-			"Get user pages failed: user_add=%pK, num_pages=%u, ret=%d\n",
-			(void *)user_address, num_pages, ret);
-		num_pages = ret < 0 ? 0 : ret;
-		ret = ret >= 0 ? -EFAULT : ret;
+			"Get user pages failed: user_add=%pK, num_pages=%u, pinned=%u, ret=%d\n",
+			(void *)user_address, num_pages, pinned, ret);
+		num_pages = pinned;
+		ret = ret < 0 ? ret : -EFAULT;
 		goto error_unpin_pages;
 	}
 
-	/* Initialize mapping book-keeping */
-	mapping = kzalloc(sizeof(*mapping), GFP_KERNEL);
-	if (!mapping) {
-		ret = -ENOMEM;
-		goto error_unpin_pages;
-	}
 	refcount_set(&mapping->refcount, 1);
 	mapping->destructor = destroy_mapping;
 	mapping->host_address = user_address;
@@ -177,26 +452,49 @@ struct gxp_mapping *gxp_mapping_create(struct gxp_dev *gxp,
 		goto error_free_sgt;
 	}
 	mapping->sgt.nents = ret;
-	mapping->device_address =
-		sg_dma_address(mapping->sgt.sgl) + offset;
+	mapping->device_address = sg_dma_address(mapping->sgt.sgl) + offset;
+	pgsize_bitmap =
+		vd->core_domains[ffs(virt_core_list) - 1]->pgsize_bitmap;
+	gxp_mapping_count_pgsizes(mapping, pgsize_bitmap);
+
+	ret = gxp_mapping_index_sg(mapping);
+	if (ret)
+		goto error_unmap_sg;
 
-	mutex_init(&mapping->sync_lock);
 	mutex_init(&mapping->vlock);
+	INIT_LIST_HEAD(&mapping->cache_entry);
 
 	kvfree(pages);
 	return mapping;
 
+error_unmap_sg:
+	gxp_dma_unmap_sg(gxp, mapping->vd, mapping->virt_core_list,
+			 mapping->sgt.sgl, mapping->sgt.orig_nents,
+			 mapping->dir, DMA_ATTR_SKIP_CPU_SYNC);
 error_free_sgt:
 	sg_free_table(&mapping->sgt);
-	kfree(mapping);
 error_unpin_pages:
 	for (i = 0; i < num_pages; i++)
 		unpin_user_page(pages[i]);
 	kvfree(pages);
+error_remove_notifier:
+	if (mapping->notifier.mm)
+		mmu_interval_notifier_remove(&mapping->notifier);
+	kfree(mapping);
 
 	return ERR_PTR(ret);
 }
 
+bool gxp_mapping_is_stale(struct gxp_mapping *mapping)
+{
+	/* Without a notifier, changes to the range cannot be ruled out */
+	if (!mapping->notifier.mm)
+		return true;
+
+	return mmu_interval_check_retry(&mapping->notifier,
+					mapping->notifier_seq);
+}
+
 bool gxp_mapping_get(struct gxp_mapping *mapping)
 {
 	return refcount_inc_not_zero(&mapping->refcount);
@@ -209,14 +507,33 @@ void gxp_mapping_put(struct gxp_mapping *mapping)
 		mapping->destructor(mapping);
 }
 
+void gxp_mapping_put_list(struct list_head *list)
+{
+	struct gxp_mapping *mapping, *tmp;
+	LIST_HEAD(released);
+
+	list_for_each_entry_safe(mapping, tmp, list, cache_entry) {
+		list_del_init(&mapping->cache_entry);
+		if (!refcount_dec_and_test(&mapping->refcount))
+			continue;
+		if (mapping->destructor != destroy_mapping) {
+			mapping->destructor(mapping);
+			continue;
+		}
+		list_add_tail(&mapping->cache_entry, &released);
+	}
+
+	destroy_or_queue_mapping_list(&released);
+}
+
 int gxp_mapping_sync(struct gxp_mapping *mapping, u32 offset, u32 size,
 		     bool for_cpu)
 {
 	struct gxp_dev *gxp = mapping->gxp;
-	struct scatterlist *sg, *start_sg = NULL, *end_sg = NULL;
-	int nelems = 0, cur_offset = 0, ret = 0, i;
-	u64 start, end;
-	unsigned int start_diff = 0, end_diff = 0;
+	u64 start, end, seg_start, seg_end;
+	uint first, last, i;
+	dma_addr_t base;
+	int ret = 0;
 
 	if (!gxp_mapping_get(mapping))
 		return -ENODEV;
@@ -244,67 +561,29 @@ int gxp_mapping_sync(struct gxp_mapping *mapping, u32 offset, u32 size,
 	 * which is not part of the mapped buffer may be present in the first
 	 * and last pages of the buffer's scattergather list.
 	 *
-	 * To ensure only the intended data is actually synced, iterate through
-	 * the scattergather list, to find the first and last `scatterlist`s
-	 * which contain the range of the buffer to sync.
+	 * To ensure only the intended data is actually synced, look up the
+	 * first and last `scatterlist`s which contain the range of the buffer
+	 * to sync, and sync only the requested part of each entry in between.
 	 *
-	 * After those links are found, change their offset/lengths so that
-	 * `dma_map_sg_for_*()` will only sync the requested region.
+	 * The scattergather list is mapped to contiguous device addresses, and
+	 * each of its entries is physically contiguous, so every part can be
+	 * synced by device address without modifying the shared list. This
+	 * allows disjoint ranges of a mapping to be synced concurrently.
 	 */
 	start = (mapping->host_address & ~PAGE_MASK) + offset;
 	end = start + size;
-	for_each_sg(mapping->sgt.sgl, sg, mapping->sgt.orig_nents, i) {
-		if (end <= cur_offset)
-			break;
-		if (cur_offset <= start && start < cur_offset + sg->length) {
-			start_sg = sg;
-			start_diff = start - cur_offset;
-		}
-		if (start_sg)
-			nelems++;
-		cur_offset += sg->length;
-		end_sg = sg;
+	first = gxp_mapping_find_sg(mapping, start);
+	last = gxp_mapping_find_sg(mapping, end - 1);
+	base = sg_dma_address(mapping->sgt.sgl);
+
+	for (i = first; i <= last; i++) {
+		seg_start = max_t(u64, start, mapping->sg_offsets[i]);
+		seg_end = min_t(u64, end, mapping->sg_offsets[i + 1]);
+		gxp_dma_sync_vd_range(gxp, mapping->vd,
+				      mapping->virt_core_list,
+				      base + seg_start, seg_end - seg_start,
+				      mapping->dir, for_cpu);
 	}
-	end_diff = cur_offset - end;
-
-	/* Make sure a valid starting scatterlist was found for the start */
-	if (!start_sg) {
-		ret = -EINVAL;
-		goto out;
-	}
-
-	/*
-	 * Since the scatter-gather list of the mapping is modified while it is
-	 * being synced, only one sync for a given mapping can occur at a time.
-	 * Rather than maintain a mutex for every mapping, lock the mapping list
-	 * mutex, making all syncs mutually exclusive.
-	 */
-	mutex_lock(&mapping->sync_lock);
-
-	start_sg->offset += start_diff;
-	start_sg->dma_address += start_diff;
-	start_sg->length -= start_diff;
-	start_sg->dma_length -= start_diff;
-	end_sg->length -= end_diff;
-	end_sg->dma_length -= end_diff;
-
-	if (for_cpu)
-		gxp_dma_sync_sg_for_cpu(gxp, start_sg, nelems, mapping->dir);
-	else
-		gxp_dma_sync_sg_for_device(gxp, start_sg, nelems, mapping->dir);
-
-	/*
-	 * Return the start and end scatterlists' offset/lengths to their
-	 * original values for the next time they need to be synced/unmapped.
-	 */
-	end_sg->length += end_diff;
-	end_sg->dma_length += end_diff;
-	start_sg->offset -= start_diff;
-	start_sg->dma_address -= start_diff;
-	start_sg->length += start_diff;
-	start_sg->dma_length += start_diff;
-
-	mutex_unlock(&mapping->sync_lock);
 
 out:
 	gxp_mapping_put(mapping);
@@ -8,16 +8,31 @@
 #define __GXP_MAPPING_H__
 
 #include <linux/dma-direction.h>
+#include <linux/interval_tree.h>
+#include <linux/list.h>
+#include <linux/mmu_notifier.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/rbtree.h>
 #include <linux/refcount.h>
 #include <linux/scatterlist.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 #include "gxp-internal.h"
 
+/*
+ * Number of IOMMU page sizes, from PAGE_SIZE upwards in powers of two, whose
+ * use is counted for each mapping. Larger pages are counted in the last entry.
+ */
+#define GXP_MAPPING_NUM_PGSIZE_ORDERS 19
+
 struct gxp_mapping {
-	struct rb_node node;
+	/* Node in the VD's index of mappings by device address range */
+	struct interval_tree_node device_node;
+	/* Node in the VD's index of user buffer mappings by host address range */
+	struct interval_tree_node host_node;
 	refcount_t refcount;
 	void (*destructor)(struct gxp_mapping *mapping);
 	/*
@@ -39,11 +54,20 @@ struct gxp_mapping {
 	 */
 	dma_addr_t device_address;
 	size_t size;
+	/*
+	 * Number of IOMMU pages, of each size from PAGE_SIZE upwards, the
+	 * mapping is expected to use in each core's domain.
+	 */
+	u32 pgsize_counts[GXP_MAPPING_NUM_PGSIZE_ORDERS];
 	uint gxp_dma_flags;
 	enum dma_data_direction dir;
 	struct sg_table sgt;
-	/* A mapping can only be synced by one thread at a time */
-	struct mutex sync_lock;
+	/*
+	 * Offset of each entry of `sgt` from the start of the mapped pages,
+	 * followed by the total length, so the entries covering a range can
+	 * be found by binary search.
+	 */
+	size_t *sg_offsets;
 	/*
 	 * `virtual_address` and `page_count` are set when gxp_mapping_vmap(..)
 	 * is called, and unset when gxp_mapping_vunmap(..) is called
@@ -53,6 +77,33 @@ struct gxp_mapping {
 	uint vmap_count;
 	/* Protects `virtual_address`, `page_count`, and `vmap_count` */
 	struct mutex vlock;
+	/*
+	 * Tracks changes to the user address range the mapping was created
+	 * from, so the mapping is not reused by the VD's mapping cache once
+	 * its pinned pages no longer back that range. Only registered if the
+	 * cache was enabled when the mapping was created; `notifier.mm` is
+	 * NULL otherwise.
+	 */
+	struct mmu_interval_notifier notifier;
+	unsigned long notifier_seq;
+	/* Entry in the VD's mapping cache, protected by the cache's lock */
+	struct list_head cache_entry;
+	/*
+	 * VD mapping lookups run without locks, so mappings are only freed
+	 * once no lookup can still be reading them.
+	 */
+	struct rcu_head rcu;
+};
+
+/*
+ * Mappings of a virtual device whose last reference has been released, already
+ * unmapped and waiting to be unpinned and freed in the background.
+ */
+struct gxp_mapping_release_queue {
+	struct list_head list;
+	/* Protects `list` */
+	spinlock_t lock;
+	struct work_struct work;
 };
 
 /**
@@ -81,6 +132,17 @@ struct gxp_mapping *gxp_mapping_create(struct gxp_dev *gxp,
 				       size_t size, u32 flags,
 				       enum dma_data_direction dir);
 
+/**
+ * gxp_mapping_is_stale() - Check whether a mapping's user range has changed
+ * @mapping: A mapping created with gxp_mapping_create()
+ *
+ * Return: True if the user address range @mapping was created from may have
+ *         been unmapped or remapped since, in which case the pinned pages of
+ *         @mapping may no longer be the ones backing that range. Always true
+ *         for mappings which do not track their range.
+ */
+bool gxp_mapping_is_stale(struct gxp_mapping *mapping);
+
 /**
  * gxp_mapping_get() - Increment a mapping's reference count
  * @map: The mapping to obtain a reference to
@@ -96,6 +158,34 @@ bool gxp_mapping_get(struct gxp_mapping *mapping);
  */
 void gxp_mapping_put(struct gxp_mapping *mapping);
 
+/**
+ * gxp_mapping_put_list() - Release a reference to each mapping in a list
+ * @list: Mappings linked through their `cache_entry`; emptied on return
+ *
+ * All mappings in @list must belong to the same virtual device. Mappings whose
+ * last reference is released are unmapped together before this returns, so
+ * each core domain's IOTLB is invalidated once for the whole list. Their user
+ * pages may then be unpinned in the background; see
+ * gxp_mapping_release_queue_flush().
+ */
+void gxp_mapping_put_list(struct list_head *list);
+
+/**
+ * gxp_mapping_release_queue_init() - Initialize a virtual device's queue of
+ *                                    mappings to release
+ * @queue: The queue to initialize
+ */
+void gxp_mapping_release_queue_init(struct gxp_mapping_release_queue *queue);
+
+/**
+ * gxp_mapping_release_queue_flush() - Wait for queued mappings to be released
+ * @queue: The queue to flush
+ *
+ * Must be called before the virtual device owning @queue is freed, once no
+ * more references to its mappings can be released.
+ */
+void gxp_mapping_release_queue_flush(struct gxp_mapping_release_queue *queue);
+
 /**
  * gxp_mapping_sync() - Sync a mapped buffer for either CPU or device
  * @mapping: The mapping to sync
@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Physical core placement for GXP virtual devices.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+
+#include "gxp-config.h"
+#include "gxp-placement.h"
+#include "gxp.h"
+
+/* How well a set of cores matches a virtual device's placement criteria */
+struct gxp_placement_score {
+	uint preferred;
+	uint affine;
+	/* Sum of the distances between each pair of cores; lower is better */
+	uint spread;
+	/* Largest block of contiguous cores left free */
+	uint free_block;
+};
+
+uint gxp_placement_core_distance(struct gxp_dev *gxp, uint a, uint b)
+{
+	return a > b ? a - b : b - a;
+}
+
+/*
+ * Whether @core_list forms a block of cores, i.e. its farthest cores are only
+ * as far apart as a line of that many neighbouring cores.
+ */
+static bool gxp_placement_is_contiguous(struct gxp_dev *gxp, uint core_list)
+{
+	uint a, b, diameter = 0;
+
+	for (a = 0; a < GXP_NUM_CORES; a++) {
+		if (!(core_list & BIT(a)))
+			continue;
+		for (b = a + 1; b < GXP_NUM_CORES; b++) {
+			if (core_list & BIT(b))
+				diameter = max(diameter,
+					       gxp_placement_core_distance(
+						       gxp, a, b));
+		}
+	}
+
+	return diameter <= hweight32(core_list) - 1;
+}
+
+/* Size of the largest block of neighbouring cores in @core_list */
+static uint gxp_placement_largest_block(struct gxp_dev *gxp, uint core_list)
+{
+	uint core, run = 0, largest = 0;
+
+	for (core = 0; core < GXP_NUM_CORES; core++) {
+		if (!(core_list & BIT(core)))
+			run = 0;
+		else if (run && gxp_placement_core_distance(gxp, core - 1,
+							    core) == 1)
+			run++;
+		else
+			run = 1;
+		largest = max(largest, run);
+	}
+
+	return largest;
+}
+
+static void gxp_placement_score(struct gxp_dev *gxp, uint core_list,
+				uint free_core_list,
+				const struct gxp_placement_hints *hints,
+				uint last_core_list,
+				struct gxp_placement_score *score)
+{
+	uint a, b;
+
+	score->preferred = hweight32(core_list & hints->preferred_core_list);
+	score->affine = hweight32(core_list & last_core_list);
+	score->spread = 0;
+	for (a = 0; a < GXP_NUM_CORES; a++) {
+		if (!(core_list & BIT(a)))
+			continue;
+		for (b = a + 1; b < GXP_NUM_CORES; b++) {
+			if (core_list & BIT(b))
+				score->spread +=
+					gxp_placement_core_distance(gxp, a, b);
+		}
+	}
+	score->free_block =
+		gxp_placement_largest_block(gxp, free_core_list & ~core_list);
+}
+
+/* Whether @a is a strictly better placement than @b */
+static bool gxp_placement_better(const struct gxp_placement_score *a,
+				 const struct gxp_placement_score *b)
+{
+	if (a->preferred != b->preferred)
+		return a->preferred > b->preferred;
+	if (a->affine != b->affine)
+		return a->affine > b->affine;
+	if (a->spread != b->spread)
+		return a->spread < b->spread;
+	return a->free_block > b->free_block;
+}
+
+/*
+ * Returns the best set of @num_cores cores out of @free_core_list, with its
+ * score in @best_score, or 0 if there is none.
+ */
+static uint gxp_placement_find(struct gxp_dev *gxp, uint num_cores,
+			       uint free_core_list, bool contiguous,
+			       const struct gxp_placement_hints *hints,
+			       uint last_core_list,
+			       struct gxp_placement_score *best_score)
+{
+	struct gxp_placement_score score;
+	uint candidate, best = 0;
+
+	/*
+	 * There are few enough cores to score every candidate set. Ascending
+	 * order makes the lowest-indexed set win ties.
+	 */
+	for (candidate = 1; candidate < BIT(GXP_NUM_CORES); candidate++) {
+		if ((candidate & ~free_core_list) ||
+		    hweight32(candidate) != num_cores)
+			continue;
+		if (contiguous && !gxp_placement_is_contiguous(gxp, candidate))
+			continue;
+
+		gxp_placement_score(gxp, candidate, free_core_list, hints,
+				    last_core_list, &score);
+		if (!best || gxp_placement_better(&score, best_score)) {
+			best = candidate;
+			*best_score = score;
+		}
+	}
+
+	return best;
+}
+
+int gxp_placement_select(struct gxp_dev *gxp, uint num_cores,
+			 const struct gxp_placement_hints *hints,
+			 uint last_core_list, uint *core_list)
+{
+	bool contiguous = hints->flags & GXP_VD_PLACEMENT_CONTIGUOUS;
+	bool strict = hints->flags & GXP_VD_PLACEMENT_STRICT;
+	struct gxp_placement_score score;
+	uint free_core_list = 0;
+	uint best;
+	uint core;
+
+	lockdep_assert_held_write(&gxp->vd_semaphore);
+
+	for (core = 0; core < GXP_NUM_CORES; core++) {
+		if (!gxp->core_to_vd[core])
+			free_core_list |= BIT(core);
+	}
+
+	if (hweight32(free_core_list) < num_cores) {
+		dev_err(gxp->dev, "Insufficient available cores. Available: %u. Requested: %u\n",
+			hweight32(free_core_list), num_cores);
+		return -EBUSY;
+	}
+
+	best = gxp_placement_find(gxp, num_cores, free_core_list, contiguous,
+				  hints, last_core_list, &score);
+	if (!best) {
+		if (strict) {
+			dev_err(gxp->dev, "No %u contiguous cores available\n",
+				num_cores);
+			return -EBUSY;
+		}
+		/* Enough cores are free, just not next to each other */
+		best = gxp_placement_find(gxp, num_cores, free_core_list,
+					  /*contiguous=*/false, hints,
+					  last_core_list, &score);
+	}
+
+	if (strict &&
+	    score.preferred < min_t(uint, num_cores,
+				    hweight32(hints->preferred_core_list))) {
+		dev_err(gxp->dev,
+			"Preferred cores %#x not available (free: %#x)\n",
+			hints->preferred_core_list, free_core_list);
+		return -EBUSY;
+	}
+
+	*core_list = best;
+
+	return 0;
+}
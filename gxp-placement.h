@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Physical core placement for GXP virtual devices.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+#ifndef __GXP_PLACEMENT_H__
+#define __GXP_PLACEMENT_H__
+
+#include <linux/types.h>
+
+#include "gxp-internal.h"
+
+/* Where a virtual device asked to be placed, see GXP_ALLOCATE_VIRTUAL_DEVICE */
+struct gxp_placement_hints {
+	/* GXP_VD_PLACEMENT_* flags */
+	u32 flags;
+	/* Physical cores the virtual device prefers to run on */
+	u32 preferred_core_list;
+};
+
+/**
+ * gxp_placement_core_distance() - Get how far apart two physical cores are
+ * @gxp: The GXP device the cores belong to
+ * @a: A physical core
+ * @b: Another physical core
+ *
+ * This is the only topology data placement decisions are based on. Cores are
+ * currently assumed to sit in a line, in index order, with neighbouring cores
+ * closest in shared memory and sync barrier access.
+ *
+ * Return: 0 if @a equals @b, otherwise a positive distance
+ */
+uint gxp_placement_core_distance(struct gxp_dev *gxp, uint a, uint b);
+
+/**
+ * gxp_placement_select() - Choose the physical cores to run a virtual device on
+ * @gxp: The GXP device to place the virtual device on
+ * @num_cores: The number of cores the virtual device needs
+ * @hints: Placement requested for the virtual device
+ * @last_core_list: The cores the virtual device last ran on, or 0
+ * @core_list: Set to the chosen cores on success
+ *
+ * Among the sets of free cores of the right size, the chosen set is the one
+ * which, in order of precedence:
+ * * satisfies GXP_VD_PLACEMENT_CONTIGUOUS, if requested,
+ * * contains the most cores of @hints->preferred_core_list,
+ * * contains the most cores of @last_core_list, whose caches and firmware
+ *   state may still be warm,
+ * * is the most compact, by gxp_placement_core_distance(),
+ * * leaves the largest contiguous block of free cores for later virtual
+ *   devices (best fit),
+ * * comes first in core index order.
+ *
+ * The caller must hold gxp->vd_semaphore for writing.
+ *
+ * Return:
+ * * 0      - Success
+ * * -EBUSY - Not enough cores are free, or GXP_VD_PLACEMENT_STRICT was
+ *            requested and the hints could not be satisfied
+ */
+int gxp_placement_select(struct gxp_dev *gxp, uint num_cores,
+			 const struct gxp_placement_hints *hints,
+			 uint last_core_list, uint *core_list);
+
+#endif /* __GXP_PLACEMENT_H__ */
@@ -12,6 +12,7 @@
 #include <linux/acpi.h>
 #include <linux/cred.h>
 #include <linux/device.h>
+#include <linux/dma-buf.h>
 #include <linux/dma-mapping.h>
 #include <linux/file.h>
 #include <linux/fs.h>
@@ -24,12 +25,15 @@
 #include <linux/platform_device.h>
 #include <linux/pm_runtime.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/uaccess.h>
 #include <linux/uidgid.h>
 #if (IS_ENABLED(CONFIG_GXP_TEST) || IS_ENABLED(CONFIG_ANDROID)) && !IS_ENABLED(CONFIG_GXP_GEM5)
 #include <soc/google/tpu-ext.h>
 #endif
 
+#include "gxp-arena.h"
 #include "gxp-client.h"
 #include "gxp-config.h"
 #include "gxp-debug-dump.h"
@@ -214,6 +218,51 @@ static inline enum dma_data_direction mapping_flags_to_dma_dir(u32 flags)
 	return DMA_NONE;
 }
 
+/*
+ * Validates a request to map the buffer described by @ibuf and returns a
+ * mapping for it, either reused from the client's mapping cache or newly
+ * created, holding one reference.
+ *
+ * The caller must hold client->semaphore and have checked that the client
+ * has an available virtual device.
+ */
+static struct gxp_mapping *gxp_map_buffer_get_mapping(struct gxp_client *client,
+						      struct gxp_map_ioctl *ibuf)
+{
+	struct gxp_dev *gxp = client->gxp;
+	struct gxp_mapping *map;
+
+	if (ibuf->size == 0 || ibuf->virtual_core_list == 0)
+		return ERR_PTR(-EINVAL);
+
+	if (ibuf->host_address % L1_CACHE_BYTES ||
+	    ibuf->size % L1_CACHE_BYTES) {
+		dev_err(gxp->dev,
+			"Mapped buffers must be cache line aligned and padded.\n");
+		return ERR_PTR(-EINVAL);
+	}
+
+	/* the list contains un-allocated core bits */
+	if (ibuf->virtual_core_list & ~(BIT(client->vd->num_cores) - 1))
+		return ERR_PTR(-EINVAL);
+
+	map = gxp_mapping_cache_lookup(&client->vd->mapping_cache,
+				       ibuf->host_address, ibuf->size,
+				       ibuf->virtual_core_list,
+				       mapping_flags_to_dma_dir(ibuf->flags));
+	if (!map)
+		map = gxp_mapping_create(gxp, client->vd,
+					 ibuf->virtual_core_list,
+					 ibuf->host_address, ibuf->size,
+					 /*gxp_dma_flags=*/0,
+					 mapping_flags_to_dma_dir(ibuf->flags));
+	if (IS_ERR(map))
+		dev_err(gxp->dev, "Failed to create mapping (ret=%ld)\n",
+			PTR_ERR(map));
+
+	return map;
+}
+
 static int gxp_map_buffer(struct gxp_client *client,
 			  struct gxp_map_ioctl __user *argp)
 {
@@ -225,15 +274,6 @@ static int gxp_map_buffer(struct gxp_client *client,
 	if (copy_from_user(&ibuf, argp, sizeof(ibuf)))
 		return -EFAULT;
 
-	if (ibuf.size == 0 || ibuf.virtual_core_list == 0)
-		return -EINVAL;
-
-	if (ibuf.host_address % L1_CACHE_BYTES || ibuf.size % L1_CACHE_BYTES) {
-		dev_err(gxp->dev,
-			"Mapped buffers must be cache line aligned and padded.\n");
-		return -EINVAL;
-	}
-
 	down_read(&client->semaphore);
 
 	if (!check_client_has_available_vd(client, "GXP_MAP_BUFFER")) {
@@ -241,19 +281,9 @@ static int gxp_map_buffer(struct gxp_client *client,
 		goto out;
 	}
 
-	/* the list contains un-allocated core bits */
-	if (ibuf.virtual_core_list & ~(BIT(client->vd->num_cores) - 1)) {
-		ret = -EINVAL;
-		goto out;
-	}
-
-	map = gxp_mapping_create(gxp, client->vd, ibuf.virtual_core_list,
-				 ibuf.host_address, ibuf.size,
-				 /*gxp_dma_flags=*/0,
-				 mapping_flags_to_dma_dir(ibuf.flags));
+	map = gxp_map_buffer_get_mapping(client, &ibuf);
 	if (IS_ERR(map)) {
 		ret = PTR_ERR(map);
-		dev_err(gxp->dev, "Failed to create mapping (ret=%d)\n", ret);
 		goto out;
 	}
 
@@ -327,6 +357,8 @@ static int gxp_unmap_buffer(struct gxp_client *client,
 	WARN_ON(map->host_address != ibuf.host_address);
 
 	gxp_vd_mapping_remove(client->vd, map);
+	/* Keep the buffer mapped in case the client maps it again */
+	gxp_mapping_cache_insert(&client->vd->mapping_cache, map);
 
 	/* Release the reference from gxp_vd_mapping_search() */
 	gxp_mapping_put(map);
@@ -337,6 +369,233 @@ out:
 	return ret;
 }
 
+/* Kernel copies of the arrays passed to GXP_MAP_BUFFERS/GXP_UNMAP_BUFFERS */
+struct gxp_map_buffers_args {
+	struct gxp_map_ioctl *bufs;
+	struct gxp_mapping **maps;
+	int *rets;
+	uint count;
+};
+
+static void gxp_map_buffers_args_put(struct gxp_map_buffers_args *args)
+{
+	kfree(args->rets);
+	kfree(args->maps);
+	kfree(args->bufs);
+}
+
+static int gxp_map_buffers_args_get(struct gxp_map_buffers_args *args,
+				    struct gxp_map_buffers_ioctl *ibuf)
+{
+	int ret;
+
+	if (ibuf->count == 0 || ibuf->count > GXP_MAX_BUFFERS_PER_IOCTL)
+		return -EINVAL;
+
+	args->count = ibuf->count;
+	args->bufs = kcalloc(args->count, sizeof(*args->bufs), GFP_KERNEL);
+	args->maps = kcalloc(args->count, sizeof(*args->maps), GFP_KERNEL);
+	args->rets = kcalloc(args->count, sizeof(*args->rets), GFP_KERNEL);
+	if (!args->bufs || !args->maps || !args->rets) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	if (copy_from_user(args->bufs, u64_to_user_ptr(ibuf->buffers),
+			   args->count * sizeof(*args->bufs))) {
+		ret = -EFAULT;
+		goto err_free;
+	}
+
+	return 0;
+
+err_free:
+	gxp_map_buffers_args_put(args);
+	return ret;
+}
+
+/* Returns the first error in @args->rets, or 0 if there is none. */
+static int gxp_map_buffers_first_error(struct gxp_map_buffers_args *args)
+{
+	uint i;
+
+	for (i = 0; i < args->count; i++) {
+		if (args->rets[i])
+			return args->rets[i];
+	}
+
+	return 0;
+}
+
+static int gxp_map_buffers(struct gxp_client *client,
+			   struct gxp_map_buffers_ioctl __user *argp)
+{
+	struct gxp_dev *gxp = client->gxp;
+	struct gxp_map_buffers_ioctl ibuf;
+	struct gxp_map_buffers_args args;
+	struct gxp_mapping *map;
+	uint i;
+	int ret;
+
+	if (copy_from_user(&ibuf, argp, sizeof(ibuf)))
+		return -EFAULT;
+
+	ret = gxp_map_buffers_args_get(&args, &ibuf);
+	if (ret)
+		return ret;
+
+	down_read(&client->semaphore);
+
+	if (!check_client_has_available_vd(client, "GXP_MAP_BUFFERS")) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	for (i = 0; i < args.count; i++) {
+		map = gxp_map_buffer_get_mapping(client, &args.bufs[i]);
+		if (IS_ERR(map))
+			args.rets[i] = PTR_ERR(map);
+		else
+			args.maps[i] = map;
+	}
+
+	gxp_vd_mapping_store_batch(client->vd, args.maps, args.rets,
+				   args.count);
+
+	for (i = 0; i < args.count; i++) {
+		map = args.maps[i];
+		if (!map)
+			continue;
+		if (args.rets[i]) {
+			dev_err(gxp->dev, "Failed to store mapping (ret=%d)\n",
+				args.rets[i]);
+			continue;
+		}
+		args.bufs[i].device_address = map->device_address;
+	}
+
+	if (copy_to_user(u64_to_user_ptr(ibuf.buffers), args.bufs,
+			 args.count * sizeof(*args.bufs)) ||
+	    copy_to_user(u64_to_user_ptr(ibuf.results), args.rets,
+			 args.count * sizeof(*args.rets))) {
+		ret = -EFAULT;
+		for (i = 0; i < args.count; i++) {
+			if (args.maps[i] && !args.rets[i])
+				gxp_vd_mapping_remove(client->vd, args.maps[i]);
+		}
+	} else {
+		ret = gxp_map_buffers_first_error(&args);
+	}
+
+	/*
+	 * Mappings which were stored are referenced by the VD's records now.
+	 * Release the references from creating the mappings, tearing down the
+	 * ones which could not be stored. Stored mappings are visible to other
+	 * ioctls, which may be linking them into a cache, so they must not be
+	 * gathered through `cache_entry` here.
+	 */
+	for (i = 0; i < args.count; i++) {
+		if (args.maps[i])
+			gxp_mapping_put(args.maps[i]);
+	}
+
+out:
+	up_read(&client->semaphore);
+	gxp_map_buffers_args_put(&args);
+
+	return ret;
+}
+
+static int gxp_unmap_buffers(struct gxp_client *client,
+			     struct gxp_map_buffers_ioctl __user *argp)
+{
+	struct gxp_dev *gxp = client->gxp;
+	struct gxp_map_buffers_ioctl ibuf;
+	struct gxp_map_buffers_args args;
+	dma_addr_t *device_addresses;
+	uint i;
+	int ret;
+
+	if (copy_from_user(&ibuf, argp, sizeof(ibuf)))
+		return -EFAULT;
+
+	ret = gxp_map_buffers_args_get(&args, &ibuf);
+	if (ret)
+		return ret;
+
+	device_addresses = kcalloc(args.count, sizeof(*device_addresses),
+				   GFP_KERNEL);
+	if (!device_addresses) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	for (i = 0; i < args.count; i++)
+		device_addresses[i] = (dma_addr_t)args.bufs[i].device_address;
+
+	down_read(&client->semaphore);
+
+	if (!client->vd) {
+		dev_err(gxp->dev,
+			"GXP_UNMAP_BUFFERS requires the client allocate a VIRTUAL_DEVICE\n");
+		ret = -ENODEV;
+		goto out;
+	}
+
+	gxp_vd_mapping_remove_batch(client->vd, device_addresses, args.maps,
+				    args.rets, args.count);
+
+	for (i = 0; i < args.count; i++) {
+		if (args.rets[i]) {
+			dev_err(gxp->dev,
+				"User buffer mapping not found for provided device address %#llX\n",
+				args.bufs[i].device_address);
+			continue;
+		}
+		WARN_ON(args.maps[i]->host_address !=
+			args.bufs[i].host_address);
+	}
+
+	/*
+	 * Keep the buffers mapped in case the client maps them again. This
+	 * takes over the references removed from the VD's records.
+	 */
+	gxp_mapping_cache_insert_batch(&client->vd->mapping_cache, args.maps,
+				       args.count);
+
+	if (copy_to_user(u64_to_user_ptr(ibuf.results), args.rets,
+			 args.count * sizeof(*args.rets)))
+		ret = -EFAULT;
+	else
+		ret = gxp_map_buffers_first_error(&args);
+
+out:
+	up_read(&client->semaphore);
+	kfree(device_addresses);
+out_free:
+	gxp_map_buffers_args_put(&args);
+
+	return ret;
+}
+
+/* Syncs part of a user buffer or dma-buf mapping */
+static int gxp_sync_mapping(struct gxp_mapping *map, u32 offset, u32 size,
+			    bool for_cpu)
+{
+	if (!map->host_address)
+		return gxp_dmabuf_sync(map, offset, size, for_cpu);
+
+	return gxp_mapping_sync(map, offset, size, for_cpu);
+}
+
+/* Size of the buffer a user buffer or dma-buf mapping maps */
+static size_t gxp_sync_mapping_size(struct gxp_mapping *map)
+{
+	if (!map->host_address)
+		return gxp_dmabuf_mapping_size(map);
+
+	return map->size;
+}
+
 static int gxp_sync_buffer(struct gxp_client *client,
 			   struct gxp_sync_ioctl __user *argp)
 {
@@ -367,7 +626,7 @@ static int gxp_sync_buffer(struct gxp_client *client,
 		goto out;
 	}
 
-	ret = gxp_mapping_sync(map, ibuf.offset, ibuf.size,
+	ret = gxp_sync_mapping(map, ibuf.offset, ibuf.size,
 			       ibuf.flags == GXP_SYNC_FOR_CPU);
 
 	/* Release the reference from gxp_vd_mapping_search() */
@@ -379,6 +638,211 @@ out:
 	return ret;
 }
 
+/* A range of a mapping to sync for GXP_SYNC_BUFFERS */
+struct gxp_sync_range {
+	struct gxp_mapping *map;
+	u64 start;
+	u64 end;
+	bool for_cpu;
+};
+
+/* Orders ranges by mapping, then direction, then starting offset */
+static int gxp_sync_range_cmp(const void *a, const void *b)
+{
+	const struct gxp_sync_range *ra = a, *rb = b;
+
+	if (ra->map != rb->map)
+		return ra->map < rb->map ? -1 : 1;
+	if (ra->for_cpu != rb->for_cpu)
+		return ra->for_cpu ? 1 : -1;
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return 0;
+}
+
+static int gxp_sync_buffers(struct gxp_client *client,
+			    struct gxp_sync_buffers_ioctl __user *argp)
+{
+	struct gxp_dev *gxp = client->gxp;
+	struct gxp_sync_buffers_ioctl ibuf;
+	struct gxp_sync_ioctl *bufs = NULL;
+	struct gxp_sync_range *ranges = NULL, *cur;
+	struct gxp_mapping **maps = NULL;
+	dma_addr_t *device_addresses = NULL;
+	uint i, num_ranges;
+	int ret = 0;
+
+	if (copy_from_user(&ibuf, argp, sizeof(ibuf)))
+		return -EFAULT;
+
+	if (ibuf.count == 0 || ibuf.count > GXP_MAX_BUFFERS_PER_IOCTL)
+		return -EINVAL;
+
+	bufs = kcalloc(ibuf.count, sizeof(*bufs), GFP_KERNEL);
+	ranges = kcalloc(ibuf.count, sizeof(*ranges), GFP_KERNEL);
+	maps = kcalloc(ibuf.count, sizeof(*maps), GFP_KERNEL);
+	device_addresses = kcalloc(ibuf.count, sizeof(*device_addresses),
+				   GFP_KERNEL);
+	if (!bufs || !ranges || !maps || !device_addresses) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	if (copy_from_user(bufs, u64_to_user_ptr(ibuf.buffers),
+			   ibuf.count * sizeof(*bufs))) {
+		ret = -EFAULT;
+		goto out_free;
+	}
+
+	for (i = 0; i < ibuf.count; i++)
+		device_addresses[i] = (dma_addr_t)bufs[i].device_address;
+
+	down_read(&client->semaphore);
+
+	if (!client->vd) {
+		dev_err(gxp->dev,
+			"GXP_SYNC_BUFFERS requires the client allocate a VIRTUAL_DEVICE\n");
+		ret = -ENODEV;
+		goto out;
+	}
+
+	gxp_vd_mapping_search_batch(client->vd, device_addresses, maps,
+				    ibuf.count);
+
+	/* Check every range before syncing any of them */
+	for (i = 0; i < ibuf.count; i++) {
+		if (!maps[i]) {
+			dev_err(gxp->dev,
+				"Mapping not found for provided device address %#llX\n",
+				bufs[i].device_address);
+			ret = -EINVAL;
+			goto out_put;
+		}
+		if (bufs[i].size == 0 ||
+		    (u64)bufs[i].offset + bufs[i].size >
+			    gxp_sync_mapping_size(maps[i])) {
+			ret = -EINVAL;
+			goto out_put;
+		}
+		ranges[i].map = maps[i];
+		ranges[i].start = bufs[i].offset;
+		ranges[i].end = (u64)bufs[i].offset + bufs[i].size;
+		ranges[i].for_cpu = bufs[i].flags == GXP_SYNC_FOR_CPU;
+	}
+
+	/*
+	 * Merge overlapping and adjacent ranges of each mapping which are
+	 * synced in the same direction, so each byte is maintained only once.
+	 */
+	sort(ranges, ibuf.count, sizeof(*ranges), gxp_sync_range_cmp, NULL);
+	cur = &ranges[0];
+	num_ranges = 1;
+	for (i = 1; i < ibuf.count; i++) {
+		if (ranges[i].map == cur->map &&
+		    ranges[i].for_cpu == cur->for_cpu &&
+		    ranges[i].start <= cur->end) {
+			cur->end = max(cur->end, ranges[i].end);
+			continue;
+		}
+		cur = &ranges[num_ranges++];
+		*cur = ranges[i];
+	}
+
+	for (i = 0; i < num_ranges; i++) {
+		ret = gxp_sync_mapping(ranges[i].map, ranges[i].start,
+				       ranges[i].end - ranges[i].start,
+				       ranges[i].for_cpu);
+		if (ret)
+			break;
+	}
+
+out_put:
+	/* Release the references from gxp_vd_mapping_search_batch() */
+	for (i = 0; i < ibuf.count; i++) {
+		if (maps[i])
+			gxp_mapping_put(maps[i]);
+	}
+out:
+	up_read(&client->semaphore);
+out_free:
+	kfree(device_addresses);
+	kfree(maps);
+	kfree(ranges);
+	kfree(bufs);
+
+	return ret;
+}
+
+static int gxp_alloc_buffer(struct gxp_client *client,
+			    struct gxp_alloc_buffer_ioctl __user *argp)
+{
+	struct gxp_dev *gxp = client->gxp;
+	struct gxp_alloc_buffer_ioctl ibuf;
+	dma_addr_t daddr;
+	int ret;
+
+	if (copy_from_user(&ibuf, argp, sizeof(ibuf)))
+		return -EFAULT;
+
+	if (ibuf.size == 0 || ibuf.flags)
+		return -EINVAL;
+
+	down_read(&client->semaphore);
+
+	if (!client->vd) {
+		dev_err(gxp->dev,
+			"GXP_ALLOC_BUFFER requires the client allocate a VIRTUAL_DEVICE\n");
+		ret = -ENODEV;
+		goto out;
+	}
+
+	ret = gxp_arena_alloc(&client->vd->arena, ibuf.size, &daddr);
+	if (ret)
+		goto out;
+
+	ibuf.device_address = daddr;
+	ibuf.mmap_offset = GXP_ARENA_MMAP_OFFSET_BASE + daddr;
+	if (copy_to_user(argp, &ibuf, sizeof(ibuf))) {
+		gxp_arena_free(&client->vd->arena, daddr);
+		ret = -EFAULT;
+	}
+
+out:
+	up_read(&client->semaphore);
+
+	return ret;
+}
+
+static int gxp_free_buffer(struct gxp_client *client, __u64 __user *argp)
+{
+	struct gxp_dev *gxp = client->gxp;
+	__u64 device_address;
+	int ret;
+
+	if (copy_from_user(&device_address, argp, sizeof(device_address)))
+		return -EFAULT;
+
+	down_read(&client->semaphore);
+
+	if (!client->vd) {
+		dev_err(gxp->dev,
+			"GXP_FREE_BUFFER requires the client allocate a VIRTUAL_DEVICE\n");
+		ret = -ENODEV;
+		goto out;
+	}
+
+	ret = gxp_arena_free(&client->vd->arena, (dma_addr_t)device_address);
+	if (ret)
+		dev_err(gxp->dev,
+			"No allocated buffer at device address %#llX\n",
+			device_address);
+
+out:
+	up_read(&client->semaphore);
+
+	return ret;
+}
+
 static int
 gxp_mailbox_command_compat(struct gxp_client *client,
 			   struct gxp_mailbox_command_compat_ioctl __user *argp)
@@ -451,7 +915,7 @@ gxp_mailbox_command_compat(struct gxp_client *client,
 		&client->vd->mailbox_resp_queues[virt_core].lock,
 		&client->vd->mailbox_resp_queues[virt_core].waitq,
 		gxp_power_state, memory_power_state, false,
-		client->mb_eventfds[virt_core]);
+		client->mb_eventfds[virt_core], 0, false, 0, NULL);
 	if (ret) {
 		dev_err(gxp->dev, "Failed to enqueue mailbox command (ret=%d)\n",
 			ret);
@@ -473,11 +937,16 @@ out_unlock_client_semaphore:
 	return ret;
 }
 
-static int gxp_mailbox_command(struct gxp_client *client,
-			       struct gxp_mailbox_command_ioctl __user *argp)
+/*
+ * Validates and dispatches the command described by @ibuf. On success, the
+ * sequence number assigned to the command is written to
+ * @ibuf->sequence_number.
+ */
+static int
+gxp_mailbox_command_internal(struct gxp_client *client,
+			     struct gxp_mailbox_command_ioctl *ibuf)
 {
 	struct gxp_dev *gxp = client->gxp;
-	struct gxp_mailbox_command_ioctl ibuf;
 	struct gxp_command cmd;
 	struct buffer_descriptor buffer;
 	int virt_core, phys_core;
@@ -485,35 +954,35 @@ static int gxp_mailbox_command(struct gxp_client *client,
 	uint gxp_power_state, memory_power_state;
 	bool requested_low_clkmux = false;
 
-	if (copy_from_user(&ibuf, argp, sizeof(ibuf))) {
-		dev_err(gxp->dev,
-			"Unable to copy ioctl data from user-space\n");
-		return -EFAULT;
+	if (ibuf->driver_flags & ~GXP_MAILBOX_COMMAND_IDEMPOTENT) {
+		dev_err(gxp->dev, "Invalid mailbox command driver flags (%#x)\n",
+			ibuf->driver_flags);
+		return -EINVAL;
 	}
-	if (ibuf.gxp_power_state == GXP_POWER_STATE_OFF) {
+	if (ibuf->gxp_power_state == GXP_POWER_STATE_OFF) {
 		dev_err(gxp->dev,
 			"GXP_POWER_STATE_OFF is not a valid value when executing a mailbox command\n");
 		return -EINVAL;
 	}
-	if (ibuf.gxp_power_state < GXP_POWER_STATE_OFF ||
-	    ibuf.gxp_power_state >= GXP_NUM_POWER_STATES) {
+	if (ibuf->gxp_power_state < GXP_POWER_STATE_OFF ||
+	    ibuf->gxp_power_state >= GXP_NUM_POWER_STATES) {
 		dev_err(gxp->dev, "Requested power state is invalid\n");
 		return -EINVAL;
 	}
-	if (ibuf.memory_power_state < MEMORY_POWER_STATE_UNDEFINED ||
-	    ibuf.memory_power_state > MEMORY_POWER_STATE_MAX) {
+	if (ibuf->memory_power_state < MEMORY_POWER_STATE_UNDEFINED ||
+	    ibuf->memory_power_state > MEMORY_POWER_STATE_MAX) {
 		dev_err(gxp->dev, "Requested memory power state is invalid\n");
 		return -EINVAL;
 	}
 
-	if (ibuf.gxp_power_state == GXP_POWER_STATE_READY) {
+	if (ibuf->gxp_power_state == GXP_POWER_STATE_READY) {
 		dev_warn_once(
 			gxp->dev,
 			"GXP_POWER_STATE_READY is deprecated, please set GXP_POWER_LOW_FREQ_CLKMUX with GXP_POWER_STATE_UUD state");
-		ibuf.gxp_power_state = GXP_POWER_STATE_UUD;
+		ibuf->gxp_power_state = GXP_POWER_STATE_UUD;
 	}
 
-	if(ibuf.power_flags & GXP_POWER_NON_AGGRESSOR)
+	if(ibuf->power_flags & GXP_POWER_NON_AGGRESSOR)
 		dev_warn_once(
 			gxp->dev,
 			"GXP_POWER_NON_AGGRESSOR is deprecated, no operation here");
@@ -529,7 +998,7 @@ static int gxp_mailbox_command(struct gxp_client *client,
 
 	down_read(&gxp->vd_semaphore);
 
-	virt_core = ibuf.virtual_core_id;
+	virt_core = ibuf->virtual_core_id;
 	phys_core = gxp_vd_virt_core_to_phys_core(client->vd, virt_core);
 	if (phys_core < 0) {
 		dev_err(gxp->dev,
@@ -556,16 +1025,16 @@ static int gxp_mailbox_command(struct gxp_client *client,
 	}
 
 	/* Pack the command structure */
-	buffer.address = ibuf.device_address;
-	buffer.size = ibuf.size;
-	buffer.flags = ibuf.flags;
+	buffer.address = ibuf->device_address;
+	buffer.size = ibuf->size;
+	buffer.flags = ibuf->flags;
 	/* cmd.seq is assigned by mailbox implementation */
 	cmd.code = GXP_MBOX_CODE_DISPATCH; /* All IOCTL commands are dispatch */
 	cmd.priority = 0; /* currently unused */
 	cmd.buffer_descriptor = buffer;
-	gxp_power_state = aur_state_array[ibuf.gxp_power_state];
-	memory_power_state = aur_memory_state_array[ibuf.memory_power_state];
-	requested_low_clkmux = (ibuf.power_flags & GXP_POWER_LOW_FREQ_CLKMUX) != 0;
+	gxp_power_state = aur_state_array[ibuf->gxp_power_state];
+	memory_power_state = aur_memory_state_array[ibuf->memory_power_state];
+	requested_low_clkmux = (ibuf->power_flags & GXP_POWER_LOW_FREQ_CLKMUX) != 0;
 
 	ret = gxp_mailbox_execute_cmd_async(
 		gxp->mailbox_mgr->mailboxes[phys_core], &cmd,
@@ -573,19 +1042,16 @@ static int gxp_mailbox_command(struct gxp_client *client,
 		&client->vd->mailbox_resp_queues[virt_core].lock,
 		&client->vd->mailbox_resp_queues[virt_core].waitq,
 		gxp_power_state, memory_power_state, requested_low_clkmux,
-		client->mb_eventfds[virt_core]);
+		client->mb_eventfds[virt_core], ibuf->user_cookie,
+		(ibuf->driver_flags & GXP_MAILBOX_COMMAND_IDEMPOTENT) != 0,
+		ibuf->deadline_ns, &client->deadline_stats);
 	if (ret) {
 		dev_err(gxp->dev, "Failed to enqueue mailbox command (ret=%d)\n",
 			ret);
 		goto out;
 	}
 
-	ibuf.sequence_number = cmd.seq;
-	if (copy_to_user(argp, &ibuf, sizeof(ibuf))) {
-		dev_err(gxp->dev, "Failed to copy back sequence number!\n");
-		ret = -EFAULT;
-		goto out;
-	}
+	ibuf->sequence_number = cmd.seq;
 
 out:
 	up_read(&gxp->vd_semaphore);
@@ -595,19 +1061,84 @@ out_unlock_client_semaphore:
 	return ret;
 }
 
-static int gxp_mailbox_response(struct gxp_client *client,
-				struct gxp_mailbox_response_ioctl __user *argp)
+static int gxp_mailbox_command(struct gxp_client *client,
+			       struct gxp_mailbox_command_ioctl __user *argp)
+{
+	struct gxp_dev *gxp = client->gxp;
+	struct gxp_mailbox_command_ioctl ibuf;
+	int ret;
+
+	if (copy_from_user(&ibuf, argp, sizeof(ibuf))) {
+		dev_err(gxp->dev,
+			"Unable to copy ioctl data from user-space\n");
+		return -EFAULT;
+	}
+
+	ret = gxp_mailbox_command_internal(client, &ibuf);
+	if (ret)
+		return ret;
+
+	if (copy_to_user(argp, &ibuf, sizeof(ibuf))) {
+		dev_err(gxp->dev, "Failed to copy back sequence number!\n");
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int gxp_mailbox_command_compat_v2(
+	struct gxp_client *client,
+	struct gxp_mailbox_command_compat_v2_ioctl __user *argp)
+{
+	struct gxp_dev *gxp = client->gxp;
+	struct gxp_mailbox_command_compat_v2_ioctl compat_ibuf;
+	struct gxp_mailbox_command_ioctl ibuf;
+	int ret;
+
+	if (copy_from_user(&compat_ibuf, argp, sizeof(compat_ibuf))) {
+		dev_err(gxp->dev,
+			"Unable to copy ioctl data from user-space\n");
+		return -EFAULT;
+	}
+
+	ibuf.virtual_core_id = compat_ibuf.virtual_core_id;
+	ibuf.device_address = compat_ibuf.device_address;
+	ibuf.size = compat_ibuf.size;
+	ibuf.gxp_power_state = compat_ibuf.gxp_power_state;
+	ibuf.memory_power_state = compat_ibuf.memory_power_state;
+	ibuf.flags = compat_ibuf.flags;
+	ibuf.power_flags = compat_ibuf.power_flags;
+	ibuf.driver_flags = 0;
+	ibuf.user_cookie = 0;
+	ibuf.deadline_ns = 0;
+
+	ret = gxp_mailbox_command_internal(client, &ibuf);
+	if (ret)
+		return ret;
+
+	compat_ibuf.sequence_number = ibuf.sequence_number;
+	if (copy_to_user(argp, &compat_ibuf, sizeof(compat_ibuf))) {
+		dev_err(gxp->dev, "Failed to copy back sequence number!\n");
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/*
+ * Pops the oldest response for @ibuf->virtual_core_id and fills in the output
+ * fields of @ibuf.
+ */
+static int
+gxp_mailbox_response_internal(struct gxp_client *client,
+			      struct gxp_mailbox_response_ioctl *ibuf)
 {
 	struct gxp_dev *gxp = client->gxp;
-	struct gxp_mailbox_response_ioctl ibuf;
 	struct gxp_async_response *resp_ptr;
 	int virt_core;
 	int ret = 0;
 	long timeout;
 
-	if (copy_from_user(&ibuf, argp, sizeof(ibuf)))
-		return -EFAULT;
-
 	/* Caller must hold VIRTUAL_DEVICE wakelock */
 	down_read(&client->semaphore);
 
@@ -617,7 +1148,7 @@ static int gxp_mailbox_response(struct gxp_client *client,
 		goto out;
 	}
 
-	virt_core = ibuf.virtual_core_id;
+	virt_core = ibuf->virtual_core_id;
 	if (virt_core >= client->vd->num_cores) {
 		dev_err(gxp->dev, "Mailbox response failed: Invalid virtual core id (%u)\n",
 			virt_core);
@@ -654,21 +1185,25 @@ static int gxp_mailbox_response(struct gxp_client *client,
 
 	spin_unlock_irq(&client->vd->mailbox_resp_queues[virt_core].lock);
 
-	ibuf.sequence_number = resp_ptr->resp.seq;
+	ibuf->sequence_number = resp_ptr->resp.seq;
+	ibuf->user_cookie = resp_ptr->user_cookie;
 	switch (resp_ptr->resp.status) {
 	case GXP_RESP_OK:
-		ibuf.error_code = GXP_RESPONSE_ERROR_NONE;
+		ibuf->error_code = GXP_RESPONSE_ERROR_NONE;
 		/* retval is only valid if status == GXP_RESP_OK */
-		ibuf.cmd_retval = resp_ptr->resp.retval;
+		ibuf->cmd_retval = resp_ptr->resp.retval;
 		break;
 	case GXP_RESP_CANCELLED:
-		ibuf.error_code = GXP_RESPONSE_ERROR_TIMEOUT;
+		ibuf->error_code = GXP_RESPONSE_ERROR_TIMEOUT;
+		break;
+	case GXP_RESP_ABORTED:
+		ibuf->error_code = GXP_RESPONSE_ERROR_ABORTED;
 		break;
 	default:
 		/* No other status values are valid at this point */
 		WARN(true, "Completed response had invalid status %hu",
 		     resp_ptr->resp.status);
-		ibuf.error_code = GXP_RESPONSE_ERROR_INTERNAL;
+		ibuf->error_code = GXP_RESPONSE_ERROR_INTERNAL;
 		break;
 	}
 
@@ -689,15 +1224,59 @@ static int gxp_mailbox_response(struct gxp_client *client,
 	cancel_delayed_work_sync(&resp_ptr->timeout_work);
 	kfree(resp_ptr);
 
-	if (copy_to_user(argp, &ibuf, sizeof(ibuf)))
-		ret = -EFAULT;
-
 out:
 	up_read(&client->semaphore);
 
 	return ret;
 }
 
+static int gxp_mailbox_response(struct gxp_client *client,
+				struct gxp_mailbox_response_ioctl __user *argp)
+{
+	struct gxp_mailbox_response_ioctl ibuf;
+	int ret;
+
+	if (copy_from_user(&ibuf, argp, sizeof(ibuf)))
+		return -EFAULT;
+
+	ret = gxp_mailbox_response_internal(client, &ibuf);
+	if (ret)
+		return ret;
+
+	if (copy_to_user(argp, &ibuf, sizeof(ibuf)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int
+gxp_mailbox_response_compat(struct gxp_client *client,
+			    struct gxp_mailbox_response_compat_ioctl __user *argp)
+{
+	struct gxp_mailbox_response_compat_ioctl compat_ibuf;
+	struct gxp_mailbox_response_ioctl ibuf;
+	int ret;
+
+	if (copy_from_user(&compat_ibuf, argp, sizeof(compat_ibuf)))
+		return -EFAULT;
+
+	ibuf.virtual_core_id = compat_ibuf.virtual_core_id;
+	/* Left untouched unless the command completed successfully */
+	ibuf.cmd_retval = compat_ibuf.cmd_retval;
+
+	ret = gxp_mailbox_response_internal(client, &ibuf);
+	if (ret)
+		return ret;
+
+	compat_ibuf.sequence_number = ibuf.sequence_number;
+	compat_ibuf.error_code = ibuf.error_code;
+	compat_ibuf.cmd_retval = ibuf.cmd_retval;
+	if (copy_to_user(argp, &compat_ibuf, sizeof(compat_ibuf)))
+		return -EFAULT;
+
+	return 0;
+}
+
 static int gxp_get_specs(struct gxp_client *client,
 			 struct gxp_specs_ioctl __user *argp)
 {
@@ -712,15 +1291,26 @@ static int gxp_get_specs(struct gxp_client *client,
 	return 0;
 }
 
+/*
+ * GXP_ALLOCATE_VIRTUAL_DEVICE as issued by callers built before placement hints
+ * were added to `struct gxp_virtual_device_ioctl`.
+ */
+#define GXP_ALLOCATE_VIRTUAL_DEVICE_NO_HINTS                               \
+	_IOC(_IOC_READ | _IOC_WRITE, GXP_IOCTL_BASE,                       \
+	     _IOC_NR(GXP_ALLOCATE_VIRTUAL_DEVICE),                         \
+	     offsetofend(struct gxp_virtual_device_ioctl, vdid))
+
 static int gxp_allocate_vd(struct gxp_client *client,
-			   struct gxp_virtual_device_ioctl __user *argp)
+			   struct gxp_virtual_device_ioctl __user *argp,
+			   size_t size)
 {
 	struct gxp_dev *gxp = client->gxp;
-	struct gxp_virtual_device_ioctl ibuf;
+	struct gxp_virtual_device_ioctl ibuf = {};
 	struct gxp_virtual_device *vd;
 	int ret = 0;
 
-	if (copy_from_user(&ibuf, argp, sizeof(ibuf)))
+	/* Callers without placement hints leave them zeroed */
+	if (copy_from_user(&ibuf, argp, size))
 		return -EFAULT;
 
 	if (ibuf.core_count == 0 || ibuf.core_count > GXP_NUM_CORES) {
@@ -734,6 +1324,14 @@ static int gxp_allocate_vd(struct gxp_client *client,
 		return -EINVAL;
 	}
 
+	if (ibuf.placement_flags &
+		    ~(GXP_VD_PLACEMENT_CONTIGUOUS | GXP_VD_PLACEMENT_STRICT) ||
+	    ibuf.preferred_core_list & ~(BIT(GXP_NUM_CORES) - 1)) {
+		dev_err(gxp->dev, "Invalid placement hints (%#x, %#x)\n",
+			ibuf.placement_flags, ibuf.preferred_core_list);
+		return -EINVAL;
+	}
+
 	down_write(&client->semaphore);
 
 	if (client->vd) {
@@ -750,8 +1348,11 @@ static int gxp_allocate_vd(struct gxp_client *client,
 			ret);
 		goto out;
 	}
+	vd->placement.flags = ibuf.placement_flags;
+	vd->placement.preferred_core_list = ibuf.preferred_core_list;
 
-	client->vd = vd;
+	/* Pairs with the lockless read in gxp_mmap() */
+	smp_store_release(&client->vd, vd);
 
 out:
 	up_write(&client->semaphore);
@@ -1723,6 +2324,8 @@ static int gxp_unmap_dmabuf(struct gxp_client *client,
 
 	/* Remove the mapping from its VD, releasing the VD's reference */
 	gxp_vd_mapping_remove(client->vd, mapping);
+	/* Keep the dma-buf attached and mapped in case it is mapped again */
+	gxp_dmabuf_cache_insert(&client->vd->dmabuf_cache, mapping);
 
 	/* Release the reference from gxp_vd_mapping_search() */
 	gxp_mapping_put(mapping);
@@ -1733,6 +2336,90 @@ out:
 	return ret;
 }
 
+static int gxp_export_buffer(struct gxp_client *client,
+			     struct gxp_export_buffer_ioctl __user *argp)
+{
+	struct gxp_dev *gxp = client->gxp;
+	struct gxp_export_buffer_ioctl ibuf;
+	struct gxp_mapping *mapping;
+	struct dma_buf *dmabuf;
+	int fd;
+	int ret = 0;
+
+	if (copy_from_user(&ibuf, argp, sizeof(ibuf)))
+		return -EFAULT;
+
+	if (ibuf.size == 0 || ibuf.virtual_core_list == 0 || ibuf.flags & ~0x3)
+		return -EINVAL;
+
+	down_read(&client->semaphore);
+
+	if (!check_client_has_available_vd(client, "GXP_EXPORT_BUFFER")) {
+		ret = -ENODEV;
+		goto out_unlock;
+	}
+
+	/* the list contains un-allocated core bits */
+	if (ibuf.virtual_core_list & ~(BIT(client->vd->num_cores) - 1)) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	mapping = gxp_dmabuf_export(gxp, client->vd, ibuf.virtual_core_list,
+				    ibuf.size, mapping_flags_to_dma_dir(ibuf.flags),
+				    &dmabuf);
+	if (IS_ERR(mapping)) {
+		ret = PTR_ERR(mapping);
+		dev_err(gxp->dev, "Failed to export buffer (ret=%d)\n", ret);
+		goto out_unlock;
+	}
+
+	ret = gxp_vd_mapping_store(client->vd, mapping);
+	if (ret) {
+		dev_err(gxp->dev,
+			"Failed to store mapping for exported buffer (ret=%d)\n",
+			ret);
+		goto out_put_dmabuf;
+	}
+
+	/*
+	 * Reserve the fd, but only install it once nothing else can fail, so
+	 * user-space never sees an fd for a dma-buf which is then released.
+	 */
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		ret = fd;
+		goto out_remove;
+	}
+
+	ibuf.dmabuf_fd = fd;
+	ibuf.device_address = mapping->device_address;
+	if (copy_to_user(argp, &ibuf, sizeof(ibuf))) {
+		put_unused_fd(fd);
+		ret = -EFAULT;
+		goto out_remove;
+	}
+
+	/* The fd takes over the reference from exporting the dma-buf */
+	fd_install(fd, dmabuf->file);
+	goto out_put_mapping;
+
+out_remove:
+	gxp_vd_mapping_remove(client->vd, mapping);
+out_put_dmabuf:
+	dma_buf_put(dmabuf);
+out_put_mapping:
+	/*
+	 * Release the reference from creating the dma-buf mapping. If the
+	 * mapping is not stored in the virtual device, this unmaps it.
+	 */
+	gxp_mapping_put(mapping);
+out_unlock:
+	up_read(&client->semaphore);
+
+	return ret;
+}
+
 static int gxp_register_mailbox_eventfd(
 	struct gxp_client *client,
 	struct gxp_register_mailbox_eventfd_ioctl __user *argp)
@@ -1905,20 +2592,39 @@ static long gxp_ioctl(struct file *file, uint cmd, ulong arg)
 	case GXP_UNMAP_BUFFER:
 		ret = gxp_unmap_buffer(client, argp);
 		break;
+	case GXP_MAP_BUFFERS:
+		ret = gxp_map_buffers(client, argp);
+		break;
+	case GXP_UNMAP_BUFFERS:
+		ret = gxp_unmap_buffers(client, argp);
+		break;
 	case GXP_SYNC_BUFFER:
 		ret = gxp_sync_buffer(client, argp);
 		break;
+	case GXP_SYNC_BUFFERS:
+		ret = gxp_sync_buffers(client, argp);
+		break;
+	case GXP_ALLOC_BUFFER:
+		ret = gxp_alloc_buffer(client, argp);
+		break;
+	case GXP_FREE_BUFFER:
+		ret = gxp_free_buffer(client, argp);
+		break;
 	case GXP_MAILBOX_COMMAND_COMPAT:
 		ret = gxp_mailbox_command_compat(client, argp);
 		break;
 	case GXP_MAILBOX_RESPONSE:
 		ret = gxp_mailbox_response(client, argp);
 		break;
+	case GXP_MAILBOX_RESPONSE_COMPAT:
+		ret = gxp_mailbox_response_compat(client, argp);
+		break;
 	case GXP_GET_SPECS:
 		ret = gxp_get_specs(client, argp);
 		break;
 	case GXP_ALLOCATE_VIRTUAL_DEVICE:
-		ret = gxp_allocate_vd(client, argp);
+	case GXP_ALLOCATE_VIRTUAL_DEVICE_NO_HINTS:
+		ret = gxp_allocate_vd(client, argp, _IOC_SIZE(cmd));
 		break;
 	case GXP_ETM_TRACE_START_COMMAND:
 		ret = gxp_etm_trace_start_command(client, argp);
@@ -1965,9 +2671,15 @@ static long gxp_ioctl(struct file *file, uint cmd, ulong arg)
 	case GXP_UNMAP_DMABUF:
 		ret = gxp_unmap_dmabuf(client, argp);
 		break;
+	case GXP_EXPORT_BUFFER:
+		ret = gxp_export_buffer(client, argp);
+		break;
 	case GXP_MAILBOX_COMMAND:
 		ret = gxp_mailbox_command(client, argp);
 		break;
+	case GXP_MAILBOX_COMMAND_COMPAT_V2:
+		ret = gxp_mailbox_command_compat_v2(client, argp);
+		break;
 	case GXP_REGISTER_MAILBOX_EVENTFD:
 		ret = gxp_register_mailbox_eventfd(client, argp);
 		break;
@@ -2007,7 +2719,14 @@ static int gxp_mmap(struct file *file, struct vm_area_struct *vma)
 						  GXP_TELEMETRY_TYPE_TRACING,
 						  vma);
 	default:
-		return -EINVAL;
+		/*
+		 * `client->vd` is only set once, and is not released until
+		 * the file is, so it cannot be freed while mmap() runs. Taking
+		 * `client->semaphore` here could deadlock against ioctls which
+		 * pin user pages while holding it.
+		 */
+		return gxp_arena_mmap(client->gxp,
+				      smp_load_acquire(&client->vd), vma);
 	}
 }
 
@@ -2174,7 +2893,6 @@ static int gxp_platform_probe(struct platform_device *pdev)
 	}
 
 	mutex_init(&gxp->dsp_firmware_lock);
-	mutex_init(&gxp->pin_user_pages_lock);
 
 	gxp->domain_pool = kmalloc(sizeof(*gxp->domain_pool), GFP_KERNEL);
 	if (!gxp->domain_pool) {
@@ -2268,6 +2986,7 @@ static int gxp_platform_remove(struct platform_device *pdev)
 	struct gxp_dev *gxp = platform_get_drvdata(pdev);
 
 	gxp_remove_debugfs(gxp);
+	gxp_mailbox_cancel_recovery(gxp->mailbox_mgr);
 	gxp_fw_data_destroy(gxp);
 	if (gxp->gsa_dev)
 		put_device(gxp->gsa_dev);
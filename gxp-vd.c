@@ -6,6 +6,9 @@
  */
 
 #include <linux/bitops.h>
+#include <linux/genalloc.h>
+#include <linux/interval_tree_generic.h>
+#include <linux/moduleparam.h>
 #include <linux/slab.h>
 
 #include "gxp-debug-dump.h"
@@ -15,6 +18,7 @@
 #include "gxp-firmware-data.h"
 #include "gxp-host-device-structs.h"
 #include "gxp-internal.h"
+#include "gxp-iova.h"
 #include "gxp-lpm.h"
 #include "gxp-mailbox.h"
 #include "gxp-notification.h"
@@ -23,12 +27,50 @@
 #include "gxp-vd.h"
 #include "gxp-wakelock.h"
 
+/*
+ * Whether newly allocated virtual devices map buffers into one IOMMU domain
+ * shared by all of their cores, rather than into a domain per core. Off by
+ * default: in a shared domain, every buffer and mailbox window of a virtual
+ * device is accessible to all of its cores, whatever `virtual_core_list` it
+ * was mapped for.
+ */
+static bool gxp_vd_shared_domain;
+module_param_named(shared_domain, gxp_vd_shared_domain, bool, 0660);
+
 static inline void hold_core_in_reset(struct gxp_dev *gxp, uint core)
 {
 	gxp_write_32_core(gxp, core, GXP_REG_ETM_PWRCTL,
 			  1 << GXP_REG_ETM_PWRCTL_CORE_RESET_SHIFT);
 }
 
+#define GXP_MAPPING_IT_START(node) ((node)->start)
+#define GXP_MAPPING_IT_LAST(node) ((node)->last)
+
+INTERVAL_TREE_DEFINE(struct interval_tree_node, rb, unsigned long,
+		     __subtree_last, GXP_MAPPING_IT_START, GXP_MAPPING_IT_LAST,
+		     static, gxp_mapping_it)
+
+/*
+ * Drops @map from @vd's records, without releasing the reference obtained
+ * when it was stored.
+ *
+ * Caller must hold vd->mappings_semaphore for writing.
+ */
+static void gxp_vd_mapping_unlink_locked(struct gxp_virtual_device *vd,
+					 struct gxp_mapping *map)
+{
+	preempt_disable();
+	write_seqcount_begin(&vd->mappings_seq);
+
+	gxp_mapping_it_remove(&map->device_node, &vd->mappings_root);
+	if (map->host_address)
+		gxp_mapping_it_remove(&map->host_node,
+				      &vd->host_mappings_root);
+
+	write_seqcount_end(&vd->mappings_seq);
+	preempt_enable();
+}
+
 int gxp_vd_init(struct gxp_dev *gxp)
 {
 	uint core;
@@ -54,6 +96,39 @@ void gxp_vd_destroy(struct gxp_dev *gxp)
 	up_write(&gxp->vd_semaphore);
 }
 
+/*
+ * Rebuilds @vd's core translation tables from `gxp->core_to_vd`. Virtual cores
+ * are numbered in the order of the physical cores they run on.
+ *
+ * Caller must hold gxp->vd_semaphore for writing.
+ */
+static void gxp_vd_update_core_tables(struct gxp_virtual_device *vd)
+{
+	struct gxp_dev *gxp = vd->gxp;
+	uint core, virt_core = 0;
+
+	vd->phys_core_list = 0;
+	for (core = 0; core < GXP_NUM_CORES; core++) {
+		vd->virt_core_to_phys_core[core] = -EINVAL;
+		vd->phys_core_to_virt_core[core] = -EINVAL;
+	}
+
+	for (core = 0; core < GXP_NUM_CORES; core++) {
+		if (gxp->core_to_vd[core] != vd)
+			continue;
+		vd->virt_core_to_phys_core[virt_core] = core;
+		vd->phys_core_to_virt_core[core] = virt_core;
+		vd->phys_core_list |= BIT(core);
+		virt_core++;
+	}
+}
+
+/* Number of distinct domains in vd->core_domains */
+static int gxp_vd_num_domains(struct gxp_virtual_device *vd)
+{
+	return vd->shared_domain ? 1 : vd->num_cores;
+}
+
 struct gxp_virtual_device *gxp_vd_allocate(struct gxp_dev *gxp,
 					   u16 requested_cores)
 {
@@ -72,6 +147,10 @@ struct gxp_virtual_device *gxp_vd_allocate(struct gxp_dev *gxp,
 	vd->gxp = gxp;
 	vd->num_cores = requested_cores;
 	vd->state = GXP_VD_OFF;
+	for (i = 0; i < GXP_NUM_CORES; i++) {
+		vd->virt_core_to_phys_core[i] = -EINVAL;
+		vd->phys_core_to_virt_core[i] = -EINVAL;
+	}
 
 	vd->core_domains =
 		kcalloc(requested_cores, sizeof(*vd->core_domains), GFP_KERNEL);
@@ -79,19 +158,42 @@ struct gxp_virtual_device *gxp_vd_allocate(struct gxp_dev *gxp,
 		err = -ENOMEM;
 		goto error_free_vd;
 	}
-	for (i = 0; i < requested_cores; i++) {
-		vd->core_domains[i] = gxp_domain_pool_alloc(gxp->domain_pool);
-		if (!vd->core_domains[i]) {
-			err = -EBUSY;
+	vd->pooled_domains =
+		kcalloc(requested_cores, sizeof(*vd->pooled_domains), GFP_KERNEL);
+	if (!vd->pooled_domains) {
+		err = -ENOMEM;
+		goto error_free_core_domains;
+	}
+	vd->shared_domain = gxp_vd_shared_domain;
+	for (i = 0; i < gxp_vd_num_domains(vd); i++) {
+		vd->pooled_domains[i] = gxp_domain_pool_alloc(gxp->domain_pool);
+		if (!vd->pooled_domains[i]) {
+			err = -ENOMEM;
 			goto error_free_domains;
 		}
+		vd->core_domains[i] = vd->pooled_domains[i]->domain;
+	}
+	for (; i < requested_cores; i++) {
+		vd->pooled_domains[i] = vd->pooled_domains[0];
+		vd->core_domains[i] = vd->core_domains[0];
 	}
 
+	vd->iova_pool = gen_pool_create(PAGE_SHIFT, -1);
+	if (!vd->iova_pool) {
+		err = -ENOMEM;
+		goto error_free_domains;
+	}
+	err = gen_pool_add(vd->iova_pool, GXP_IOVA_VD_PRIVATE_START,
+			   GXP_IOVA_VD_PRIVATE_END - GXP_IOVA_VD_PRIVATE_START,
+			   -1);
+	if (err)
+		goto error_destroy_iova_pool;
+
 	vd->mailbox_resp_queues = kcalloc(
 		vd->num_cores, sizeof(*vd->mailbox_resp_queues), GFP_KERNEL);
 	if (!vd->mailbox_resp_queues) {
 		err = -ENOMEM;
-		goto error_free_domains;
+		goto error_destroy_iova_pool;
 	}
 
 	for (i = 0; i < vd->num_cores; i++) {
@@ -100,14 +202,29 @@ struct gxp_virtual_device *gxp_vd_allocate(struct gxp_dev *gxp,
 		init_waitqueue_head(&vd->mailbox_resp_queues[i].waitq);
 	}
 
-	vd->mappings_root = RB_ROOT;
+	err = gxp_arena_init(&vd->arena, vd);
+	if (err)
+		goto error_free_resp_queues;
+
+	vd->mappings_root = RB_ROOT_CACHED;
+	vd->host_mappings_root = RB_ROOT_CACHED;
 	init_rwsem(&vd->mappings_semaphore);
+	seqcount_init(&vd->mappings_seq);
+	gxp_mapping_cache_init(&vd->mapping_cache);
+	gxp_dmabuf_cache_init(&vd->dmabuf_cache);
+	gxp_mapping_release_queue_init(&vd->release_queue);
 
 	return vd;
 
+error_free_resp_queues:
+	kfree(vd->mailbox_resp_queues);
+error_destroy_iova_pool:
+	gen_pool_destroy(vd->iova_pool);
 error_free_domains:
-	for (i -= 1; i >= 0; i--)
-		gxp_domain_pool_free(gxp->domain_pool, vd->core_domains[i]);
+	for (i = min_t(int, i, gxp_vd_num_domains(vd)) - 1; i >= 0; i--)
+		gxp_domain_pool_free(gxp->domain_pool, vd->pooled_domains[i]);
+	kfree(vd->pooled_domains);
+error_free_core_domains:
 	kfree(vd->core_domains);
 error_free_vd:
 	kfree(vd);
@@ -145,15 +262,31 @@ void gxp_vd_release(struct gxp_virtual_device *vd)
 	 * but do it anyway for consistency.
 	 */
 	down_write(&vd->mappings_semaphore);
-	while ((node = rb_first(&vd->mappings_root))) {
-		mapping = rb_entry(node, struct gxp_mapping, node);
-		rb_erase(node, &vd->mappings_root);
+	while ((node = rb_first_cached(&vd->mappings_root))) {
+		mapping = rb_entry(node, struct gxp_mapping, device_node.rb);
+		gxp_vd_mapping_unlink_locked(vd, mapping);
 		gxp_mapping_put(mapping);
 	}
 	up_write(&vd->mappings_semaphore);
 
-	for (i = 0; i < vd->num_cores; i++)
-		gxp_domain_pool_free(vd->gxp->domain_pool, vd->core_domains[i]);
+	/* Mappings must be released while the domains are still held */
+	gxp_mapping_cache_flush(&vd->mapping_cache);
+	gxp_dmabuf_cache_flush(&vd->dmabuf_cache);
+	gxp_mapping_release_queue_flush(&vd->release_queue);
+	gxp_arena_destroy(&vd->arena);
+	/*
+	 * gen_pool_destroy() BUG()s on outstanding allocations. If a mapping
+	 * reference was leaked, leak the pool too rather than crash.
+	 */
+	if (!WARN(gen_pool_avail(vd->iova_pool) != gen_pool_size(vd->iova_pool),
+		  "Leaking IOVA pool with %zu bytes still allocated\n",
+		  gen_pool_size(vd->iova_pool) - gen_pool_avail(vd->iova_pool)))
+		gen_pool_destroy(vd->iova_pool);
+
+	for (i = 0; i < gxp_vd_num_domains(vd); i++)
+		gxp_domain_pool_free(vd->gxp->domain_pool,
+				     vd->pooled_domains[i]);
+	kfree(vd->pooled_domains);
 	kfree(vd->core_domains);
 	kfree(vd->mailbox_resp_queues);
 	kfree(vd);
@@ -232,6 +365,9 @@ static int map_debug_dump_buffer(struct gxp_dev *gxp,
 	/* If debug-dump is not enabled, nothing to map */
 	if (!gxp->debug_dump_mgr)
 		return 0;
+	/* A shared domain maps the buffer once, with its first core */
+	if (vd->shared_domain && virt_core)
+		return 0;
 
 	return gxp_dma_map_allocated_coherent_buffer(
 		gxp, gxp->debug_dump_mgr->buf.vaddr, vd, BIT(virt_core),
@@ -245,6 +381,8 @@ static void unmap_debug_dump_buffer(struct gxp_dev *gxp,
 {
 	if (!gxp->debug_dump_mgr)
 		return;
+	if (vd->shared_domain && virt_core)
+		return;
 
 	gxp_dma_unmap_allocated_coherent_buffer(
 		gxp, vd, BIT(virt_core), gxp->debug_dump_mgr->buf.size,
@@ -256,25 +394,15 @@ int gxp_vd_start(struct gxp_virtual_device *vd)
 {
 	struct gxp_dev *gxp = vd->gxp;
 	uint core;
-	uint available_cores = 0;
 	uint cores_remaining = vd->num_cores;
 	uint core_list = 0;
 	uint virt_core = 0;
 	int ret = 0;
 
-	for (core = 0; core < GXP_NUM_CORES; core++) {
-		if (gxp->core_to_vd[core] == NULL) {
-			if (available_cores < vd->num_cores)
-				core_list |= BIT(core);
-			available_cores++;
-		}
-	}
-
-	if (available_cores < vd->num_cores) {
-		dev_err(gxp->dev, "Insufficient available cores. Available: %u. Requested: %u\n",
-			available_cores, vd->num_cores);
-		return -EBUSY;
-	}
+	ret = gxp_placement_select(gxp, vd->num_cores, &vd->placement,
+				   vd->last_core_list, &core_list);
+	if (ret)
+		return ret;
 
 	vd->fw_app = gxp_fw_data_create_app(gxp, core_list);
 
@@ -284,6 +412,7 @@ int gxp_vd_start(struct gxp_virtual_device *vd)
 
 		if (core_list & BIT(core)) {
 			gxp->core_to_vd[core] = vd;
+			gxp_vd_update_core_tables(vd);
 			cores_remaining--;
 			ret = gxp_dma_domain_attach_device(gxp, vd, virt_core,
 							   core);
@@ -307,6 +436,7 @@ int gxp_vd_start(struct gxp_virtual_device *vd)
 	if (ret)
 		goto err_clean_all_cores;
 
+	vd->last_core_list = core_list;
 	vd->state = GXP_VD_RUNNING;
 	return ret;
 
@@ -330,6 +460,7 @@ err_clean_all_cores:
 			virt_core--;
 		}
 	}
+	gxp_vd_update_core_tables(vd);
 	gxp_fw_data_destroy_app(gxp, vd->fw_app);
 
 	return ret;
@@ -339,7 +470,7 @@ err_clean_all_cores:
 void gxp_vd_stop(struct gxp_virtual_device *vd)
 {
 	struct gxp_dev *gxp = vd->gxp;
-	uint core, core_list = 0;
+	uint core, core_list;
 	uint virt_core = 0;
 	uint lpm_state;
 
@@ -357,9 +488,7 @@ void gxp_vd_stop(struct gxp_virtual_device *vd)
 		}
 	}
 
-	for (core = 0; core < GXP_NUM_CORES; core++)
-		if (gxp->core_to_vd[core] == vd)
-			core_list |= BIT(core);
+	core_list = vd->phys_core_list;
 
 	gxp_firmware_stop(gxp, vd, core_list);
 
@@ -374,6 +503,7 @@ void gxp_vd_stop(struct gxp_virtual_device *vd)
 			virt_core++;
 		}
 	}
+	gxp_vd_update_core_tables(vd);
 
 	if (!IS_ERR_OR_NULL(vd->fw_app)) {
 		gxp_fw_data_destroy_app(gxp, vd->fw_app);
@@ -381,6 +511,44 @@ void gxp_vd_stop(struct gxp_virtual_device *vd)
 	}
 }
 
+int gxp_vd_restart_core(struct gxp_virtual_device *vd, uint core)
+{
+	struct gxp_dev *gxp = vd->gxp;
+	int virt_core;
+	uint i;
+	int ret;
+
+	lockdep_assert_held_write(&gxp->vd_semaphore);
+
+	virt_core = gxp_vd_phys_core_to_virt_core(vd, core);
+	if (vd->state != GXP_VD_RUNNING || virt_core < 0)
+		return -EINVAL;
+
+	hold_core_in_reset(gxp, core);
+	ret = gxp_firmware_restart_core(gxp, vd, virt_core, core);
+	if (!ret)
+		return 0;
+
+	dev_err(gxp->dev, "Failed to restart core %u (ret=%d)\n", core, ret);
+	/*
+	 * Shut down the whole VD, as when a core fails to suspend. The failed
+	 * core has already been powered off by gxp_firmware_restart_core().
+	 */
+	vd->state = GXP_VD_UNAVAILABLE;
+	virt_core = 0;
+	for (i = 0; i < GXP_NUM_CORES; i++) {
+		if (gxp->core_to_vd[i] == vd) {
+			hold_core_in_reset(gxp, i);
+			gxp_dma_domain_detach_device(gxp, vd, virt_core);
+			if (i != core)
+				gxp_pm_core_off(gxp, i);
+			virt_core++;
+		}
+	}
+
+	return ret;
+}
+
 /*
  * Caller must have locked `gxp->vd_semaphore` for writing.
  */
@@ -570,23 +738,14 @@ int gxp_vd_resume(struct gxp_virtual_device *vd)
 /* Caller must have locked `gxp->vd_semaphore` for reading */
 int gxp_vd_virt_core_to_phys_core(struct gxp_virtual_device *vd, u16 virt_core)
 {
-	struct gxp_dev *gxp = vd->gxp;
-	uint phys_core;
-	uint virt_core_index = 0;
-
-	for (phys_core = 0; phys_core < GXP_NUM_CORES; phys_core++) {
-		if (gxp->core_to_vd[phys_core] == vd) {
-			if (virt_core_index == virt_core) {
-				/* Found virtual core */
-				return phys_core;
-			}
-
-			virt_core_index++;
-		}
-	}
-
-	dev_dbg(gxp->dev, "No mapping for virtual core %u\n", virt_core);
-	return -EINVAL;
+	int phys_core = virt_core < GXP_NUM_CORES ?
+				vd->virt_core_to_phys_core[virt_core] :
+				-EINVAL;
+
+	if (phys_core < 0)
+		dev_dbg(vd->gxp->dev, "No mapping for virtual core %u\n",
+			virt_core);
+	return phys_core;
 }
 
 /* Caller must have locked `gxp->vd_semaphore` for reading */
@@ -594,27 +753,20 @@ uint gxp_vd_virt_core_list_to_phys_core_list(struct gxp_virtual_device *vd,
 					     u16 virt_core_list)
 {
 	uint phys_core_list = 0;
-	uint virt_core = 0;
+	uint virt_core;
 	int phys_core;
 
-	while (virt_core_list) {
-		/*
-		 * Get the next virt core by finding the index of the first
-		 * set bit in the core list.
-		 *
-		 * Subtract 1 since `ffs()` returns a 1-based index. Since
-		 * virt_core_list cannot be 0 at this point, no need to worry
-		 * about wrap-around.
-		 */
-		virt_core = ffs(virt_core_list) - 1;
+	/* Any invalid virt cores invalidate the whole list */
+	if (virt_core_list & ~(BIT(GXP_NUM_CORES) - 1))
+		return 0;
 
-		/* Any invalid virt cores invalidate the whole list */
-		phys_core = gxp_vd_virt_core_to_phys_core(vd, virt_core);
+	for (virt_core = 0; virt_core_list; virt_core++, virt_core_list >>= 1) {
+		if (!(virt_core_list & 1))
+			continue;
+		phys_core = vd->virt_core_to_phys_core[virt_core];
 		if (phys_core < 0)
 			return 0;
-
 		phys_core_list |= BIT(phys_core);
-		virt_core_list &= ~BIT(virt_core);
 	}
 
 	return phys_core_list;
@@ -624,68 +776,126 @@ uint gxp_vd_virt_core_list_to_phys_core_list(struct gxp_virtual_device *vd,
 int gxp_vd_phys_core_to_virt_core(struct gxp_virtual_device *vd,
 						u16 phys_core)
 {
-	struct gxp_dev *gxp = vd->gxp;
-	int virt_core = 0;
-	uint core;
+	if (phys_core >= GXP_NUM_CORES)
+		return -EINVAL;
 
-	if (gxp->core_to_vd[phys_core] != vd) {
-		virt_core = -EINVAL;
-		goto out;
-	}
+	return vd->phys_core_to_virt_core[phys_core];
+}
+
+/*
+ * Returns the node in @root whose interval starts at @address, or, if
+ * @check_range is true, the first node whose interval contains @address.
+ *
+ * Only walks down the tree, so it may be called without holding
+ * vd->mappings_semaphore as long as the result is discarded if
+ * vd->mappings_seq changed during the call.
+ */
+static struct interval_tree_node *
+gxp_vd_mapping_it_find(struct rb_root_cached *root, u64 address,
+		       bool check_range)
+{
+	struct rb_node *rb = READ_ONCE(root->rb_root.rb_node);
+	struct interval_tree_node *node;
+
+	if (check_range)
+		return gxp_mapping_it_iter_first(root, address, address);
 
 	/*
-	 * A core's virtual core ID == the number of physical cores in the same
-	 * virtual device with a lower physical core ID than its own.
+	 * The trees are ordered by starting address, with equal starts to the
+	 * right, so a plain binary search finds the exact match even when
+	 * nested mappings also contain @address.
 	 */
-	for (core = 0; core < phys_core; core++) {
-		if (gxp->core_to_vd[core] == vd)
-			virt_core++;
+	while (rb) {
+		node = rb_entry(rb, struct interval_tree_node, rb);
+		if (address < node->start)
+			rb = READ_ONCE(rb->rb_left);
+		else if (address > node->start)
+			rb = READ_ONCE(rb->rb_right);
+		else
+			return node;
 	}
-out:
-	return virt_core;
+
+	return NULL;
 }
 
-int gxp_vd_mapping_store(struct gxp_virtual_device *vd,
-			 struct gxp_mapping *map)
+/* Caller must hold vd->mappings_semaphore. Does not acquire a reference. */
+static struct gxp_mapping *
+gxp_vd_mapping_find_locked(struct gxp_virtual_device *vd,
+			   dma_addr_t device_address, bool check_range)
 {
-	struct rb_node **link;
-	struct rb_node *parent = NULL;
-	dma_addr_t device_address = map->device_address;
-	struct gxp_mapping *mapping;
+	struct interval_tree_node *node;
 
-	link = &vd->mappings_root.rb_node;
+	node = gxp_vd_mapping_it_find(&vd->mappings_root, device_address,
+				      check_range);
 
-	down_write(&vd->mappings_semaphore);
-
-	/* Figure out where to put the new node */
-	while (*link) {
-		parent = *link;
-		mapping = rb_entry(parent, struct gxp_mapping, node);
+	return node ? container_of(node, struct gxp_mapping, device_node) :
+		      NULL;
+}
 
-		if (mapping->device_address > device_address)
-			link = &(*link)->rb_left;
-		else if (mapping->device_address < device_address)
-			link = &(*link)->rb_right;
-		else
-			goto out;
+/* Caller must hold vd->mappings_semaphore for writing. */
+static int gxp_vd_mapping_store_locked(struct gxp_virtual_device *vd,
+				       struct gxp_mapping *map)
+{
+	if (gxp_vd_mapping_find_locked(vd, map->device_address, false)) {
+		dev_err(vd->gxp->dev, "Duplicate mapping: %pad\n",
+			&map->device_address);
+		return -EEXIST;
 	}
 
-	/* Add new node and rebalance the tree. */
-	rb_link_node(&map->node, parent, link);
-	rb_insert_color(&map->node, &vd->mappings_root);
+	/*
+	 * dma-buf mappings do not record their size, so they are only found
+	 * by their starting device address.
+	 */
+	map->device_node.start = map->device_address;
+	map->device_node.last =
+		map->device_address + max_t(size_t, map->size, 1) - 1;
+	map->host_node.start = map->host_address;
+	map->host_node.last = map->host_address + map->size - 1;
+
+	preempt_disable();
+	write_seqcount_begin(&vd->mappings_seq);
+
+	gxp_mapping_it_insert(&map->device_node, &vd->mappings_root);
+	/* dma-bufs are not mapped from a user-space address */
+	if (map->host_address)
+		gxp_mapping_it_insert(&map->host_node,
+				      &vd->host_mappings_root);
+
+	write_seqcount_end(&vd->mappings_seq);
+	preempt_enable();
 
 	/* Acquire a reference to the mapping */
 	gxp_mapping_get(map);
 
+	return 0;
+}
+
+int gxp_vd_mapping_store(struct gxp_virtual_device *vd,
+			 struct gxp_mapping *map)
+{
+	int ret;
+
+	down_write(&vd->mappings_semaphore);
+	ret = gxp_vd_mapping_store_locked(vd, map);
 	up_write(&vd->mappings_semaphore);
 
-	return 0;
+	return ret;
+}
+
+void gxp_vd_mapping_store_batch(struct gxp_virtual_device *vd,
+				struct gxp_mapping **maps, int *rets,
+				uint count)
+{
+	uint i;
+
+	down_write(&vd->mappings_semaphore);
+
+	for (i = 0; i < count; i++) {
+		if (maps[i])
+			rets[i] = gxp_vd_mapping_store_locked(vd, maps[i]);
+	}
 
-out:
 	up_write(&vd->mappings_semaphore);
-	dev_err(vd->gxp->dev, "Duplicate mapping: %pad\n",
-		&map->device_address);
-	return -EEXIST;
 }
 
 void gxp_vd_mapping_remove(struct gxp_virtual_device *vd,
@@ -694,7 +904,7 @@ void gxp_vd_mapping_remove(struct gxp_virtual_device *vd,
 	down_write(&vd->mappings_semaphore);
 
 	/* Drop the mapping from this virtual device's records */
-	rb_erase(&map->node, &vd->mappings_root);
+	gxp_vd_mapping_unlink_locked(vd, map);
 
 	/* Release the reference obtained in gxp_vd_mapping_store() */
 	gxp_mapping_put(map);
@@ -702,63 +912,115 @@ void gxp_vd_mapping_remove(struct gxp_virtual_device *vd,
 	up_write(&vd->mappings_semaphore);
 }
 
-static bool is_device_address_in_mapping(struct gxp_mapping *mapping,
-					 dma_addr_t device_address)
+void gxp_vd_mapping_remove_batch(struct gxp_virtual_device *vd,
+				 const dma_addr_t *device_addresses,
+				 struct gxp_mapping **maps, int *rets,
+				 uint count)
 {
-	return ((device_address >= mapping->device_address) &&
-		(device_address < (mapping->device_address + mapping->size)));
+	struct gxp_mapping *mapping;
+	uint i;
+
+	down_write(&vd->mappings_semaphore);
+
+	for (i = 0; i < count; i++) {
+		maps[i] = NULL;
+		if (rets[i])
+			continue;
+
+		mapping = gxp_vd_mapping_find_locked(vd, device_addresses[i],
+						     false);
+
+		/* dma-bufs must be unmapped via GXP_UNMAP_DMABUF */
+		if (!mapping || !mapping->host_address) {
+			rets[i] = -EINVAL;
+			continue;
+		}
+
+		/*
+		 * Drop the mapping from this virtual device's records, handing
+		 * the reference obtained in gxp_vd_mapping_store() to the
+		 * caller.
+		 */
+		gxp_vd_mapping_unlink_locked(vd, mapping);
+		maps[i] = mapping;
+	}
+
+	up_write(&vd->mappings_semaphore);
 }
 
+/*
+ * Looks up a mapping in @vd's index of device address ranges, or of host
+ * address ranges if @host is true, and acquires a reference to it.
+ *
+ * Lookups do not take vd->mappings_semaphore. They are retried if the index
+ * changes while they run, and mappings are freed only after an RCU grace
+ * period, so a mapping found here is safe to read until its reference count
+ * is checked.
+ */
 static struct gxp_mapping *
-gxp_vd_mapping_internal_search(struct gxp_virtual_device *vd,
-			       dma_addr_t device_address, bool check_range)
+gxp_vd_mapping_lookup(struct gxp_virtual_device *vd, u64 address, bool host,
+		      bool check_range)
 {
-	struct rb_node *node;
-	struct gxp_mapping *mapping;
+	struct rb_root_cached *root =
+		host ? &vd->host_mappings_root : &vd->mappings_root;
+	struct interval_tree_node *node;
+	struct gxp_mapping *mapping = NULL;
+	uint seq;
+
+	rcu_read_lock();
+
+	do {
+		seq = read_seqcount_begin(&vd->mappings_seq);
+		node = gxp_vd_mapping_it_find(root, address, check_range);
+	} while (read_seqcount_retry(&vd->mappings_seq, seq));
+
+	if (node) {
+		if (host)
+			mapping = container_of(node, struct gxp_mapping,
+					       host_node);
+		else
+			mapping = container_of(node, struct gxp_mapping,
+					       device_node);
+		/* The mapping is being destroyed if its last reference is gone */
+		if (!gxp_mapping_get(mapping))
+			mapping = NULL;
+	}
 
-	down_read(&vd->mappings_semaphore);
+	rcu_read_unlock();
 
-	node = vd->mappings_root.rb_node;
-
-	while (node) {
-		mapping = rb_entry(node, struct gxp_mapping, node);
-		if ((mapping->device_address == device_address) ||
-		    (check_range &&
-		     is_device_address_in_mapping(mapping, device_address))) {
-			gxp_mapping_get(mapping);
-			up_read(&vd->mappings_semaphore);
-			return mapping; /* Found it */
-		} else if (mapping->device_address > device_address) {
-			node = node->rb_left;
-		} else {
-			node = node->rb_right;
-		}
-	}
+	return mapping;
+}
 
-	up_read(&vd->mappings_semaphore);
+void gxp_vd_mapping_search_batch(struct gxp_virtual_device *vd,
+				 const dma_addr_t *device_addresses,
+				 struct gxp_mapping **maps, uint count)
+{
+	uint i;
 
-	return NULL;
+	for (i = 0; i < count; i++)
+		maps[i] = gxp_vd_mapping_lookup(vd, device_addresses[i],
+						/*host=*/false,
+						/*check_range=*/false);
 }
 
 struct gxp_mapping *gxp_vd_mapping_search(struct gxp_virtual_device *vd,
 					  dma_addr_t device_address)
 {
-	return gxp_vd_mapping_internal_search(vd, device_address, false);
+	return gxp_vd_mapping_lookup(vd, device_address, /*host=*/false,
+				     /*check_range=*/false);
 }
 
 struct gxp_mapping *
 gxp_vd_mapping_search_in_range(struct gxp_virtual_device *vd,
 			       dma_addr_t device_address)
 {
-	return gxp_vd_mapping_internal_search(vd, device_address, true);
+	return gxp_vd_mapping_lookup(vd, device_address, /*host=*/false,
+				     /*check_range=*/true);
 }
 
 struct gxp_mapping *gxp_vd_mapping_search_host(struct gxp_virtual_device *vd,
 					       u64 host_address)
 {
-	struct rb_node *node;
-	struct gxp_mapping *mapping;
-
 	/*
 	 * dma-buf mappings can not be looked-up by host address since they are
 	 * not mapped from a user-space address.
@@ -769,19 +1031,23 @@ struct gxp_mapping *gxp_vd_mapping_search_host(struct gxp_virtual_device *vd,
 		return NULL;
 	}
 
+	return gxp_vd_mapping_lookup(vd, host_address, /*host=*/true,
+				     /*check_range=*/false);
+}
+
+void gxp_vd_mapping_for_each(struct gxp_virtual_device *vd,
+			     void (*fn)(struct gxp_mapping *mapping,
+					void *data),
+			     void *data)
+{
+	struct interval_tree_node *node;
+
 	down_read(&vd->mappings_semaphore);
 
-	/* Iterate through the elements in the rbtree */
-	for (node = rb_first(&vd->mappings_root); node; node = rb_next(node)) {
-		mapping = rb_entry(node, struct gxp_mapping, node);
-		if (mapping->host_address == host_address) {
-			gxp_mapping_get(mapping);
-			up_read(&vd->mappings_semaphore);
-			return mapping;
-		}
-	}
+	for (node = gxp_mapping_it_iter_first(&vd->mappings_root, 0,
+					      ULONG_MAX);
+	     node; node = gxp_mapping_it_iter_next(node, 0, ULONG_MAX))
+		fn(container_of(node, struct gxp_mapping, device_node), data);
 
 	up_read(&vd->mappings_semaphore);
-
-	return NULL;
 }
@@ -7,16 +7,22 @@
 #ifndef __GXP_VD_H__
 #define __GXP_VD_H__
 
+#include <linux/interval_tree.h>
 #include <linux/iommu.h>
 #include <linux/list.h>
 #include <linux/rbtree.h>
 #include <linux/rwsem.h>
+#include <linux/seqlock.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/wait.h>
 
+#include "gxp-arena.h"
+#include "gxp-dmabuf.h"
 #include "gxp-internal.h"
 #include "gxp-mapping.h"
+#include "gxp-mapping-cache.h"
+#include "gxp-placement.h"
 
 struct mailbox_resp_queue {
 	/* Queue of `struct gxp_async_response`s */
@@ -39,14 +45,60 @@ enum gxp_virtual_device_state {
 	GXP_VD_UNAVAILABLE = 3,
 };
 
+struct gen_pool;
+struct gxp_pooled_domain;
+
 struct gxp_virtual_device {
 	struct gxp_dev *gxp;
 	uint num_cores;
 	void *fw_app;
+	/*
+	 * Domain of each virtual core. If `shared_domain` is set, every entry
+	 * points to the same domain, so buffers are mapped once for all cores.
+	 */
 	struct iommu_domain **core_domains;
+	/* The pool's handle for each entry of `core_domains` */
+	struct gxp_pooled_domain **pooled_domains;
+	bool shared_domain;
+	/* Virtual cores whose stream IDs are routed to their domain */
+	uint attached_core_list;
+	/* Virtual cores whose fixed IOVA resources are mapped */
+	uint resource_core_list;
+	/* Allocates the IOVAs user buffers are mapped at in `core_domains` */
+	struct gen_pool *iova_pool;
 	struct mailbox_resp_queue *mailbox_resp_queues;
-	struct rb_root mappings_root;
+	/* Mappings indexed by the range of device addresses they cover */
+	struct rb_root_cached mappings_root;
+	/* User buffer mappings indexed by the range of host addresses they cover */
+	struct rb_root_cached host_mappings_root;
+	/*
+	 * Held for writing to store or remove mappings. Lookups do not take
+	 * it; they retry if `mappings_seq` changes while they run.
+	 */
 	struct rw_semaphore mappings_semaphore;
+	seqcount_t mappings_seq;
+	/* Mappings kept alive after being unmapped, for reuse */
+	struct gxp_mapping_cache mapping_cache;
+	/* dma-buf mappings kept alive after being unmapped, for reuse */
+	struct gxp_dmabuf_cache dmabuf_cache;
+	/* Released mappings waiting to be unmapped and unpinned */
+	struct gxp_mapping_release_queue release_queue;
+	/* Driver-owned buffers, pre-mapped to all cores, shared with user-space */
+	struct gxp_arena arena;
+	/* Where the virtual device asked to be placed when it starts */
+	struct gxp_placement_hints placement;
+	/* Physical cores the virtual device last ran on */
+	uint last_core_list;
+	/*
+	 * Translations between the virtual cores and the physical cores they
+	 * are running on, or -EINVAL where there is none. Rebuilt whenever
+	 * `gxp->core_to_vd` changes for this virtual device, and protected by
+	 * `gxp->vd_semaphore` like it.
+	 */
+	int virt_core_to_phys_core[GXP_NUM_CORES];
+	int phys_core_to_virt_core[GXP_NUM_CORES];
+	/* Physical cores the virtual device is running on */
+	uint phys_core_list;
 	enum gxp_virtual_device_state state;
 	/*
 	 * Record the gxp->power_mgr->blk_switch_count when the vd was
@@ -81,8 +133,7 @@ void gxp_vd_destroy(struct gxp_dev *gxp);
  *
  * Return: The virtual address of the virtual device or an ERR_PTR on failure
  * * -EINVAL - The number of requested cores was invalid
- * * -ENOMEM - Unable to allocate the virtual device
- * * -EBUSY  - Not enough iommu domains available
+ * * -ENOMEM - Unable to allocate the virtual device or its iommu domains
  */
 struct gxp_virtual_device *gxp_vd_allocate(struct gxp_dev *gxp, u16 requested_cores);
 
@@ -114,6 +165,25 @@ int gxp_vd_start(struct gxp_virtual_device *vd);
  */
 void gxp_vd_stop(struct gxp_virtual_device *vd);
 
+/**
+ * gxp_vd_restart_core() - Reboot one physical core of a running virtual device
+ * @vd: The virtual device @core belongs to
+ * @core: The physical core to restart
+ *
+ * Commands pending on @core which were flagged as idempotent are re-sent once
+ * the core is back up; all other pending commands are aborted. If the core
+ * cannot be restarted, @vd is marked GXP_VD_UNAVAILABLE and all of its cores
+ * are shut down.
+ *
+ * The caller must have locked gxp->vd_semaphore for writing.
+ *
+ * Return:
+ * * 0       - Success
+ * * -EINVAL - @core is not running for @vd
+ * * Otherwise - Error returned while rebooting the core's firmware
+ */
+int gxp_vd_restart_core(struct gxp_virtual_device *vd, uint core);
+
 /*
  * Returns the physical core ID for the specified virtual_core belonging to
  * this virtual device or -EINVAL if this virtual core is not running on a
@@ -156,6 +226,22 @@ int gxp_vd_phys_core_to_virt_core(struct gxp_virtual_device *vd, u16 phys_core);
 int gxp_vd_mapping_store(struct gxp_virtual_device *vd,
 			 struct gxp_mapping *map);
 
+/**
+ * gxp_vd_mapping_store_batch() - Store several mappings in a virtual device's
+ *                                records
+ * @vd: The virtual device the mappings were created for and will be stored in
+ * @maps: Array of @count mappings to store; NULL entries are skipped
+ * @rets: Array of @count results, set for each non-NULL entry of @maps to the
+ *        value gxp_vd_mapping_store() would have returned for it
+ * @count: The number of entries in @maps and @rets
+ *
+ * Acquires a reference to each mapping which was successfully stored. The
+ * VD's records are locked only once for the whole batch.
+ */
+void gxp_vd_mapping_store_batch(struct gxp_virtual_device *vd,
+				struct gxp_mapping **maps, int *rets,
+				uint count);
+
 /**
  * gxp_vd_mapping_remove() - Remove a mapping from a virtual device's records
  * @vd: The VD to remove @map from
@@ -166,6 +252,26 @@ int gxp_vd_mapping_store(struct gxp_virtual_device *vd,
 void gxp_vd_mapping_remove(struct gxp_virtual_device *vd,
 			   struct gxp_mapping *map);
 
+/**
+ * gxp_vd_mapping_remove_batch() - Remove several user buffer mappings from a
+ *                                 virtual device's records
+ * @vd: The VD to remove the mappings from
+ * @device_addresses: Array of @count starting device addresses of the mappings
+ *                    to remove
+ * @maps: Array of @count entries, set to the removed mappings or NULL
+ * @rets: Array of @count results. Entries which are non-zero on entry are
+ *        skipped; others are set to -EINVAL if no user buffer mapping starts
+ *        at the corresponding device address.
+ * @count: The number of entries in each array
+ *
+ * The VD's reference to each removed mapping is handed over to the caller
+ * through @maps. The VD's records are locked only once for the whole batch.
+ */
+void gxp_vd_mapping_remove_batch(struct gxp_virtual_device *vd,
+				 const dma_addr_t *device_addresses,
+				 struct gxp_mapping **maps, int *rets,
+				 uint count);
+
 /**
  * gxp_vd_mapping_search() - Obtain a reference to the mapping starting at the
  *                           specified device address
@@ -179,6 +285,22 @@ void gxp_vd_mapping_remove(struct gxp_virtual_device *vd,
 struct gxp_mapping *gxp_vd_mapping_search(struct gxp_virtual_device *vd,
 					  dma_addr_t device_address);
 
+/**
+ * gxp_vd_mapping_search_batch() - Obtain references to the mappings starting at
+ *                                 several device addresses
+ * @vd: The virtual device to search for the mappings
+ * @device_addresses: Array of @count starting device addresses
+ * @maps: Array of @count entries, set to the mapping found for each address,
+ *        or NULL if there is none
+ * @count: The number of entries in @device_addresses and @maps
+ *
+ * Obtains a reference to each mapping found. The VD's records are locked only
+ * once for the whole batch.
+ */
+void gxp_vd_mapping_search_batch(struct gxp_virtual_device *vd,
+				 const dma_addr_t *device_addresses,
+				 struct gxp_mapping **maps, uint count);
+
 /**
  * gxp_vd_mapping_search_in_range() - Obtain a reference to the mapping which
  *                                    contains the specified device address
@@ -207,6 +329,21 @@ gxp_vd_mapping_search_in_range(struct gxp_virtual_device *vd,
 struct gxp_mapping *gxp_vd_mapping_search_host(struct gxp_virtual_device *vd,
 					       u64 host_address);
 
+/**
+ * gxp_vd_mapping_for_each() - Call a function for each mapping of a virtual
+ *                             device
+ * @vd: The virtual device whose mappings to visit
+ * @fn: The function to call, in order of increasing device address
+ * @data: Passed to @fn along with each mapping
+ *
+ * @fn is called with @vd's mappings locked for reading, so it must not store
+ * or remove mappings.
+ */
+void gxp_vd_mapping_for_each(struct gxp_virtual_device *vd,
+			     void (*fn)(struct gxp_mapping *mapping,
+					void *data),
+			     void *data);
+
 /**
  * gxp_vd_suspend() - Suspend a running virtual device
  * @vd: The virtual device to suspend
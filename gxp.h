@@ -12,7 +12,7 @@
 
 /* Interface Version */
 #define GXP_INTERFACE_VERSION_MAJOR	1
-#define GXP_INTERFACE_VERSION_MINOR	3
+#define GXP_INTERFACE_VERSION_MINOR	12
 #define GXP_INTERFACE_VERSION_BUILD	0
 
 /*
@@ -95,9 +95,46 @@ struct gxp_virtual_device_ioctl {
 	 * The ID assigned to the virtual device and shared with its cores.
 	 */
 	__u32 vdid;
+	/*
+	 * Input:
+	 * Flags controlling which physical cores the virtual device is placed
+	 * on when it starts. Set RESERVED bits to 0 to ensure backwards
+	 * compatibility.
+	 *
+	 * Bitfields:
+	 *   [0:0]   - GXP_VD_PLACEMENT_CONTIGUOUS: place the virtual device on
+	 *             neighbouring physical cores
+	 *   [1:1]   - GXP_VD_PLACEMENT_STRICT: fail to start the virtual device
+	 *             with EBUSY, rather than place it elsewhere, if the other
+	 *             flags and @preferred_core_list cannot be satisfied
+	 *   [31:2]  - RESERVED
+	 */
+	__u32 placement_flags;
+	/*
+	 * Input:
+	 * Bitfield of the physical cores the virtual device prefers to be
+	 * placed on, or 0 for no preference. To prefer physical core X, set
+	 * bit X in this field, i.e. `1 << X`.
+	 */
+	__u32 preferred_core_list;
 };
 
-/* Allocate virtual device. */
+#define GXP_VD_PLACEMENT_CONTIGUOUS	(1 << 0)
+#define GXP_VD_PLACEMENT_STRICT		(1 << 1)
+
+/*
+ * Allocate virtual device.
+ *
+ * Without hints, a restarting virtual device prefers the physical cores it last
+ * ran on. Otherwise it is placed on the free cores closest together which
+ * leave the largest block of neighbouring cores free for other virtual devices.
+ *
+ * Callers built against an interface version without `placement_flags` and
+ * `preferred_core_list` remain supported, and get no hints.
+ *
+ * EINVAL: If @placement_flags has RESERVED bits set, or @preferred_core_list
+ *         names cores which do not exist.
+ */
 #define GXP_ALLOCATE_VIRTUAL_DEVICE \
 	_IOWR(GXP_IOCTL_BASE, 6, struct gxp_virtual_device_ioctl)
 
@@ -332,6 +369,51 @@ struct gxp_map_ioctl {
 #define GXP_UNMAP_BUFFER \
 	_IOW(GXP_IOCTL_BASE, 1, struct gxp_map_ioctl)
 
+/* Maximum number of buffers a single GXP_[UN]MAP_BUFFERS call can process */
+#define GXP_MAX_BUFFERS_PER_IOCTL	256
+
+struct gxp_map_buffers_ioctl {
+	/*
+	 * User-space address of an array of `count` `struct gxp_map_ioctl`s,
+	 * each filled in as for GXP_MAP_BUFFER or GXP_UNMAP_BUFFER. The map
+	 * IOCTL writes back each buffer's `device_address`.
+	 */
+	__u64 buffers;
+	/*
+	 * User-space address of an array of `count` `__s32`s. The IOCTL sets
+	 * each entry to 0 if the corresponding buffer was processed, or to the
+	 * negative error code GXP_MAP_BUFFER or GXP_UNMAP_BUFFER would have
+	 * returned for it.
+	 */
+	__u64 results;
+	/* Number of buffers, at most GXP_MAX_BUFFERS_PER_IOCTL */
+	__u32 count;
+};
+
+/*
+ * Map several host buffers at once.
+ *
+ * Buffers which fail to map do not prevent the others from being mapped. If
+ * any buffer fails, the IOCTL returns the error of the first one which did,
+ * and `results` indicates which buffers were mapped.
+ *
+ * The client must have allocated a virtual device.
+ */
+#define GXP_MAP_BUFFERS \
+	_IOW(GXP_IOCTL_BASE, 31, struct gxp_map_buffers_ioctl)
+
+/*
+ * Un-map several host buffers previously mapped by GXP_MAP_BUFFER or
+ * GXP_MAP_BUFFERS.
+ *
+ * As for GXP_UNMAP_BUFFER, only the @device_address field of each buffer is
+ * used. Errors are reported as for GXP_MAP_BUFFERS.
+ *
+ * The client must have allocated a virtual device.
+ */
+#define GXP_UNMAP_BUFFERS \
+	_IOW(GXP_IOCTL_BASE, 32, struct gxp_map_buffers_ioctl)
+
 /* GXP sync flag macros */
 #define GXP_SYNC_FOR_DEVICE		(0)
 #define GXP_SYNC_FOR_CPU		(1)
@@ -339,7 +421,7 @@ struct gxp_map_ioctl {
 struct gxp_sync_ioctl {
 	/*
 	 * The starting address of the buffer to be synchronized. Must be a
-	 * device address returned by GXP_MAP_BUFFER.
+	 * device address returned by GXP_MAP_BUFFER or GXP_MAP_DMABUF.
 	 */
 	__u64 device_address;
 	/* size in bytes to be sync'ed */
@@ -363,7 +445,10 @@ struct gxp_sync_ioctl {
 };
 
 /*
- * Sync buffer previously mapped by GXP_MAP_BUFFER.
+ * Sync buffer previously mapped by GXP_MAP_BUFFER or GXP_MAP_DMABUF.
+ *
+ * Only the requested range is synced. For dma-bufs, the mapping size is the
+ * size of the dma-buf.
  *
  * The client must have allocated a virtual device.
  *
@@ -374,6 +459,80 @@ struct gxp_sync_ioctl {
 #define GXP_SYNC_BUFFER \
 	_IOW(GXP_IOCTL_BASE, 2, struct gxp_sync_ioctl)
 
+struct gxp_sync_buffers_ioctl {
+	/*
+	 * User-space address of an array of `count` `struct gxp_sync_ioctl`s,
+	 * each filled in as for GXP_SYNC_BUFFER.
+	 */
+	__u64 buffers;
+	/* Number of ranges, at most GXP_MAX_BUFFERS_PER_IOCTL */
+	__u32 count;
+};
+
+/*
+ * Sync several ranges of buffers previously mapped by GXP_MAP_BUFFER,
+ * GXP_MAP_BUFFERS or GXP_MAP_DMABUF at once.
+ *
+ * Overlapping or adjacent ranges of the same buffer which are synced in the
+ * same direction are merged and synced once.
+ *
+ * The client must have allocated a virtual device.
+ *
+ * EINVAL: If any range would be rejected by GXP_SYNC_BUFFER. Nothing is
+ *         synced in that case.
+ */
+#define GXP_SYNC_BUFFERS \
+	_IOW(GXP_IOCTL_BASE, 33, struct gxp_sync_buffers_ioctl)
+
+struct gxp_alloc_buffer_ioctl {
+	/*
+	 * Size of the buffer to allocate, in bytes. Rounded up to a multiple
+	 * of PAGE_SIZE.
+	 */
+	__u64 size;
+	/* Set to 0; reserved for future use */
+	__u32 flags;
+	/* Device address of the buffer, set by the driver */
+	__u64 device_address;
+	/*
+	 * Offset to pass to mmap() on the GXP device file to map the buffer
+	 * into user-space, set by the driver. The mapping must be MAP_SHARED
+	 * and no larger than the buffer.
+	 */
+	__u64 mmap_offset;
+};
+
+/*
+ * Allocate a buffer from memory owned by the driver which is already mapped
+ * to all cores of the client's virtual device.
+ *
+ * Unlike a buffer mapped by GXP_MAP_BUFFER, no user pages are pinned and,
+ * once the virtual device has allocated enough memory, no IOMMU mappings are
+ * created. The memory is write-combined for the CPU, so it never needs to be
+ * synced by GXP_SYNC_BUFFER.
+ *
+ * The client must have allocated a virtual device.
+ *
+ * EINVAL: If @size equals 0 or @flags is not 0.
+ * ENOMEM: If the virtual device has reached the `arena_max_size` module
+ *         parameter, or memory could not be allocated.
+ */
+#define GXP_ALLOC_BUFFER \
+	_IOWR(GXP_IOCTL_BASE, 34, struct gxp_alloc_buffer_ioctl)
+
+/*
+ * Free a buffer allocated by GXP_ALLOC_BUFFER, given its device address.
+ *
+ * Any user-space mappings of the buffer are torn down; accessing them
+ * afterwards raises SIGBUS.
+ *
+ * The client must have allocated a virtual device.
+ *
+ * EINVAL: If no buffer allocated by the client's virtual device starts at the
+ *         given device address.
+ */
+#define GXP_FREE_BUFFER _IOW(GXP_IOCTL_BASE, 35, __u64)
+
 struct gxp_map_dmabuf_ioctl {
 	/*
 	 * Bitfield indicating which virtual cores to map the dma-buf for.
@@ -426,6 +585,59 @@ struct gxp_map_dmabuf_ioctl {
  */
 #define GXP_UNMAP_DMABUF _IOW(GXP_IOCTL_BASE, 21, struct gxp_map_dmabuf_ioctl)
 
+struct gxp_export_buffer_ioctl {
+	/* Size, in bytes, of the buffer to allocate; rounded up to pages. */
+	__u64 size;
+	/*
+	 * Bitfield indicating which virtual cores to map the buffer for.
+	 * To map for virtual core X, set bit X in this field, i.e. `1 << X`.
+	 */
+	__u16 virtual_core_list;
+	/*
+	 * Flags indicating mapping attribute requests from the runtime.
+	 * Set RESERVED bits to 0 to ensure backwards compatibility.
+	 *
+	 * Bitfields:
+	 *   [1:0]   - DMA_DIRECTION, as for GXP_MAP_DMABUF
+	 *   [31:2]  - RESERVED
+	 */
+	__u32 flags;
+	/*
+	 * Output:
+	 * File descriptor of the dma-buf exporting the buffer.
+	 */
+	__s32 dmabuf_fd;
+	/*
+	 * Output:
+	 * Device address the buffer is mapped to, as if by GXP_MAP_DMABUF.
+	 */
+	__u64 device_address;
+};
+
+/*
+ * Allocate a buffer from memory owned by the driver, export it as a dma-buf,
+ * and map the dma-buf for the requested virtual cores.
+ *
+ * The dma-buf can be passed to other drivers, such as the TPU's or the
+ * display's, to share the buffer with them without copies. It supports
+ * mmap(), and DMA_BUF_IOCTL_SYNC maintains the CPU caches for every device
+ * the dma-buf is attached to.
+ *
+ * The mapping in the virtual device is an ordinary dma-buf mapping: it is
+ * unmapped by GXP_UNMAP_DMABUF, and synced by GXP_SYNC_BUFFER. The buffer is
+ * freed once the dma-buf has been unmapped and every reference to it,
+ * including @dmabuf_fd, has been released.
+ *
+ * The client must have allocated a virtual device.
+ *
+ * EINVAL: If @size or @virtual_core_list equals 0, @size exceeds the driver's
+ *         limit, @virtual_core_list names cores the virtual device does not
+ *         have, or @flags has RESERVED bits set.
+ * ENOMEM: If the buffer could not be allocated.
+ */
+#define GXP_EXPORT_BUFFER \
+	_IOWR(GXP_IOCTL_BASE, 36, struct gxp_export_buffer_ioctl)
+
 struct gxp_mailbox_command_ioctl {
 	/*
 	 * Input:
@@ -490,15 +702,74 @@ struct gxp_mailbox_command_ioctl {
 	 *   [31:2]  - RESERVED
 	 */
 	__u32 power_flags;
+	/*
+	 * Input:
+	 * Flags for the kernel driver, as opposed to `flags` which are passed
+	 * through to the GXP device.
+	 * Set RESERVED bits to 0 to ensure backwards compatibility.
+	 *
+	 * Bitfields:
+	 *   [0:0]   - IDEMPOTENT
+	 *               0 = The command must not be executed more than once
+	 *               1 = The command may be re-sent to the core if the
+	 *                   core is restarted before responding to it
+	 *   [31:1]  - RESERVED
+	 */
+	__u32 driver_flags;
+	/*
+	 * Input:
+	 * Opaque value which is not interpreted by the driver. It is returned
+	 * verbatim in the `user_cookie` field of the response fetched via
+	 * `GXP_MAILBOX_RESPONSE`, so the caller can locate its request object
+	 * without keeping a `sequence_number` lookup table.
+	 */
+	__u64 user_cookie;
+	/*
+	 * Input:
+	 * Absolute time, in nanoseconds of CLOCK_MONOTONIC, by which the
+	 * command should complete, or 0 if the command has no deadline.
+	 *
+	 * If the driver limits how many commands are outstanding on a core,
+	 * commands waiting for a slot are sent earliest deadline first, ahead
+	 * of commands without a deadline. Commands which do not complete
+	 * successfully by their deadline are counted as misses against the
+	 * client.
+	 */
+	__u64 deadline_ns;
 };
 
+/* Command may be re-sent if its core is restarted before it completes. */
+#define GXP_MAILBOX_COMMAND_IDEMPOTENT	(1 << 0)
+
 /*
  * Push element to the mailbox commmand queue.
  *
  * The client must hold a VIRTUAL_DEVICE wakelock.
  */
 #define GXP_MAILBOX_COMMAND \
-	_IOWR(GXP_IOCTL_BASE, 23, struct gxp_mailbox_command_ioctl)
+	_IOWR(GXP_IOCTL_BASE, 28, struct gxp_mailbox_command_ioctl)
+
+/*
+ * Legacy "mailbox command" IOCTL that does not support driver flags, user
+ * cookies or deadlines.
+ * This IOCTL exists for backwards compatibility with older runtimes. All
+ * fields, other than the unsupported `driver_flags`, `user_cookie` and
+ * `deadline_ns`, are the same as in `struct gxp_mailbox_command_ioctl`.
+ */
+struct gxp_mailbox_command_compat_v2_ioctl {
+	__u16 virtual_core_id;
+	__u64 sequence_number;
+	__u64 device_address;
+	__u32 size;
+	__u32 gxp_power_state;
+	__u32 memory_power_state;
+	__u32 flags;
+	__u32 power_flags;
+};
+
+/* The client must hold a VIRTUAL_DEVICE wakelock. */
+#define GXP_MAILBOX_COMMAND_COMPAT_V2 \
+	_IOWR(GXP_IOCTL_BASE, 23, struct gxp_mailbox_command_compat_v2_ioctl)
 
 /*
  * Legacy "mailbox command" IOCTL that does not support power requests.
@@ -522,6 +793,11 @@ struct gxp_mailbox_command_compat_ioctl {
 #define GXP_RESPONSE_ERROR_NONE         (0)
 #define GXP_RESPONSE_ERROR_INTERNAL     (1)
 #define GXP_RESPONSE_ERROR_TIMEOUT      (2)
+/*
+ * The core was restarted before responding, and the command was not re-sent
+ * since it was not flagged with `GXP_MAILBOX_COMMAND_IDEMPOTENT`.
+ */
+#define GXP_RESPONSE_ERROR_ABORTED      (3)
 
 struct gxp_mailbox_response_ioctl {
 	/*
@@ -548,6 +824,13 @@ struct gxp_mailbox_response_ioctl {
 	 * Only valid if `error_code` == GXP_RESPONSE_ERROR_NONE
 	 */
 	__u32 cmd_retval;
+	/*
+	 * Output:
+	 * The `user_cookie` passed to `GXP_MAILBOX_COMMAND` for the command
+	 * this response is for. 0 if the command was sent with one of the
+	 * legacy mailbox command IOCTLs.
+	 */
+	__u64 user_cookie;
 };
 
 /*
@@ -557,7 +840,24 @@ struct gxp_mailbox_response_ioctl {
  * The client must hold a VIRTUAL_DEVICE wakelock.
  */
 #define GXP_MAILBOX_RESPONSE \
-	_IOWR(GXP_IOCTL_BASE, 4, struct gxp_mailbox_response_ioctl)
+	_IOWR(GXP_IOCTL_BASE, 29, struct gxp_mailbox_response_ioctl)
+
+/*
+ * Legacy "mailbox response" IOCTL that does not return user cookies.
+ * This IOCTL exists for backwards compatibility with older runtimes. All
+ * fields, other than the unsupported `user_cookie`, are the same as in
+ * `struct gxp_mailbox_response_ioctl`.
+ */
+struct gxp_mailbox_response_compat_ioctl {
+	__u16 virtual_core_id;
+	__u64 sequence_number;
+	__u16 error_code;
+	__u32 cmd_retval;
+};
+
+/* The client must hold a VIRTUAL_DEVICE wakelock. */
+#define GXP_MAILBOX_RESPONSE_COMPAT \
+	_IOWR(GXP_IOCTL_BASE, 4, struct gxp_mailbox_response_compat_ioctl)
 
 struct gxp_register_mailbox_eventfd_ioctl {
 	/*